@@ -37,6 +37,7 @@ extern "C" {
 #endif /* __KERNEL */
 
 #define BF_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define BF_HUGE_PAGE_SIZE_1G (1024 * 1024 * 1024)
 
 typedef uint64_t bf_phys_addr_t;
 typedef bf_phys_addr_t bf_dma_addr_t;
@@ -46,6 +47,16 @@ typedef int (*bf_dma_bus_map)(int dev_id, uint32_t subdev_id, void *phy_addr,
                               size_t size, void **dma_addr);
 typedef int (*bf_dma_bus_unmap)(int dev_id, uint32_t subdev_id, void *dma_addr,
                                 size_t size);
+/* optional range variants, mapping or unmapping cnt pages of page_size bytes
+ * each in a single call; they take precedence over the per page functions
+ */
+typedef int (*bf_dma_bus_map_range)(int dev_id, uint32_t subdev_id,
+                                    const bf_phys_addr_t *phy_addrs, int cnt,
+                                    size_t page_size,
+                                    bf_dma_addr_t *dma_addrs);
+typedef int (*bf_dma_bus_unmap_range)(int dev_id, uint32_t subdev_id,
+                                      const bf_dma_addr_t *dma_addrs, int cnt,
+                                      size_t page_size);
 
 /**
  * @addtogroup bf_dma-dma
@@ -54,11 +65,20 @@ typedef int (*bf_dma_bus_unmap)(int dev_id, uint32_t subdev_id, void *dma_addr,
 
 #define BF_SYS_DMA_POOL_MAX 21
 
+/* numa nodes known to the dma pools */
+#define BF_SYS_DMA_NUMA_NODE_MAX 16
+#define BF_SYS_DMA_NUMA_NODE_ANY (-1)
+
 /**
  * dma pool id type abstraction
  */
 typedef void *bf_sys_dma_pool_handle_t;
 
+/**
+ * dma arena id type abstraction
+ */
+typedef void *bf_sys_dma_arena_handle_t;
+
 /**
  * dma data direction
  */
@@ -68,19 +88,221 @@ typedef enum {
   BF_DMA_BI_DIRECTIONAL
 } bf_sys_dma_dir_t;
 
+/**
+ * dma pool creation attributes
+ */
+typedef struct bf_sys_dma_pool_attr_s {
+  /* depth of the per-thread magazine caching free buffers in front of the
+   * pool, 0 disables the magazines. A thread's alloc/free calls only touch
+   * the shared pool when its magazine runs empty or full, and then move
+   * half a magazine worth of buffers at a time.
+   */
+  int mag_depth;
+  /* size of the huge pages backing the pool, BF_HUGE_PAGE_SIZE (the default
+   * when 0) or BF_HUGE_PAGE_SIZE_1G. A pool asking for 1GB pages falls back
+   * to 2MB pages when no 1GB pages are available.
+   */
+  size_t page_size;
+  /* numa node to bind the pool's huge pages to, BF_SYS_DMA_NUMA_NODE_ANY
+   * (the default) applies no memory policy
+   */
+  int numa_node;
+  /* most buffers the pool grows to, 0 (the default) for a fixed size pool.
+   * An elastic pool maps more huge pages when its freelist runs dry, as many
+   * as it started out with at a time; its buffers must fit in a huge page.
+   */
+  int max_cnt;
+  /* 1 to back the pool with a file named after the pool on a hugetlbfs
+   * mount of its page size. Creating a pool of the same name and geometry
+   * again, e.g. after a restart, re-attaches to the file's huge pages and
+   * freelist instead of faulting in and zeroing new ones; the buffers
+   * allocated at the time stay allocated. The file outlives the pool until
+   * bf_sys_dma_pool_remove. Persistent pools are of a fixed size and their
+   * buffers must fit in a huge page.
+   */
+  int persistent;
+  /* 1 to make the pool persistent and let other processes create the pool
+   * of the same name and geometry and attach to it while it is in use. The
+   * pool metadata, freelist and huge page table live in the pool's file, so
+   * that all the attached processes allocate and free the same buffers lock
+   * free, each at its own virtual address, and see the same dma addresses.
+   * Only the first process to attach bus maps the pages and only the last
+   * one to detach bus unmaps them.
+   */
+  int shared;
+  /* threads faulting in the pool's huge pages in parallel at creation, 0
+   * (the default) or 1 for the calling thread only
+   */
+  int populate_threads;
+  /* 1 to leave the pool's huge pages unpopulated until the first allocation
+   * from the pool, which then populates and bus maps them. Pools carved out
+   * of the init reservation or with buffers larger than a huge page are
+   * never cold.
+   */
+  int cold;
+  /* 1 to give each buffer a reference count, set to 1 on allocation. More
+   * owners take references with bf_sys_dma_buf_ref and each drops its
+   * reference with bf_sys_dma_buf_unref or bf_sys_dma_free; the buffer goes
+   * back to the pool with the last one. Persistent and shared pools cannot
+   * be reference counted.
+   */
+  int refcnt;
+} bf_sys_dma_pool_attr_t;
+
+/**
+ * dma library init attributes
+ */
+typedef struct bf_sys_dma_lib_attr_s {
+  /* bytes of huge page memory to reserve at init, 0 for no reservation.
+   * Pools are carved out of the reservation while it has room, sharing
+   * its single mapping and bus mapping, and get huge pages of their own
+   * otherwise.
+   */
+  size_t reserve_size;
+  /* size of the reserved huge pages, BF_HUGE_PAGE_SIZE (the default when 0)
+   * or BF_HUGE_PAGE_SIZE_1G
+   */
+  size_t page_size;
+  /* numa node to bind the reservation to, BF_SYS_DMA_NUMA_NODE_ANY (the
+   * default) applies no memory policy
+   */
+  int numa_node;
+  /* device the reservation is bus mapped for, only pools of that device
+   * are carved out of it
+   */
+  int dev_id;
+  uint32_t subdev_id;
+  /* threads faulting in the reserved huge pages in parallel, 0 (the
+   * default) or 1 for the calling thread only
+   */
+  int populate_threads;
+} bf_sys_dma_lib_attr_t;
+
+/**
+ * dma pool geometry and placement
+ */
+typedef struct bf_sys_dma_pool_info_s {
+  char name[64];    /* pool name */
+  size_t buf_size;  /* size of each buffer, after alignment */
+  int buf_cnt;      /* number of buffer slots in the pool */
+  size_t page_size; /* size of the huge pages backing the pool */
+  int num_pages;    /* number of huge pages backing the pool */
+  int numa_node;    /* numa node asked for at pool creation */
+  /* number of the pool's huge pages found on each numa node */
+  int numa_pages[BF_SYS_DMA_NUMA_NODE_MAX];
+  int carved;      /* 1 if the pool was carved out of the init reservation */
+  int max_buf_cnt; /* most buffers the pool grows to */
+  int restored;    /* 1 if a persistent pool re-attached to its file or a
+                      shared pool attached to the one of another process */
+  int cold;        /* 1 while a cold pool's pages are not populated yet */
+  uint64_t create_usec; /* microseconds spent creating the pool */
+  uint64_t warm_usec;   /* microseconds spent populating a cold pool */
+  int page_bufs; /* buffers packed in each huge page, 0 if the buffers are
+                    laid out back to back */
+  size_t map_size; /* bytes of huge pages taken by the pool */
+  /* buffer bytes per 1000 bytes of huge pages taken by the pool */
+  int efficiency;
+} bf_sys_dma_pool_info_t;
+
+/**
+ * dma pool usage counters
+ */
+typedef struct bf_sys_dma_pool_stats_s {
+  uint64_t allocs;      /* buffers allocated */
+  uint64_t frees;       /* buffers freed */
+  uint64_t in_use;      /* buffers allocated and not freed */
+  uint64_t alloc_fails; /* allocations that found the pool empty */
+  uint64_t cached;      /* free buffers cached in per-thread magazines */
+  /* most buffers taken from the pool at a time, counting the free ones
+   * cached in magazines
+   */
+  uint64_t taken_hwm;
+  /* attempts at updating the pool's lock-free freelist that lost the race
+   * to another thread and had to be retried
+   */
+  uint64_t cas_retries;
+  /* frees rejected as double frees or of pointers that are not buffers of
+   * the pool
+   */
+  uint64_t bad_frees;
+  int buf_cnt;      /* number of buffer slots in the pool */
+  int num_pages;    /* number of huge pages backing the pool */
+  size_t page_size; /* size of the huge pages backing the pool */
+} bf_sys_dma_pool_stats_t;
+
+/**
+ * dma descriptor ring handle
+ */
+typedef void *bf_sys_dma_ring_handle_t;
+
+/* ring flag, the ring has more than one producer thread */
+#define BF_SYS_DMA_RING_F_MP 0x1
+
+/**
+ * dma descriptor ring geometry and addresses
+ */
+typedef struct bf_sys_dma_ring_info_s {
+  uint32_t slot_cnt;              /* number of slots */
+  uint32_t slot_size;             /* size of each slot */
+  void *slots_v_addr;             /* virtual address of the slot array */
+  bf_phys_addr_t slots_phys_addr; /* physical address of the slot array */
+  bf_dma_addr_t slots_dma_addr;   /* dma address of the slot array */
+  /* dma addresses of the producer index, below which slots are filled, and
+   * of the consumer index, below which slots are consumed
+   */
+  bf_dma_addr_t prod_idx_dma_addr;
+  bf_dma_addr_t cons_idx_dma_addr;
+} bf_sys_dma_ring_info_t;
+
+/**
+ * scatter-gather list entry, a range contiguous in dma address space
+ */
+typedef struct bf_sys_dma_sg_s {
+  bf_dma_addr_t dma_addr; /* dma address of the start of the range */
+  size_t len;             /* length of the range in bytes */
+} bf_sys_dma_sg_t;
+
+/* called for each live pool by bf_sys_dma_pool_iterate, returns non-zero to
+ * stop the iteration
+ */
+typedef int (*bf_sys_dma_pool_iter_fn)(bf_sys_dma_pool_handle_t hndl,
+                                       const char *pool_name, void *cookie);
+
 /* register the static dma bus map functions
  */
 void bf_sys_dma_map_fn_register(bf_dma_bus_map fn1, bf_dma_bus_unmap fn2);
 
+/* register the dma bus map functions that map all the pages of a pool in
+ * one call, NULL to go back to the per page functions
+ */
+void bf_sys_dma_map_range_fn_register(bf_dma_bus_map_range fn1,
+                                      bf_dma_bus_unmap_range fn2);
+
+/**
+ * Initialize DMA library init attributes with the defaults
+ * @param attr attributes to initialize
+ * @return none
+ */
+void bf_sys_dma_lib_attr_init(bf_sys_dma_lib_attr_t *attr);
+
 /**
  * Perform platform specific initialization for DMA memory mgmt
  * @param param1 plaform specific parameter
  * @param param2 plaform specific parameter
- * @param param3 plaform specific parameter
+ * @param param3 optional bf_sys_dma_lib_attr_t to reserve huge page memory
+ *  for the pools up front, NULL for none
  * @return Status 0 on Success, -1 on failure
+ *
+ *  Bus map functions must be registered before the reservation is made.
  */
 int bf_sys_dma_lib_init(void *param1, void *param2, void *param3);
 
+/**
+ * Release the huge page memory reserved at init
+ * @return Status 0 on Success, -1 if pools carved out of it still exist
+ */
+int bf_sys_dma_lib_fini(void);
+
 /**
  * Create a DMA memory pool
  * @param pool_name name of the pool
@@ -96,6 +318,77 @@ int bf_sys_dma_pool_create(char *pool_name, bf_sys_dma_pool_handle_t *hndl,
                            int dev_id, uint32_t subdv_id, size_t size, int cnt,
                            unsigned align);
 
+/**
+ * Initialize DMA memory pool attributes to their defaults
+ * @param attr attributes to initialize
+ * @return none
+ */
+void bf_sys_dma_pool_attr_init(bf_sys_dma_pool_attr_t *attr);
+
+/**
+ * Create a DMA memory pool with creation attributes
+ * @param pool_name name of the pool
+ * @param hndl returns pool handle for future pool operations
+ * @param dev_id bf device id
+ * @param subdev_id bf subdevice id
+ * @param size size in bytes of each buffer in the pool
+ * @param cnt number of buffer count in pool
+ * @param align pool alignment must be power of 2
+ * @param attr pool attributes, NULL for the defaults
+ * @return Status 0 on Success, -1 on failure
+ */
+int bf_sys_dma_pool_create_ext(char *pool_name, bf_sys_dma_pool_handle_t *hndl,
+                               int dev_id, uint32_t subdev_id, size_t size,
+                               int cnt, unsigned align,
+                               const bf_sys_dma_pool_attr_t *attr);
+
+/**
+ * Get the geometry and placement of a DMA memory pool
+ * @param hndl pool handle
+ * @param info returns the pool information
+ * @return Status 0 on Success, -1 on failure
+ */
+int bf_sys_dma_pool_info_get(bf_sys_dma_pool_handle_t hndl,
+                             bf_sys_dma_pool_info_t *info);
+
+/**
+ * Get the usage counters of a DMA memory pool
+ * @param hndl pool handle
+ * @param stats returns the pool counters
+ * @return Status 0 on Success, -1 on failure
+ *
+ *  The counters are not a consistent snapshot while the pool is in use.
+ */
+int bf_sys_dma_pool_stats_get(bf_sys_dma_pool_handle_t hndl,
+                              bf_sys_dma_pool_stats_t *stats);
+
+/**
+ * Call a function for each live DMA memory pool, newest first
+ * @param fn function to call, must not create or destroy pools
+ * @param cookie passed to fn
+ * @return number of pools fn was called for
+ */
+int bf_sys_dma_pool_iterate(bf_sys_dma_pool_iter_fn fn, void *cookie);
+
+/**
+ * Return the buffers cached in the calling thread's magazine to the pool.
+ * Threads that stop using a pool with magazines should call this so that
+ * the buffers they cached become available to the other threads.
+ * @param hndl pool handle
+ * @return none
+ */
+void bf_sys_dma_pool_mag_flush(bf_sys_dma_pool_handle_t hndl);
+
+/**
+ * Return the fully free huge pages at the end of an elastic DMA memory pool
+ * to the system; the pool keeps the pages it was created with
+ * @param hndl pool handle
+ * @return number of huge pages returned, -1 on failure
+ *
+ *  Buffers cached in magazines are not free, flush them first.
+ */
+int bf_sys_dma_pool_shrink(bf_sys_dma_pool_handle_t hndl);
+
 /**
  * Destroy a DMA memory pool
  * @param hndl pool handle
@@ -103,6 +396,14 @@ int bf_sys_dma_pool_create(char *pool_name, bf_sys_dma_pool_handle_t *hndl,
  */
 void bf_sys_dma_pool_destroy(bf_sys_dma_pool_handle_t hndl);
 
+/**
+ * Remove the hugetlbfs file of a persistent DMA memory pool, releasing its
+ * huge pages once no process maps them any more
+ * @param pool_name name of the pool
+ * @return Status 0 on Success, -1 if there is no such file
+ */
+int bf_sys_dma_pool_remove(char *pool_name);
+
 /**
  * Given the virtual address return the physical address
  * @param virtaddr virtual address of the buffer
@@ -110,6 +411,20 @@ void bf_sys_dma_pool_destroy(bf_sys_dma_pool_handle_t hndl);
  */
 bf_phys_addr_t bf_mem_virt2phy(const void *virtaddr);
 
+/**
+ * Given a virtual address range return the physical addresses of the pages
+ * in it. The pagemap entries of the whole range are read in bulk rather than
+ * page by page.
+ * @param virtaddr virtual address of the first page
+ * @param stride distance in bytes between the pages to translate, must be a
+ *   multiple of the system page size (e.g. BF_HUGE_PAGE_SIZE)
+ * @param cnt number of pages to translate
+ * @param phys_addrs array of cnt entries returning the physical addresses
+ * @return Status 0 on Success, -1 on failure
+ */
+int bf_mem_virt2phy_range(const void *virtaddr, size_t stride, int cnt,
+                          bf_phys_addr_t *phys_addrs);
+
 /**
  * Given the virtual address return the physical IO bus address
  * by using DMA mapping
@@ -126,6 +441,26 @@ bf_dma_addr_t bf_mem_virt2dma(const void *virtaddr);
  */
 void *bf_mem_dma2virt(bf_sys_dma_pool_handle_t hndl, bf_dma_addr_t dma_addr);
 
+/**
+ * Find the pool a physical IO bus address of a device belongs to, without
+ * knowing the pool, through an index of the huge pages of all live pools.
+ * Safe to call while other threads create and destroy pools; the pool
+ * handle returned is only good for as long as the caller keeps the pool
+ * from being destroyed. A range whose bus addresses another pool of the
+ * same device already has is not found.
+ * @param dev_id device the pool was created for
+ * @param subdev_id subdevice the pool was created for
+ * @param dma_addr physical IO bus address
+ * @param hndl returns the handle of the pool, may be NULL
+ * @param v_addr returns the virtual address of dma_addr, may be NULL
+ * @param index returns the logical index of the buffer holding dma_addr, -1
+ *  if it is not within a buffer of the pool; may be NULL
+ * @return Status 0 on Success, -1 if dma_addr is not in any pool
+ */
+int bf_sys_dma_lookup(int dev_id, uint32_t subdev_id, bf_dma_addr_t dma_addr,
+                      bf_sys_dma_pool_handle_t *hndl, void **v_addr,
+                      int *index);
+
 /**
  * Allocate a buffer from a DMA memory pool
  * @param hndl pool handle
@@ -137,6 +472,31 @@ void *bf_mem_dma2virt(bf_sys_dma_pool_handle_t hndl, bf_dma_addr_t dma_addr);
 int bf_sys_dma_alloc(bf_sys_dma_pool_handle_t hndl, size_t size, void **v_addr,
                      bf_phys_addr_t *phys_addr);
 
+/**
+ * Allocate a burst of buffers from a DMA memory pool
+ * @param hndl pool handle
+ * @param cnt number of buffers to allocate
+ * @param v_addrs array of cnt entries returning the buffers' virtual addresses
+ * @param phys_addrs array of cnt entries returning the buffers' physical
+ *   addresses
+ * @return Status 0 on Success, -1 on failure. Either all cnt buffers are
+ *   allocated or none is.
+ *
+ *  The pool freelist is taken once for the whole burst.
+ */
+int bf_sys_dma_alloc_bulk(bf_sys_dma_pool_handle_t hndl, int cnt,
+                          void **v_addrs, bf_phys_addr_t *phys_addrs);
+
+/**
+ * Free a burst of buffers into a DMA memory pool
+ * @param hndl pool handle
+ * @param cnt number of buffers to free
+ * @param v_addrs array of cnt virtual addresses of buffers in the pool
+ * @return none
+ */
+void bf_sys_dma_free_bulk(bf_sys_dma_pool_handle_t hndl, int cnt,
+                          void **v_addrs);
+
 /**
  * get the physical address from the cached values of a DMA memory pool
  * @param hndl pool handle
@@ -152,6 +512,21 @@ int bf_sys_dma_alloc(bf_sys_dma_pool_handle_t hndl, size_t size, void **v_addr,
 int bf_sys_dma_get_phy_addr_from_pool(bf_sys_dma_pool_handle_t hndl,
                                       void *v_addr, bf_phys_addr_t *phy_addr);
 
+/**
+ * Split a virtual address range of a pool into the fewest ranges contiguous
+ * in dma address space, for a multi-buffer dma descriptor. Huge pages that
+ * follow each other in dma address space are merged into one range.
+ * @param hndl pool handle
+ * @param v_addr start of the range, within the pool's huge pages
+ * @param len length of the range in bytes
+ * @param sg returns the scatter-gather list
+ * @param max number of entries sg has room for
+ * @return number of entries filled in, -1 if the range is not within the
+ *  pool or needs more than max entries
+ */
+int bf_sys_dma_sg_build(bf_sys_dma_pool_handle_t hndl, void *v_addr,
+                        size_t len, bf_sys_dma_sg_t *sg, int max);
+
 /**
  * Allocate a buffer from a DMA memory pool
  * @param hndl pool handle
@@ -171,6 +546,24 @@ int bf_sys_dma_buffer_index(bf_sys_dma_pool_handle_t hndl, void *v_addr);
  */
 void bf_sys_dma_free(bf_sys_dma_pool_handle_t hndl, void *v_addr);
 
+/**
+ * Take another reference to an allocated buffer of a reference counted pool
+ * @param hndl pool handle
+ * @param v_addr virtual address of a buffer in the pool
+ * @return Status 0 on Success, -1 if the pool is not reference counted or the
+ *  buffer is not allocated
+ */
+int bf_sys_dma_buf_ref(bf_sys_dma_pool_handle_t hndl, void *v_addr);
+
+/**
+ * Drop a reference to a buffer of a reference counted pool, freeing the
+ * buffer with the last reference; same as bf_sys_dma_free
+ * @param hndl pool handle
+ * @param v_addr virtual address of a buffer in the pool
+ * @return none
+ */
+void bf_sys_dma_buf_unref(bf_sys_dma_pool_handle_t hndl, void *v_addr);
+
 /* convenient wrapper API if one needs just one buffer in the pool */
 /**
  * Allocate a single buffer DMA memory pool
@@ -195,6 +588,122 @@ int bf_sys_dma_buffer_alloc(char *pool_name, bf_sys_dma_pool_handle_t *hndl,
  */
 void bf_sys_dma_buffer_free(bf_sys_dma_pool_handle_t hndl, void *v_addr);
 
+/**
+ * Create a DMA memory arena for variable size allocations. The arena draws
+ * 2MB chunks of DMA memory from a pool of its own as needed and splits them
+ * with a buddy allocator.
+ * @param arena_name name of the arena
+ * @param hndl returns arena handle for future arena operations
+ * @param dev_id bf device id
+ * @param subdev_id bf subdevice id
+ * @param size maximum size in bytes of DMA memory the arena may use
+ * @param attr attributes of the backing pool, NULL for the defaults
+ * @return Status 0 on Success, -1 on failure
+ */
+int bf_sys_dma_arena_create(char *arena_name, bf_sys_dma_arena_handle_t *hndl,
+                            int dev_id, uint32_t subdev_id, size_t size,
+                            const bf_sys_dma_pool_attr_t *attr);
+
+/**
+ * Destroy a DMA memory arena along with all the buffers allocated from it
+ * @param hndl arena handle
+ * @return none
+ */
+void bf_sys_dma_arena_destroy(bf_sys_dma_arena_handle_t hndl);
+
+/**
+ * Allocate a variable size buffer from a DMA memory arena
+ * @param hndl arena handle
+ * @param size size in bytes of the buffer, at most BF_HUGE_PAGE_SIZE
+ * @param align alignment of the buffer, must be power of 2
+ * @param phys_addr returns the physical address of the buffer
+ * @return virtual address of the buffer, NULL on failure
+ *
+ *  Buffers are physically contiguous. Sizes are rounded up to a power of 2
+ *  of at least 64 bytes.
+ */
+void *bf_sys_dma_malloc(bf_sys_dma_arena_handle_t hndl, size_t size,
+                        size_t align, bf_phys_addr_t *phys_addr);
+
+/**
+ * Free a variable size buffer into a DMA memory arena
+ * @param hndl arena handle
+ * @param v_addr virtual address of a buffer allocated from the arena
+ * @return none
+ */
+void bf_sys_dma_mfree(bf_sys_dma_arena_handle_t hndl, void *v_addr);
+
+/**
+ * Create a lock-free ring of fixed size slots, e.g. dma descriptors, in one
+ * buffer of a DMA memory pool. The buffer holds the producer and the
+ * consumer index, each on a cache line of its own, followed by the slot
+ * array; the indices are 32 bit counters that wrap, a slot's position in the
+ * array is its index modulo the slot count. The ring has a single consumer
+ * and a single producer, or any number of producers with
+ * BF_SYS_DMA_RING_F_MP.
+ * @param pool pool to take the ring buffer from, its buffers must be 64 byte
+ *   aligned and hold 128 bytes plus the slot array
+ * @param slot_cnt number of slots, a power of 2 of at least 2
+ * @param slot_size size in bytes of each slot
+ * @param flags BF_SYS_DMA_RING_F_xxx
+ * @param hndl returns ring handle for future ring operations
+ * @return Status 0 on Success, -1 on failure
+ */
+int bf_sys_dma_ring_create(bf_sys_dma_pool_handle_t pool, uint32_t slot_cnt,
+                           uint32_t slot_size, int flags,
+                           bf_sys_dma_ring_handle_t *hndl);
+
+/**
+ * Destroy a ring and free its buffer into the pool
+ * @param hndl ring handle
+ * @return none
+ */
+void bf_sys_dma_ring_destroy(bf_sys_dma_ring_handle_t hndl);
+
+/**
+ * Get the geometry and the addresses of a ring, for a device or another
+ * process consuming it
+ * @param hndl ring handle
+ * @param info returns the ring info
+ * @return Status 0 on Success, -1 on failure
+ */
+int bf_sys_dma_ring_info_get(bf_sys_dma_ring_handle_t hndl,
+                             bf_sys_dma_ring_info_t *info);
+
+/**
+ * Copy slots into a ring, as many as there is room for
+ * @param hndl ring handle
+ * @param slots array of cnt slots
+ * @param cnt number of slots to enqueue
+ * @return number of slots enqueued
+ */
+uint32_t bf_sys_dma_ring_enqueue_burst(bf_sys_dma_ring_handle_t hndl,
+                                       const void *slots, uint32_t cnt);
+
+/**
+ * Copy slots out of a ring, as many as it holds; single consumer only
+ * @param hndl ring handle
+ * @param slots returns up to cnt slots
+ * @param cnt number of slots to dequeue
+ * @return number of slots dequeued
+ */
+uint32_t bf_sys_dma_ring_dequeue_burst(bf_sys_dma_ring_handle_t hndl,
+                                       void *slots, uint32_t cnt);
+
+/**
+ * Number of filled slots in a ring
+ * @param hndl ring handle
+ * @return number of slots enqueued and not dequeued
+ */
+uint32_t bf_sys_dma_ring_count(bf_sys_dma_ring_handle_t hndl);
+
+/**
+ * Number of free slots in a ring
+ * @param hndl ring handle
+ * @return number of slots that can be enqueued
+ */
+uint32_t bf_sys_dma_ring_free_count(bf_sys_dma_ring_handle_t hndl);
+
 /**
  * bus map a dma buffer
  * @param hndl pool handle to which the buffer belongs
@@ -208,6 +717,25 @@ void bf_sys_dma_buffer_free(bf_sys_dma_pool_handle_t hndl, void *v_addr);
  *
  * this function is meant to dynamically bus map a buffer. Static mapping
  * is implemented as part of bf_sys_dma_pool_create()
+ *
+ * cpu_vaddr may also point to caller owned memory outside of the pool, for
+ * zero-copy dma; phys_addr is ignored then. The memory's pages are locked
+ * with mlock, looked up and bus mapped for the pool's device. They must be
+ * physically contiguous unless a range map function is registered with
+ * bf_sys_dma_map_range_fn_register, which gets the physical address of
+ * each page. Every such mapping must be undone with bf_sys_dma_unmap of
+ * the same range and direction. The last few unmapped ranges stay mapped so
+ * that mapping them again is cheap, until bf_sys_dma_map_cache_flush; a
+ * range found mapped is not looked up again, so memory must not be released
+ * or remapped before the flush.
+ *
+ * mlock keeps the pages resident but does not pin them for dma: the kernel
+ * may still migrate locked pages, e.g. for compaction while
+ * vm.compact_unevictable_allowed is 1. Pinning the pages for as long as
+ * they are bus mapped is up to the driver behind the registered map
+ * functions, as vfio does. Pages are munlocked as the last mapping covering
+ * them is released, including pages the caller had locked itself, which
+ * the caller has to lock again if needed.
  */
 int bf_sys_dma_map(bf_sys_dma_pool_handle_t hndl, const void *cpu_vaddr,
                    const bf_phys_addr_t phys_addr, size_t size,
@@ -220,7 +748,8 @@ int bf_sys_dma_map(bf_sys_dma_pool_handle_t hndl, const void *cpu_vaddr,
  * @param size size in bytes of each buffer in the pool to unmap, must not be
  *   greater than the buffer size
  * @param direction data DMA direction
- * @return Status 0 on Success, -1 on failure
+ * @return Status 0 on Success, -1 on failure, including caller owned memory
+ *   that is not mapped with bf_sys_dma_map for this range and direction
  *
  * this function is meant to dynamically bus unmap a buffer. Static unmapping
  * is implemented as part of bf_sys_dma_pool_destroy()
@@ -228,6 +757,35 @@ int bf_sys_dma_map(bf_sys_dma_pool_handle_t hndl, const void *cpu_vaddr,
 int bf_sys_dma_unmap(bf_sys_dma_pool_handle_t hndl, const void *cpu_vaddr,
                      size_t size, bf_sys_dma_dir_t direction);
 
+/**
+ * Unpin and bus unmap the caller owned memory kept mapped by
+ * bf_sys_dma_unmap; call before releasing memory that was bus mapped
+ * @return none
+ */
+void bf_sys_dma_map_cache_flush(void);
+
+/**
+ * Copy into a dma buffer the cpu does not read again, e.g. a table image,
+ * with streaming stores that bypass the cpu caches; memcpy semantics. The
+ * widest vector instructions the cpu supports are used, plain memcpy for
+ * short copies and on other architectures.
+ * @param dst destination in a dma buffer
+ * @param src source
+ * @param len length in bytes to copy
+ * @return dst
+ */
+void *bf_sys_dma_copy_to_dev(void *dst, const void *src, size_t len);
+
+/**
+ * Copy out of a dma buffer with streaming loads, which keep the buffer out
+ * of the cpu caches where it is mapped write combining; memcpy semantics
+ * @param dst destination
+ * @param src source in a dma buffer
+ * @param len length in bytes to copy
+ * @return dst
+ */
+void *bf_sys_dma_copy_from_dev(void *dst, const void *src, size_t len);
+
 /**
  * cache flush a buffer
  * @param cpu_vaddr  pointer to virtual address of buffer
@@ -25,23 +25,107 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <mntent.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
 #include <target-sys/bf_sal/bf_sys_dma.h>
 #include <target-sys/bf_sal/bf_sys_mem.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 #define BF_INVALID_PHY_ADDR ((bf_phys_addr_t)(0xFFFFFFFFFFFFFFFFULL))
 #define BF_INVALID_DMA_ADDR ((bf_dma_addr_t)(0xFFFFFFFFFFFFFFFFULL))
 
 #define POOL_HDR_SIZE (4 * 1024)
-#define ALIGN_TO_BF_PAGE_SIZE(x)                                               \
-  (((x) + BF_HUGE_PAGE_SIZE - 1) / BF_HUGE_PAGE_SIZE * BF_HUGE_PAGE_SIZE)
+/* attempts at mapping huge pages contiguous enough for multi-page buffers */
+#define BF_DMA_CONTIG_RETRY_MAX 4
+
+/* memory policy definitions from linux/mempolicy.h, numaif.h is part of
+ * libnuma and may not be installed
+ */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+/* open file description locks from linux/fcntl.h, visible in fcntl.h only
+ * with _GNU_SOURCE
+ */
+#ifndef F_OFD_SETLK
+#define F_OFD_SETLK 37
+#endif
+#ifndef F_OFD_SETLKW
+#define F_OFD_SETLKW 38
+#endif
+#define BF_DMA_NODEMASK_LONGS                                                  \
+  ((BF_SYS_DMA_NUMA_NODE_MAX + 8 * sizeof(long) - 1) / (8 * sizeof(long)))
+#define ALIGN_TO_PAGE_SIZE(x, page_size)                                       \
+  (((x) + (page_size)-1) / (page_size) * (page_size))
+
+/* per-thread magazine limits */
+#define BF_DMA_MAG_THREAD_MAX 64
+#define BF_DMA_MAG_DEPTH_MAX 512
+#define BF_DMA_CACHE_LINE_SIZE 64
+/* most threads populating the huge pages of a mapping */
+#define BF_DMA_POPULATE_THREAD_MAX 16
+/* bus mappings of caller owned memory kept mapped once unmapped */
+#define BF_DMA_MAP_CACHE_MAX 64
+/* copies to and from dma buffers shorter than this go through memcpy */
+#define BF_DMA_NT_COPY_MIN 256
+
+/* The pool freelist is a lock-free LIFO of buffer indices. Its head packs a
+ * 32 bit tag, bumped on every update to make the compare-and-swap ABA safe,
+ * with the 32 bit index of the first free buffer. The index of the buffer
+ * following a free buffer is kept in a side array indexed by buffer index.
+ */
+#define BF_DMA_FREE_END 0xFFFFFFFFU
+#define BF_DMA_FREE_HEAD(tag, idx) (((uint64_t)(tag) << 32) | (uint32_t)(idx))
+#define BF_DMA_FREE_TAG(head) ((uint32_t)((head) >> 32))
+#define BF_DMA_FREE_IDX(head) ((uint32_t)(head))
+/* The freelist links are followed by the allocation map, one bit per buffer
+ * set while the buffer is allocated, which catches double frees and frees
+ * of pointers that are not buffers of the pool.
+ */
+#define BF_DMA_ALLOC_MAP_OFFSET(buf_cnt)                                       \
+  ALIGN_TO_PAGE_SIZE((size_t)(buf_cnt) * sizeof(uint32_t), sizeof(uint64_t))
+#define BF_DMA_FREE_LINKS_SIZE(buf_cnt)                                        \
+  (BF_DMA_ALLOC_MAP_OFFSET(buf_cnt) +                                         \
+   ((size_t)(buf_cnt) + 63) / 64 * sizeof(uint64_t))
+
+/* persistent pools live in hugetlbfs files named after the pool */
+#define BF_DMA_FILE_PREFIX "bf_dma_"
+#define BF_DMA_FILE_MAGIC 0x6266646d61706f6fULL
+#define BF_DMA_FILE_VERSION 3
+/* bytes of a pool's file locked to serialize attaching and detaching, and
+ * held shared by every attached pool
+ */
+#define BF_DMA_FILE_LOCK_SETUP 0
+#define BF_DMA_FILE_LOCK_ATTACH 1
+/* offset of the huge page dma address table, after the freelist links and
+ * the allocation map
+ */
+#define BF_DMA_FILE_TBL_OFFSET(buf_cnt)                                        \
+  (sizeof(bf_dma_file_hdr_t) + BF_DMA_FREE_LINKS_SIZE(buf_cnt))
 
 /**
  * huge_page info including the virtual and physical IO bus addresses
@@ -51,8 +135,151 @@ typedef struct {
   void *base_virt_addr;        /* virtual address of the huge page */
 } bf_huge_page_info_t;
 
-/* data structures */
+/**
+ * entry of the reverse (dma to virtual) lookup index of a pool, sorted by
+ * dma address
+ */
+typedef struct {
+  bf_dma_addr_t base_dma_addr; /* physical IO bus address of the huge page */
+  uint32_t page;               /* index of the page in huge_page_info_ptr */
+} bf_dma_index_t;
+
+/**
+ * reverse lookup index of a pool; an elastic pool replaces its index as it
+ * grows and shrinks, keeping the replaced ones until the pool is destroyed
+ * since lookups may still be using them
+ */
+typedef struct bf_dma_index_tbl_s {
+  struct bf_dma_index_tbl_s *prev; /* index replaced by this one */
+  int cnt;                         /* number of huge pages indexed */
+  bf_dma_index_t ent[];            /* huge pages sorted by dma address */
+} bf_dma_index_tbl_t;
+
+/**
+ * entry of the global reverse lookup index over all pools, a run of a pool's
+ * huge pages contiguous in both dma and virtual address space. Bus addresses
+ * are per device behind an iommu, so runs are keyed by device first.
+ */
+typedef struct {
+  uint64_t dev;                /* device and subdevice, see bf_dma_lookup_dev */
+  bf_dma_addr_t base_dma_addr; /* physical IO bus address of the run */
+  bf_dma_addr_t len;           /* length of the run in bytes */
+  uint8_t *base_virt_addr;     /* virtual address of the run */
+  struct bf_huge_pool_s *pool; /* pool of the run, NULL once taken out */
+} bf_dma_lookup_ent_t;
+
+/**
+ * global reverse lookup index, replaced as pools come, grow, shrink and go
+ */
+typedef struct {
+  int cnt;                   /* number of runs */
+  bf_dma_lookup_ent_t ent[]; /* runs sorted by device and dma address */
+} bf_dma_lookup_tbl_t;
+
+/**
+ * lookup in progress on a thread slot, on a cache line of its own so that
+ * lookups on other threads do not contend for it
+ */
+typedef struct {
+  uint64_t epoch; /* epoch the lookup started under, 0 if none */
+} __attribute__((aligned(BF_DMA_CACHE_LINE_SIZE))) bf_dma_lookup_reader_t;
+
+/**
+ * per-thread magazine, a small stack of free buffer pointers owned by a
+ * single thread; it is refilled from and spilled to the pool LIFO in batches
+ */
+typedef struct {
+  int cnt;         /* number of buffers currently cached */
+  void *raw;       /* unaligned allocation backing this magazine */
+  uint64_t allocs; /* buffers allocated by the owning thread */
+  uint64_t frees;  /* buffers freed by the owning thread */
+  void *bufs[];    /* cached buffer pointers, mag_depth entries */
+} bf_dma_mag_t;
+
+/**
+ * pool usage counters, on cache lines of their own. Threads with a magazine
+ * count their allocations and frees in it instead, and count buffers taken
+ * only as the magazine is refilled or spilled.
+ */
+typedef struct {
+  uint64_t allocs;      /* buffers allocated without a magazine */
+  uint64_t frees;       /* buffers freed without a magazine */
+  uint64_t alloc_fails; /* allocations that found the pool empty */
+  uint64_t cas_retries; /* freelist compare-and-swap attempts that lost */
+  uint64_t bad_frees;   /* double frees and frees of foreign pointers */
+  /* buffers off the freelist, including the ones cached in magazines; it
+   * goes negative as buffers allocated before a persistent pool was
+   * restored are freed
+   */
+  int64_t taken;
+  /* high-water mark of taken, mostly read, apart from the counters written
+   * on every call
+   */
+  int64_t taken_hwm __attribute__((aligned(BF_DMA_CACHE_LINE_SIZE)));
+} __attribute__((aligned(BF_DMA_CACHE_LINE_SIZE))) bf_dma_pool_cnt_t;
+
+/**
+ * huge page memory reserved at library init for pools to be carved out of;
+ * pools are placed at POOL_HDR_SIZE (4K) granularity
+ */
 typedef struct {
+  uint8_t *base;     /* start of the reserved huge page mapping */
+  size_t size;       /* size of the reserved huge page mapping */
+  size_t page_size;  /* size of the reserved huge pages */
+  int page_shift;    /* log2 of page_size */
+  int numa_node;     /* numa node the pages are bound to, -1 if none */
+  int dev_id;        /* device the reservation is bus mapped for */
+  uint32_t subdev_id;
+  bf_huge_page_info_t *huge_page_info; /* reserved huge pages, bus mapped
+                                          once for all the pools */
+  uint64_t *unit_map; /* one bit per 4K unit, set if carved out */
+  size_t unit_cnt;    /* number of 4K units in the reservation */
+  int pool_cnt;       /* number of pools carved out of the reservation */
+  pthread_mutex_t lock;
+} bf_dma_rsv_t;
+
+/**
+ * bus mapping of caller owned memory by bf_sys_dma_map. The pages of the
+ * range stay pinned and bus mapped after the last bf_sys_dma_unmap, until
+ * the mapping is evicted as the least recently used one.
+ */
+typedef struct bf_dma_map_ent_s {
+  struct bf_dma_map_ent_s *prev, *next; /* most recently used first */
+  int dev_id;                           /* device the range is mapped for */
+  uint32_t subdev_id;
+  uintptr_t vaddr;             /* start of the range */
+  size_t len;                  /* length of the range */
+  bf_sys_dma_dir_t dir;        /* direction the range is mapped for */
+  uintptr_t pin_start;         /* start of the pinned pages */
+  size_t pin_len;              /* length of the pinned pages */
+  bf_dma_addr_t dma_addr;      /* bus address of pin_start */
+  int users;                   /* outstanding bf_sys_dma_map calls */
+  bf_phys_addr_t phys_addrs[]; /* physical address of each pinned page */
+} bf_dma_map_ent_t;
+
+/**
+ * metadata at the start of a persistent pool's hugetlbfs file, on pages of
+ * its own in front of the buffers' pages; the freelist links and the
+ * allocation map follow it, then the dma addresses of the buffers' huge
+ * pages. Buffers are referred to by index only, so every process attached to
+ * the file can use the metadata wherever it has the file mapped.
+ */
+typedef struct {
+  uint64_t magic;               /* BF_DMA_FILE_MAGIC once initialized */
+  uint32_t version;             /* BF_DMA_FILE_VERSION */
+  uint32_t hdr_offset;          /* offset of the first buffer */
+  uint64_t page_size;           /* size of the huge pages */
+  uint64_t buf_size;            /* stride of the buffers */
+  int32_t buf_cnt;              /* number of buffers */
+  int32_t page_cnt;             /* number of huge pages of the buffers */
+  int32_t shared;               /* 1 if processes may attach concurrently */
+  int32_t page_bufs;            /* buffers packed in each huge page */
+  volatile uint64_t free_head;  /* {tag, index} of the first free buffer */
+  uint32_t free_next[];         /* next free buffer index, by buffer index */
+} bf_dma_file_hdr_t;
+
+/* data structures */
+typedef struct bf_huge_pool_s {
   int pool_inited;     /* 0 if pool is not initialized */
   int pool_id;         /* pool id */
   size_t hdr_size;     /* reserved header size for pool allocation */
@@ -60,40 +287,277 @@ typedef struct {
   uint8_t *buf_start;  /* starting address of buffers within the pool */
   int buf_cnt;         /* number of buffers in pool */
   size_t buf_size;     /* size of eachbuffer in pool */
+  int buf_shift;       /* log2 of buf_size, -1 if not a power of 2 */
+  uint64_t buf_recip;  /* 2^64 / buf_size rounded up, to divide by buf_size */
+  int page_bufs; /* buffers packed in each huge page, 0 if the buffers are
+                    laid out back to back */
+  uint64_t page_bufs_recip; /* 2^64 / page_bufs rounded up, 0 for 1 */
   int alignment;       /* application's alignment requirement */
-  void **pool_buf_ptr; /* pointer to queue of buf pointers */
-  volatile uint32_t
-      pool_buf_offset; /* position of current head into the above queue */
+  uint32_t *free_next; /* next free buffer index, indexed by buffer index */
+  uint64_t *alloc_map; /* bit set for each allocated buffer, after the links */
+  uint32_t *refcnt;    /* buffer reference counts, by buffer index; NULL if
+                          the pool is not reference counted */
+  volatile uint64_t *free_head; /* {tag, index} of the first free buffer */
+  volatile uint64_t local_free_head; /* free_head of a pool kept in process
+                                        memory */
   bf_phys_addr_t base_phy_addr; /* physical address of first buffer of pool */
-  volatile int pool_gate;       /* assist for atomic operation */
   char name[64];                /* pool name */
   bf_huge_page_info_t *huge_page_info_ptr; /* an array of huge page pointers */
   int num_huge_pages; /* number of huge pages allocated for the DMA memory pool
                        */
+  size_t page_size; /* size of the huge pages backing the pool */
+  int page_shift;   /* log2 of page_size */
+  int numa_node;    /* numa node the pages are bound to, -1 if none */
+  int numa_pages[BF_SYS_DMA_NUMA_NODE_MAX]; /* huge pages found on each numa
+                                               node */
   unsigned int pool_hdr_offset; /* offset to be added so that no buffer spills
                                    over from the physical page */
+  void *map_base;  /* start of the huge page mapping */
+  size_t map_size; /* size of the huge page mapping */
+  int carved; /* 1 if the pages belong to the init reservation, map_base and
+                 map_size are then the range carved out of it */
+  int dma_contig; /* 1 if the huge pages are contiguous in dma address space
+                     in the same order as in the virtual address space */
+  bf_dma_index_tbl_t *dma_index; /* huge pages sorted by dma address, used
+                                    when the pool is not dma contiguous */
   int fd;     /* file handle of bf device for dma bus mapping */
   int dev_id; /* device id that the pool belongs to */
   uint32_t
       subdev_id; /* subdev_id (within the device id) that the pool belongs to */
+  int mag_depth; /* per-thread magazine depth, 0 if magazines are disabled */
+  int mag_batch; /* number of buffers moved on magazine refill/spill */
+  bf_dma_mag_t *mags[BF_DMA_MAG_THREAD_MAX]; /* magazines by thread slot */
+  int max_cnt;    /* most buffers an elastic pool grows to */
+  int max_pages;  /* huge pages reserved for an elastic pool to grow into */
+  int base_pages; /* huge pages an elastic pool never shrinks below */
+  int grow_pages; /* huge pages mapped per growth, 0 for a fixed size pool */
+  pthread_mutex_t grow_lock; /* serializes growing and shrinking */
+  bf_dma_file_hdr_t *file_hdr; /* metadata of a persistent pool, mapped in
+                                  front of map_base; NULL otherwise */
+  size_t file_size;            /* size of a persistent pool's file */
+  int file_fd; /* persistent pool's file, locked for as long as attached */
+  int restored; /* 1 if a persistent pool was found in its file */
+  int populate_threads; /* threads populating the pool's huge pages */
+  int cold; /* 1 until the pages of a cold pool are populated, at the first
+               allocation */
+  uint64_t create_usec; /* time spent creating the pool */
+  uint64_t warm_usec;   /* time spent populating a cold pool */
+  bf_dma_pool_cnt_t cnt; /* usage counters */
+  struct bf_huge_pool_s *next; /* next pool in the list of live pools */
 } bf_huge_pool_t;
 
+/* set up the division of buffer offsets by buf_size, see bf_dma_buf_idx */
+static void bf_dma_buf_div_init(bf_huge_pool_t *pool) {
+  if (pool->buf_size == 0) {
+    /* a pool of empty buffers, all at index 0 */
+    pool->buf_shift = 63;
+    return;
+  }
+  pool->buf_shift = (pool->buf_size & (pool->buf_size - 1))
+                        ? -1
+                        : __builtin_ctzl(pool->buf_size);
+  pool->buf_recip = UINT64_MAX / pool->buf_size + 1;
+  pool->page_bufs_recip = pool->page_bufs ? UINT64_MAX / pool->page_bufs + 1
+                                          : 0;
+}
+
+/* n / d for 32 bit n, given the reciprocal of d from bf_dma_buf_div_init */
+static inline size_t bf_dma_div32(size_t n, uint64_t recip) {
+  return (size_t)(((unsigned __int128)n * recip) >> 64);
+}
+
+/**
+ * Map an offset from the start of the buffers to a buffer index: a shift for
+ * power of 2 buffer sizes, a multiply by the precomputed reciprocal for
+ * offsets under 4G (exact for 32 bit dividends, see Lemire et al., "Faster
+ * Remainder by Direct Computation") and a plain division otherwise
+ */
+static inline size_t bf_dma_buf_idx(const bf_huge_pool_t *pool, size_t delta) {
+  if (pool->buf_shift >= 0) {
+    return delta >> pool->buf_shift;
+  }
+  if (delta <= UINT32_MAX) {
+    return bf_dma_div32(delta, pool->buf_recip);
+  }
+  return delta / pool->buf_size;
+}
+
+/* map an offset from the start of the buffers to the index of the buffer
+ * slot holding it, taking the unused tail of packed pages into account
+ */
+static inline size_t bf_dma_slot_idx(const bf_huge_pool_t *pool,
+                                     size_t delta) {
+  if (pool->page_bufs) {
+    return (delta >> pool->page_shift) * pool->page_bufs +
+           bf_dma_buf_idx(pool, delta & (pool->page_size - 1));
+  }
+  return bf_dma_buf_idx(pool, delta);
+}
+
+/* offset of a buffer slot from the start of the buffers */
+static inline size_t bf_dma_slot_off(const bf_huge_pool_t *pool, size_t idx) {
+  size_t page;
+
+  if (pool->page_bufs) {
+    /* 2^64 does not fit the reciprocal of a single buffer per page */
+    page = pool->page_bufs == 1 ? idx
+                                : bf_dma_div32(idx, pool->page_bufs_recip);
+    return (page << pool->page_shift) +
+           (idx - page * pool->page_bufs) * pool->buf_size;
+  }
+  return idx * pool->buf_size;
+}
+
 static bf_dma_bus_map bf_sys_dma_map_fn = NULL;
 static bf_dma_bus_unmap bf_sys_dma_unmap_fn = NULL;
+static bf_dma_bus_map_range bf_sys_dma_map_range_fn = NULL;
+static bf_dma_bus_unmap_range bf_sys_dma_unmap_range_fn = NULL;
+
+/* huge page memory reserved by bf_sys_dma_lib_init, NULL if none */
+static bf_dma_rsv_t *bf_dma_rsv = NULL;
+
+/* bus mappings of caller owned memory and the number of unused ones */
+static bf_dma_map_ent_t *bf_dma_map_list = NULL;
+static int bf_dma_map_idle = 0;
+static pthread_mutex_t bf_dma_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* live pools, for bf_sys_dma_pool_iterate */
+static bf_huge_pool_t *bf_dma_pool_list = NULL;
+static pthread_mutex_t bf_dma_pool_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* reverse lookup index over all pools and the lookups in progress, by
+ * thread slot, and for threads without a slot under each of the two
+ * alternating epochs. The epoch starts at 2 as 0 marks an idle slot.
+ */
+static bf_dma_lookup_tbl_t *bf_dma_lookup_tbl = NULL;
+static pthread_mutex_t bf_dma_lookup_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t bf_dma_lookup_epoch = 2;
+static uint32_t bf_dma_lookup_readers[2] = {0, 0};
+static bf_dma_lookup_reader_t bf_dma_lookup_slots[BF_DMA_MAG_THREAD_MAX];
+
+/* thread slots for magazines and lookups; a slot is owned by one live thread
+ * at a time and is released when that thread exits. Magazines left behind by
+ * an exiting thread are inherited by the next thread that claims the same
+ * slot.
+ */
+static pthread_once_t bf_dma_mag_once = PTHREAD_ONCE_INIT;
+static pthread_key_t bf_dma_mag_key;
+static volatile uint64_t bf_dma_mag_slot_map = 0;
+static __thread int bf_dma_mag_slot = -1;
 
 void bf_sys_dma_map_fn_register(bf_dma_bus_map fn1, bf_dma_bus_unmap fn2) {
   bf_sys_dma_map_fn = fn1;
   bf_sys_dma_unmap_fn = fn2;
 }
 
-/**
- * Platform specific init for dma memory mgmt
- * param1 : register function pointer that provides bus mapping services
+void bf_sys_dma_map_range_fn_register(bf_dma_bus_map_range fn1,
+                                      bf_dma_bus_unmap_range fn2) {
+  bf_sys_dma_map_range_fn = fn1;
+  bf_sys_dma_unmap_range_fn = fn2;
+}
+
+static void bf_dma_mag_slot_release(void *arg) {
+  int slot = (int)((uintptr_t)arg - 1);
+
+  __sync_fetch_and_and(&bf_dma_mag_slot_map, ~(1ULL << slot));
+}
+
+static void bf_dma_mag_key_create(void) {
+  pthread_key_create(&bf_dma_mag_key, bf_dma_mag_slot_release);
+}
+
+/* claim a magazine slot for the calling thread, returns
+ * BF_DMA_MAG_THREAD_MAX if all the slots are in use
  */
-int bf_sys_dma_lib_init(void *param1, void *param2, void *param3) {
-  (void)param1;
-  (void)param2;
-  (void)param3;
+static int bf_dma_mag_slot_get(void) {
+  uint64_t map;
+  int slot;
+
+  if (bf_dma_mag_slot >= 0) {
+    return bf_dma_mag_slot;
+  }
+  pthread_once(&bf_dma_mag_once, bf_dma_mag_key_create);
+  do {
+    map = bf_dma_mag_slot_map;
+    if (map == ~0ULL) {
+      /* do not cache the failure, a slot may be released later */
+      return BF_DMA_MAG_THREAD_MAX;
+    }
+    slot = __builtin_ctzll(~map);
+  } while (__sync_val_compare_and_swap(
+               &bf_dma_mag_slot_map, map, map | (1ULL << slot)) != map);
+  pthread_setspecific(bf_dma_mag_key, (void *)(uintptr_t)(slot + 1));
+  bf_dma_mag_slot = slot;
+  return slot;
+}
+
+/* pagemap entries read per pread() when translating a range */
+#define BF_PAGEMAP_CHUNK_ENTRIES (128 * 1024)
+/* the pfn (page frame number) are bits 0-54 (see pagemap.txt in linux
+ * Documentation)
+ */
+#define BF_PAGEMAP_PFN_MASK 0x7fffffffffffffULL
+
+/* /proc/self/pagemap is kept open across translations */
+static volatile int bf_pagemap_fd = -1;
+static pthread_once_t bf_pagemap_once = PTHREAD_ONCE_INIT;
+
+/* a forked child must not read its parent's pagemap through the inherited
+ * descriptor
+ */
+static void bf_pagemap_atfork_child(void) {
+  if (bf_pagemap_fd >= 0) {
+    close(bf_pagemap_fd);
+    bf_pagemap_fd = -1;
+  }
+}
+
+static void bf_pagemap_atfork_register(void) {
+  pthread_atfork(NULL, NULL, bf_pagemap_atfork_child);
+}
+
+static int bf_pagemap_fd_get(void) {
+  int fd = bf_pagemap_fd;
+
+  if (fd >= 0) {
+    return fd;
+  }
+  pthread_once(&bf_pagemap_once, bf_pagemap_atfork_register);
+  fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    printf("%s(): cannot open /proc/self/pagemap: %s\n", __func__,
+           strerror(errno));
+    return -1;
+  }
+  /* another thread may have raced us to it, keep only one descriptor */
+  if (!__sync_bool_compare_and_swap(&bf_pagemap_fd, -1, fd)) {
+    close(fd);
+    fd = bf_pagemap_fd;
+  }
+  return fd;
+}
+
+/* read cnt pagemap entries starting at virtual page frame virt_pfn */
+static int bf_pagemap_read(unsigned long virt_pfn, uint64_t *entries,
+                           size_t cnt) {
+  size_t len = cnt * sizeof(uint64_t), done = 0;
+  off_t offset = (off_t)(virt_pfn * sizeof(uint64_t));
+  ssize_t ret;
+  int fd;
+
+  fd = bf_pagemap_fd_get();
+  if (fd < 0) {
+    return -1;
+  }
+  while (done < len) {
+    ret = pread(fd, (char *)entries + done, len - done, offset + done);
+    if (ret <= 0) {
+      printf("%s(): cannot read /proc/self/pagemap: %s\n", __func__,
+             ret ? strerror(errno) : "short read");
+      return -1;
+    }
+    done += ret;
+  }
   return 0;
 }
 
@@ -103,48 +567,86 @@ int bf_sys_dma_lib_init(void *param1, void *param2, void *param3) {
  *
  */
 bf_phys_addr_t bf_mem_virt2phy(const void *virtaddr) {
-  int fd;
   uint64_t page, phys_addr;
   unsigned long virt_pfn;
   int page_size;
-  off_t offset;
 
   /* standard page size */
   page_size = getpagesize();
 
-  fd = open("/proc/self/pagemap", O_RDONLY);
-  if (fd < 0) {
-    printf("%s(): cannot open /proc/self/pagemap: %s\n", __func__,
-           strerror(errno));
-    return BF_INVALID_PHY_ADDR;
-  }
-
   virt_pfn = (unsigned long)virtaddr / page_size;
-  offset = sizeof(uint64_t) * virt_pfn;
-  if (lseek(fd, offset, SEEK_SET) == (off_t)-1) {
-    printf("%s(): seek error in /proc/self/pagemap: %s\n", __func__,
-           strerror(errno));
-    close(fd);
-    return BF_INVALID_PHY_ADDR;
-  }
-
-  if (read(fd, &page, sizeof(uint64_t)) < 0) {
-    printf("%s(): cannot read /proc/self/pagemap: %s\n", __func__,
-           strerror(errno));
-    close(fd);
+  if (bf_pagemap_read(virt_pfn, &page, 1)) {
     return BF_INVALID_PHY_ADDR;
   }
 
-  /*
-   * the pfn (page frame number) are bits 0-54 (see
-   * pagemap.txt in linux Documentation)
-   */
-  phys_addr = ((page & 0x7fffffffffffffULL) * page_size) +
+  phys_addr = ((page & BF_PAGEMAP_PFN_MASK) * page_size) +
               ((unsigned long)virtaddr % page_size);
-  close(fd);
   return (bf_phys_addr_t)phys_addr;
 }
 
+/*
+ * Get the physical addresses of cnt consecutive pages of stride bytes
+ * starting at virtaddr, reading the pagemap entries of the whole range
+ * in as few reads as possible.
+ *
+ */
+int bf_mem_virt2phy_range(const void *virtaddr, size_t stride, int cnt,
+                          bf_phys_addr_t *phys_addrs) {
+  uint64_t *entries;
+  unsigned long virt_pfn, first_pfn, last_pfn;
+  size_t page_size, chunk;
+  int i = 0;
+
+  assert(phys_addrs);
+  if (cnt <= 0) {
+    return cnt == 0 ? 0 : -1;
+  }
+  page_size = getpagesize();
+  if (stride == 0 || stride % page_size) {
+    return -1;
+  }
+  first_pfn = (unsigned long)virtaddr / page_size;
+  last_pfn = first_pfn + (cnt - 1) * (stride / page_size);
+  chunk = last_pfn - first_pfn + 1;
+  if (chunk > BF_PAGEMAP_CHUNK_ENTRIES) {
+    chunk = BF_PAGEMAP_CHUNK_ENTRIES;
+  }
+  entries = bf_sys_malloc(chunk * sizeof(uint64_t));
+  if (entries == NULL) {
+    return -1;
+  }
+
+  virt_pfn = first_pfn;
+  while (i < cnt) {
+    /* entries for the pages up to the end of this chunk */
+    size_t n = last_pfn - virt_pfn + 1;
+    if (n > chunk) {
+      n = chunk;
+    }
+    if (bf_pagemap_read(virt_pfn, entries, n)) {
+      bf_sys_free(entries);
+      return -1;
+    }
+    while (i < cnt) {
+      unsigned long pfn = first_pfn + i * (stride / page_size);
+      if (pfn >= virt_pfn + n) {
+        break;
+      }
+      phys_addrs[i] =
+          (entries[pfn - virt_pfn] & BF_PAGEMAP_PFN_MASK) * page_size +
+          ((unsigned long)virtaddr % page_size);
+      i++;
+    }
+    virt_pfn += n;
+    /* skip over the pages in between the translated ones */
+    if (i < cnt) {
+      virt_pfn = first_pfn + i * (stride / page_size);
+    }
+  }
+  bf_sys_free(entries);
+  return 0;
+}
+
 /*
  * Get the physical IO bus address of any mapped virtual address
  * in the current process
@@ -178,56 +680,197 @@ static uint32_t conv_to_next_aligned(uint32_t val, uint32_t alignment) {
   }
 }
 
-static void *alloc_huge_pages(size_t size, unsigned int header_offset) {
+/* monotonic time in microseconds */
+static uint64_t bf_dma_usec_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * slice of a huge page mapping populated by one thread
+ */
+typedef struct {
+  uint8_t *ptr;     /* start of the slice */
+  size_t size;      /* size of the slice, whole huge pages */
+  size_t page_size; /* size of the huge pages */
+  int ret;          /* 0 once populated, -1 on failure */
+} bf_dma_populate_slice_t;
+
+static void *bf_dma_populate_slice(void *arg) {
+  bf_dma_populate_slice_t *slice = (bf_dma_populate_slice_t *)arg;
+  size_t off;
+
+  slice->ret = 0;
+  if (madvise(slice->ptr, slice->size, MADV_POPULATE_WRITE) == 0) {
+    return NULL;
+  }
+  if (errno != EINVAL) {
+    /* out of huge pages on the bound node */
+    slice->ret = -1;
+    return NULL;
+  }
+  /* older kernels, fault the pages in by hand; reading leaves the contents
+   * of a persistent pool's pages alone
+   */
+  for (off = 0; off < slice->size; off += slice->page_size) {
+    (void)((volatile uint8_t *)slice->ptr)[off];
+  }
+  return NULL;
+}
+
+/**
+ * Fault in (allocate and zero) the huge pages of a mapping, splitting it
+ * into slices of whole pages populated by up to threads threads in parallel,
+ * the calling thread taking one of them.
+ * @return Status 0 on Success, -1 on failure
+ */
+static int bf_dma_populate(void *ptr, size_t size, size_t page_size,
+                           int threads) {
+  bf_dma_populate_slice_t slices[BF_DMA_POPULATE_THREAD_MAX];
+  pthread_t tids[BF_DMA_POPULATE_THREAD_MAX];
+  size_t pages = size / page_size, per_slice;
+  int i, started, ret = 0;
+
+  if (threads > BF_DMA_POPULATE_THREAD_MAX) {
+    threads = BF_DMA_POPULATE_THREAD_MAX;
+  }
+  if ((size_t)threads > pages) {
+    threads = pages ? (int)pages : 1;
+  }
+  per_slice = (pages + threads - 1) / threads;
+  for (i = 0; i < threads; i++) {
+    size_t first = i * per_slice;
+    size_t cnt = first + per_slice <= pages ? per_slice : pages - first;
+
+    slices[i].ptr = (uint8_t *)ptr + first * page_size;
+    slices[i].size = cnt * page_size;
+    slices[i].page_size = page_size;
+  }
+  /* slices whose thread cannot be started are done by the calling thread */
+  for (started = 1; started < threads; started++) {
+    if (pthread_create(&tids[started], NULL, bf_dma_populate_slice,
+                       &slices[started])) {
+      break;
+    }
+  }
+  for (i = started; i < threads; i++) {
+    bf_dma_populate_slice(&slices[i]);
+  }
+  bf_dma_populate_slice(&slices[0]);
+  for (i = 1; i < started; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  for (i = 0; i < threads; i++) {
+    ret |= slices[i].ret;
+  }
+  return ret;
+}
+
+/**
+ * Bind a not yet populated huge page mapping to a numa node.
+ * A hugetlb page fault that cannot be served from the bound node raises
+ * SIGBUS, so the pages are only strictly bound when the kernel can populate
+ * them with MADV_POPULATE_WRITE, which reports the failure instead. Older
+ * kernels get the node as a preference.
+ */
+static int bf_dma_numa_bind(void *ptr, size_t size, int numa_node) {
+  unsigned long nodemask[BF_DMA_NODEMASK_LONGS] = {0};
+  int populate_write;
+
+  nodemask[numa_node / (8 * sizeof(long))] |=
+      1UL << (numa_node % (8 * sizeof(long)));
+  /* zero length advice only checks that the kernel knows the advice */
+  populate_write = madvise(ptr, 0, MADV_POPULATE_WRITE) == 0;
+  if (syscall(SYS_mbind, ptr, size,
+              populate_write ? MPOL_BIND : MPOL_PREFERRED, nodemask,
+              8 * sizeof(nodemask), 0)) {
+    printf("%s(): cannot bind to numa node %d: %s\n", __func__, numa_node,
+           strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* map huge pages, at addr in place of whatever is mapped there if addr is
+ * not NULL, and from the hugetlbfs file fd if fd is not -1. The pages are
+ * populated by threads threads, or left to be faulted in later if threads
+ * is 0.
+ */
+static void *alloc_huge_pages(void *addr, int fd, size_t size,
+                              unsigned int header_offset, size_t page_size,
+                              int numa_node, int threads, size_t *map_size) {
   size_t actual_size;
   char *ptr;
-  actual_size = ALIGN_TO_BF_PAGE_SIZE(size + header_offset);
-  ptr = (char *)mmap(NULL, actual_size, PROT_READ | PROT_WRITE,
-                     MAP_SHARED | MAP_ANONYMOUS | MAP_POPULATE | MAP_HUGETLB |
-                         (21 << MAP_HUGE_SHIFT),
-                     -1, 0);
-  if (ptr == MAP_FAILED) {
+  /* pages bound to a numa node are populated after binding, and pages
+   * populated in parallel by the threads
+   */
+  int populate = numa_node < 0 && threads == 1 ? MAP_POPULATE : 0;
+  int fixed = addr ? MAP_FIXED : 0;
+  actual_size = ALIGN_TO_PAGE_SIZE(size + header_offset, page_size);
+  if (fd >= 0) {
+    ptr = (char *)mmap(addr, actual_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | populate | fixed, fd, 0);
+  } else {
+    ptr = (char *)mmap(addr, actual_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS | populate | fixed |
+                           MAP_HUGETLB |
+                           (__builtin_ctzl(page_size) << MAP_HUGE_SHIFT),
+                       -1, 0);
+  }
+  if (ptr == MAP_FAILED && fd < 0 && page_size == BF_HUGE_PAGE_SIZE) {
     // If 2MB failed, retry with default size
-    ptr = (char *)mmap(NULL, actual_size, PROT_READ | PROT_WRITE,
-                       MAP_SHARED | MAP_ANONYMOUS | MAP_POPULATE | MAP_HUGETLB,
+    ptr = (char *)mmap(addr, actual_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS | populate | fixed |
+                           MAP_HUGETLB,
                        -1, 0);
   }
   if (ptr == MAP_FAILED) {
     return NULL;
   }
+  if ((numa_node >= 0 && bf_dma_numa_bind(ptr, actual_size, numa_node)) ||
+      (!populate && threads &&
+       bf_dma_populate(ptr, actual_size, page_size, threads))) {
+    munmap(ptr, actual_size);
+    return NULL;
+  }
   /* Save actual_size since mmunmap() requires a size parameter */
-  *((size_t *)ptr) = actual_size;
-  /* Skip the page with metadata and offset*/
-  return (ptr + header_offset);
+  *map_size = actual_size;
+  return ptr;
 }
 
-/* free "ALL" huge pages belonging to a dma pool */
-static void free_huge_pages(int dev_id, uint32_t subdev_id,
-                            bf_huge_page_info_t *base_huge_page, void *ptr,
-                            unsigned int header_offset) {
-  void *huge_ptr;
-  size_t actual_size;
+/* bus unmap cnt huge pages through the registered bus map services, for
+ * iommu-enabled platforms
+ */
+static void bf_dma_bus_unmap_pages(int dev_id, uint32_t subdev_id,
+                                   bf_huge_page_info_t *base_huge_page,
+                                   int cnt, size_t page_size) {
   int i;
 
-  if (ptr == NULL) {
-    return;
-  }
-  /* Jump back to the page with metadata */
-  huge_ptr = (char *)ptr - header_offset;
+  if (bf_sys_dma_unmap_range_fn) {
+    bf_dma_addr_t *dma_addrs = bf_sys_calloc(cnt, sizeof(bf_dma_addr_t));
 
-  /* Get the original allocation size */
-  actual_size = *((size_t *)huge_ptr);
-  assert(actual_size != 0);
-  assert(actual_size % BF_HUGE_PAGE_SIZE == 0);
-  /* call static bus map services thru registered function to unmap bus address
-   * for iommu-enabled platforms
-   */
-  if (bf_sys_dma_unmap_fn) {
+    if (dma_addrs == NULL) {
+      printf("error allocating the dma unmap range\n");
+      assert(0);
+    }
+    for (i = 0; i < cnt; i++) {
+      dma_addrs[i] = base_huge_page[i].base_dma_addr;
+    }
+    if (bf_sys_dma_unmap_range_fn(dev_id, subdev_id, dma_addrs, cnt,
+                                  page_size)) {
+      printf("error in dma unmap ioctl for dma addr %p\n",
+             (void *)(uintptr_t)dma_addrs[0]);
+      assert(0);
+    }
+    bf_sys_free(dma_addrs);
+  } else if (bf_sys_dma_unmap_fn) {
     bf_huge_page_info_t *temp_ptr = base_huge_page;
-    for (i = 0; i < (int)(actual_size / BF_HUGE_PAGE_SIZE); i++) {
+    for (i = 0; i < cnt; i++) {
       if (bf_sys_dma_unmap_fn(dev_id, subdev_id,
                               (void *)(uintptr_t)(temp_ptr->base_dma_addr),
-                              BF_HUGE_PAGE_SIZE)) {
+                              page_size)) {
         printf("error in dma unmap ioctl for dma addr %p\n",
                (void *)(uintptr_t)temp_ptr->base_dma_addr);
         assert(0);
@@ -235,9 +878,52 @@ static void free_huge_pages(int dev_id, uint32_t subdev_id,
       temp_ptr++;
     }
   }
+}
+
+/* free "ALL" huge pages belonging to a dma pool */
+static void free_huge_pages(int dev_id, uint32_t subdev_id,
+                            bf_huge_page_info_t *base_huge_page, void *huge_ptr,
+                            size_t actual_size, size_t page_size) {
+  if (huge_ptr == NULL) {
+    return;
+  }
+  assert(actual_size != 0);
+  assert(actual_size % page_size == 0);
+  /* pages not bus mapped yet have no table */
+  if (base_huge_page) {
+    bf_dma_bus_unmap_pages(dev_id, subdev_id, base_huge_page,
+                           actual_size / page_size, page_size);
+  }
   munmap(huge_ptr, actual_size);
 }
 
+/**
+ * Reserve address space for huge pages to be mapped into later, aligned to
+ * the huge page size. With addr set, the reservation is put back in place
+ * of the pages mapped there.
+ */
+static void *bf_dma_va_reserve(void *addr, size_t size, size_t page_size) {
+  uint8_t *ptr, *aligned;
+
+  if (addr) {
+    ptr = mmap(addr, size, PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+  }
+  ptr = mmap(NULL, size + page_size, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return NULL;
+  }
+  /* trim the excess around the aligned range */
+  aligned = (uint8_t *)ALIGN_TO_PAGE_SIZE((uintptr_t)ptr, page_size);
+  if (aligned != ptr) {
+    munmap(ptr, aligned - ptr);
+  }
+  munmap(aligned + size, ptr + page_size - aligned);
+  return aligned;
+}
+
 #if 0  /* Uncomment if needed */
 /* change the value to current or previous aligned value.
  *
@@ -259,12 +945,16 @@ conv_to_prev_aligned (uint64_t val, uint64_t alignment)
  * @param fd file handle of bf device that provides dma bus mapping services
  * @param ptr virtual address of the first huge page
  * @param cnt number of hugepages in the DMA memory pool
+ * @param page_size size of the hugepages
  */
 static bf_huge_page_info_t *log_virt_dma_addr(int dev_id, uint32_t subdev_id,
-                                              void *ptr, int cnt) {
+                                              void *ptr, int cnt,
+                                              size_t page_size) {
   int i;
   char *huge_ptr = (char *)ptr;
   bf_huge_page_info_t *huge_page;
+  bf_phys_addr_t *phys_addrs;
+  bf_dma_addr_t *dma_addrs = NULL;
 
   /* Create the array of huge page info structures */
   huge_page =
@@ -272,30 +962,121 @@ static bf_huge_page_info_t *log_virt_dma_addr(int dev_id, uint32_t subdev_id,
   if (NULL == huge_page) {
     return NULL;
   }
+  /* Since for the current implementation the physical IO bus address
+     and the physical addresses are the same, translate all the pages in
+     one go */
+  phys_addrs = (bf_phys_addr_t *)bf_sys_calloc(cnt, sizeof(bf_phys_addr_t));
+  if (NULL == phys_addrs ||
+      bf_mem_virt2phy_range(huge_ptr, page_size, cnt, phys_addrs)) {
+    bf_sys_free(phys_addrs);
+    bf_sys_free(huge_page);
+    return NULL;
+  }
+  /* with a range map function registered, bus map all the pages at once */
+  if (bf_sys_dma_map_range_fn) {
+    dma_addrs = (bf_dma_addr_t *)bf_sys_calloc(cnt, sizeof(bf_dma_addr_t));
+    if (NULL == dma_addrs) {
+      bf_sys_free(phys_addrs);
+      bf_sys_free(huge_page);
+      return NULL;
+    }
+    if (bf_sys_dma_map_range_fn(dev_id, subdev_id, phys_addrs, cnt, page_size,
+                                dma_addrs)) {
+      printf("error in dma map ioctl for phy addr %p\n",
+             (void *)(uintptr_t)phys_addrs[0]);
+      assert(0);
+    }
+  }
   /* Initialize the array of pointers */
   for (i = 0; i < cnt; i++) {
-    huge_page[i].base_dma_addr = bf_mem_virt2dma(huge_ptr);
+    huge_page[i].base_dma_addr =
+        dma_addrs ? dma_addrs[i] : (bf_dma_addr_t)phys_addrs[i];
     huge_page[i].base_virt_addr = (void *)huge_ptr;
     /* call registered function to map physical to bus address if iommu
      * is enabled, and, additionally, replace physical address with  bus
      * address
      */
-    if (bf_sys_dma_map_fn) {
+    if (bf_sys_dma_map_fn && !dma_addrs) {
       /* replace the phy address with bus address returned by the kernel */
       if (bf_sys_dma_map_fn(
               dev_id, subdev_id, (void *)(uintptr_t)huge_page[i].base_dma_addr,
-              BF_HUGE_PAGE_SIZE, (void **)&(huge_page[i].base_dma_addr))) {
+              page_size, (void **)&(huge_page[i].base_dma_addr))) {
         printf("error in dma map ioctl for phy addr %p\n",
                (void *)(uintptr_t)huge_page[i].base_dma_addr);
         assert(0);
       }
     }
-    huge_ptr += BF_HUGE_PAGE_SIZE;
+    huge_ptr += page_size;
   }
 
+  bf_sys_free(phys_addrs);
+  bf_sys_free(dma_addrs);
   return huge_page;
 }
 
+static int bf_dma_index_cmp(const void *a, const void *b) {
+  bf_dma_addr_t x = ((const bf_dma_index_t *)a)->base_dma_addr;
+  bf_dma_addr_t y = ((const bf_dma_index_t *)b)->base_dma_addr;
+
+  return (x > y) - (x < y);
+}
+
+/**
+ * Build the reverse lookup index of a pool. Pools whose huge pages are laid
+ * out back to back in dma address space are looked up by plain offset
+ * arithmetic, the others through a binary search of their pages sorted by
+ * dma address. Once a pool has an index it keeps one, a new index replaces
+ * it as an elastic pool grows or shrinks.
+ * @param dma_pool pool with its huge page table set up
+ * @param num_huge_pages number of huge pages to index
+ * @return Status 0 on Success, -1 on failure
+ */
+static int bf_dma_index_build(bf_huge_pool_t *dma_pool, int num_huge_pages) {
+  bf_huge_page_info_t *huge_page_info = dma_pool->huge_page_info_ptr;
+  bf_dma_index_tbl_t *index;
+  int i, contig = 1;
+
+  for (i = 1; i < num_huge_pages; i++) {
+    if (huge_page_info[i].base_dma_addr !=
+        huge_page_info[0].base_dma_addr +
+            ((bf_dma_addr_t)i << dma_pool->page_shift)) {
+      contig = 0;
+      break;
+    }
+  }
+  if (contig && dma_pool->dma_index == NULL) {
+    dma_pool->dma_contig = 1;
+    return 0;
+  }
+
+  index = bf_sys_calloc(1, sizeof(bf_dma_index_tbl_t) +
+                               num_huge_pages * sizeof(bf_dma_index_t));
+  if (index == NULL) {
+    return -1;
+  }
+  for (i = 0; i < num_huge_pages; i++) {
+    index->ent[i].base_dma_addr = huge_page_info[i].base_dma_addr;
+    index->ent[i].page = i;
+  }
+  qsort(index->ent, num_huge_pages, sizeof(bf_dma_index_t), bf_dma_index_cmp);
+  index->cnt = num_huge_pages;
+  index->prev = dma_pool->dma_index;
+  /* lookups switch over to the index once it is complete */
+  __atomic_store_n(&dma_pool->dma_index, index, __ATOMIC_RELEASE);
+  __atomic_store_n(&dma_pool->dma_contig, 0, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static void bf_dma_index_free(bf_dma_index_tbl_t *index) {
+  bf_dma_index_tbl_t *prev;
+
+  while (index) {
+    prev = index->prev;
+    bf_sys_free(index);
+    index = prev;
+  }
+}
+
 /**
  * Given the physical IO bus address return the virtual address and
  * @param hndl DMA memory pool handle
@@ -303,32 +1084,1325 @@ static bf_huge_page_info_t *log_virt_dma_addr(int dev_id, uint32_t subdev_id,
  */
 void *bf_mem_dma2virt(bf_sys_dma_pool_handle_t hndl, bf_dma_addr_t dma_addr) {
   bf_huge_page_info_t *huge_page_info;
-  int num_huge_pages, i;
-  unsigned long virtaddr = 0;
+  bf_dma_index_tbl_t *tbl;
+  bf_dma_index_t *index;
+  bf_dma_addr_t offset;
+  int n, half;
   bf_huge_pool_t *dma_pool = (bf_huge_pool_t *)hndl;
 
   assert(dma_pool);
 
   huge_page_info = dma_pool->huge_page_info_ptr;
-  num_huge_pages = dma_pool->num_huge_pages;
+  /* the pages an elastic pool grows by are published by num_huge_pages,
+   * along with the index covering them
+   */
+  n = __atomic_load_n(&dma_pool->num_huge_pages, __ATOMIC_ACQUIRE);
+
+  if (__atomic_load_n(&dma_pool->dma_contig, __ATOMIC_ACQUIRE)) {
+    /* unsigned offset also catches addresses below the pool */
+    offset = dma_addr - huge_page_info[0].base_dma_addr;
+    if (offset >= ((bf_dma_addr_t)n << dma_pool->page_shift)) {
+      return NULL;
+    }
+    return (uint8_t *)huge_page_info[0].base_virt_addr + offset;
+  }
+
+  /* find the last huge page starting at or below dma_addr, branch free so
+   * that random completion addresses do not cost a mispredict per step
+   */
+  tbl = __atomic_load_n(&dma_pool->dma_index, __ATOMIC_ACQUIRE);
+  if (tbl == NULL) {
+    /* a cold pool before its first allocation */
+    return NULL;
+  }
+  index = tbl->ent;
+  n = tbl->cnt;
+  if (n == 0 || dma_addr < index[0].base_dma_addr) {
+    return NULL;
+  }
+  while (n > 1) {
+    half = n / 2;
+    index = (index[half].base_dma_addr <= dma_addr) ? index + half : index;
+    n -= half;
+  }
+  offset = dma_addr - index->base_dma_addr;
+  if (offset >= dma_pool->page_size) {
+    /* Indicates that the given physical address doesn't belong
+       to any of the huge pages in the given DMA memory pool */
+    return NULL;
+  }
+  return (uint8_t *)huge_page_info[index->page].base_virt_addr + offset;
+}
+
+/* keep the replaced global lookup index until no lookup can be using it */
+static void bf_dma_lookup_sync(void) {
+  uint64_t epoch, cur;
+  int i;
+
+  /* wait for the lookups counted under each epoch to finish; new lookups
+   * count under the other epoch meanwhile, so the wait is bounded
+   */
+  for (i = 0; i < 2; i++) {
+    epoch = __atomic_fetch_add(&bf_dma_lookup_epoch, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&bf_dma_lookup_readers[epoch & 1],
+                           __ATOMIC_SEQ_CST)) {
+      sched_yield();
+    }
+  }
+  /* and for the lookups on thread slots started before the last epoch */
+  for (i = 0; i < BF_DMA_MAG_THREAD_MAX; i++) {
+    for (;;) {
+      cur = __atomic_load_n(&bf_dma_lookup_slots[i].epoch, __ATOMIC_SEQ_CST);
+      if (cur == 0 || cur > epoch) {
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+/* lookup index key of a device */
+static inline uint64_t bf_dma_lookup_dev(int dev_id, uint32_t subdev_id) {
+  return (uint64_t)(uint32_t)dev_id << 32 | subdev_id;
+}
+
+static int bf_dma_lookup_cmp(const void *a, const void *b) {
+  const bf_dma_lookup_ent_t *x = a, *y = b;
+
+  if (x->dev != y->dev) {
+    return (x->dev > y->dev) - (x->dev < y->dev);
+  }
+  return (x->base_dma_addr > y->base_dma_addr) -
+         (x->base_dma_addr < y->base_dma_addr);
+}
+
+/**
+ * Replace the entries of a pool in the global reverse lookup index with its
+ * first num_huge_pages huge pages, none to take the pool out of the index.
+ * A pool carved out of the reservation only gets its own range of the
+ * pages it shares with other pools. Runs of the pool whose dma addresses
+ * another pool of the same device already has are left out of the index.
+ * The replaced index is freed once no lookup can be using it.
+ * @param dma_pool pool with its huge page table set up
+ * @param num_huge_pages number of huge pages to index
+ * @return Status 0 on Success, -1 on failure
+ */
+static int bf_dma_lookup_update(bf_huge_pool_t *dma_pool, int num_huge_pages) {
+  bf_huge_page_info_t *huge_page_info = dma_pool->huge_page_info_ptr;
+  bf_dma_lookup_tbl_t *old, *tbl;
+  bf_dma_lookup_ent_t *ent;
+  uint8_t *lo = NULL, *hi = (uint8_t *)UINTPTR_MAX, *start, *end;
+  uint64_t dev = bf_dma_lookup_dev(dma_pool->dev_id, dma_pool->subdev_id);
+  int i, cnt, skipped = 0;
+
+  pthread_mutex_lock(&bf_dma_lookup_lock);
+  old = bf_dma_lookup_tbl;
+  cnt = old ? old->cnt : 0;
+  tbl = bf_sys_calloc(1, sizeof(bf_dma_lookup_tbl_t) +
+                             (cnt + num_huge_pages) *
+                                 sizeof(bf_dma_lookup_ent_t));
+  if (tbl == NULL) {
+    if (num_huge_pages == 0 && old) {
+      /* a pool going away must not be found, take it out in place */
+      for (i = 0; i < cnt; i++) {
+        if (old->ent[i].pool == dma_pool) {
+          __atomic_store_n(&old->ent[i].pool, NULL, __ATOMIC_RELEASE);
+        }
+      }
+      bf_dma_lookup_sync();
+    }
+    pthread_mutex_unlock(&bf_dma_lookup_lock);
+    return -1;
+  }
+  for (i = 0; i < cnt; i++) {
+    if (old->ent[i].pool != dma_pool && old->ent[i].pool != NULL) {
+      tbl->ent[tbl->cnt++] = old->ent[i];
+    }
+  }
+  if (dma_pool->carved) {
+    lo = dma_pool->map_base;
+    hi = dma_pool->map_base + dma_pool->map_size;
+  }
+  /* one entry per run of pages contiguous in both address spaces */
+  for (i = 0, ent = NULL; i < num_huge_pages; i++) {
+    start = huge_page_info[i].base_virt_addr;
+    end = start + dma_pool->page_size;
+    start = start < lo ? lo : start;
+    end = end > hi ? hi : end;
+    if (ent &&
+        ent->base_dma_addr + ent->len == huge_page_info[i].base_dma_addr &&
+        ent->base_virt_addr + ent->len == start) {
+      ent->len += end - start;
+      continue;
+    }
+    ent = &tbl->ent[tbl->cnt++];
+    ent->dev = dev;
+    ent->base_dma_addr = huge_page_info[i].base_dma_addr +
+                         (start - (uint8_t *)huge_page_info[i].base_virt_addr);
+    ent->len = end - start;
+    ent->base_virt_addr = start;
+    ent->pool = dma_pool;
+  }
+  qsort(tbl->ent, tbl->cnt, sizeof(bf_dma_lookup_ent_t), bf_dma_lookup_cmp);
+  /* a dma address must lead to a single pool; the other pools' runs do not
+   * overlap, so each overlap is between a run of this pool and another one
+   */
+  for (i = 0, cnt = 0; i < tbl->cnt; i++) {
+    ent = &tbl->ent[i];
+    if (cnt && tbl->ent[cnt - 1].dev == ent->dev &&
+        tbl->ent[cnt - 1].base_dma_addr + tbl->ent[cnt - 1].len >
+            ent->base_dma_addr) {
+      skipped = 1;
+      if (ent->pool == dma_pool) {
+        continue;
+      }
+      cnt--;
+    }
+    tbl->ent[cnt++] = *ent;
+  }
+  tbl->cnt = cnt;
+  if (skipped) {
+    printf("%s: dma range of pool %s overlaps another pool, not indexed\n",
+           __func__, dma_pool->name);
+  }
+  __atomic_store_n(&bf_dma_lookup_tbl, tbl, __ATOMIC_SEQ_CST);
+  bf_dma_lookup_sync();
+  pthread_mutex_unlock(&bf_dma_lookup_lock);
+  bf_sys_free(old);
+  return 0;
+}
+
+/**
+ *  Find the pool, virtual address and buffer of a dma address
+ */
+int bf_sys_dma_lookup(int dev_id, uint32_t subdev_id, bf_dma_addr_t dma_addr,
+                      bf_sys_dma_pool_handle_t *hndl, void **v_addr,
+                      int *index) {
+  uint64_t dev = bf_dma_lookup_dev(dev_id, subdev_id);
+  bf_dma_lookup_tbl_t *tbl;
+  bf_dma_lookup_ent_t *ent;
+  bf_huge_pool_t *dma_pool;
+  bf_dma_lookup_reader_t *reader = NULL;
+  uint8_t *vaddr;
+  size_t delta, idx;
+  uint64_t epoch;
+  int n, half, slot, ret = -1;
+
+  /* mark the lookup with the current epoch so that the index it uses and
+   * the pool found stay around until it is done; a thread slot's line is
+   * only written by its own thread, the shared counters are the fallback
+   */
+  epoch = __atomic_load_n(&bf_dma_lookup_epoch, __ATOMIC_SEQ_CST);
+  slot = bf_dma_mag_slot_get();
+  if (slot < BF_DMA_MAG_THREAD_MAX) {
+    reader = &bf_dma_lookup_slots[slot];
+    __atomic_store_n(&reader->epoch, epoch, __ATOMIC_SEQ_CST);
+  } else {
+    epoch &= 1;
+    __atomic_fetch_add(&bf_dma_lookup_readers[epoch], 1, __ATOMIC_SEQ_CST);
+  }
+  tbl = __atomic_load_n(&bf_dma_lookup_tbl, __ATOMIC_SEQ_CST);
+  if (tbl == NULL || tbl->cnt == 0) {
+    goto done;
+  }
+  /* last run of the device starting at or below dma_addr, as in
+   * bf_mem_dma2virt
+   */
+  ent = tbl->ent;
+  n = tbl->cnt;
+  while (n > 1) {
+    half = n / 2;
+    ent = (ent[half].dev < dev ||
+           (ent[half].dev == dev && ent[half].base_dma_addr <= dma_addr))
+              ? ent + half
+              : ent;
+    n -= half;
+  }
+  dma_pool = __atomic_load_n(&ent->pool, __ATOMIC_ACQUIRE);
+  if (dma_pool == NULL || ent->dev != dev || dma_addr < ent->base_dma_addr ||
+      dma_addr - ent->base_dma_addr >= ent->len) {
+    goto done;
+  }
+  vaddr = ent->base_virt_addr + (dma_addr - ent->base_dma_addr);
+  /* the buffer holding the address, none for a pool header or the unused
+   * tail of a packed page
+   */
+  slot = -1;
+  if (vaddr >= dma_pool->buf_start) {
+    delta = (size_t)(vaddr - dma_pool->buf_start);
+    idx = bf_dma_slot_idx(dma_pool, delta);
+    if (idx < (size_t)__atomic_load_n(&dma_pool->buf_cnt, __ATOMIC_RELAXED) &&
+        delta - bf_dma_slot_off(dma_pool, idx) < dma_pool->buf_size) {
+      slot = (int)idx;
+    }
+  }
+  if (hndl) {
+    *hndl = (bf_sys_dma_pool_handle_t)dma_pool;
+  }
+  if (v_addr) {
+    *v_addr = vaddr;
+  }
+  if (index) {
+    *index = slot;
+  }
+  ret = 0;
+
+done:
+  if (reader) {
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+  } else {
+    __atomic_fetch_sub(&bf_dma_lookup_readers[epoch], 1, __ATOMIC_RELEASE);
+  }
+  return ret;
+}
+
+/* buffer layout of a pool on its huge pages, see bf_dma_layout */
+typedef struct {
+  size_t stride; /* distance between buffers within a page */
+  int page_bufs; /* buffers packed in each page, 0 if back to back */
+  size_t size;   /* bytes of huge pages taken by the buffers */
+} bf_dma_layout_t;
+
+/**
+ * Lay cnt buffers out on huge pages. No buffer of at most a page straddles
+ * two pages, as the pages are not contiguous in dma address space:
+ *  - a pool fitting in one page has its buffers back to back from the
+ *    start of the page
+ *  - buffers of a power of 2 size, or any size dividing the page size, are
+ *    laid out back to back from the start of the pages
+ *  - other buffers are packed as many to a page as fit, leaving the tail of
+ *    each page unused
+ * Buffers larger than a page take whole pages. The pool's metadata is kept
+ * out of its pages in all cases.
+ */
+static void bf_dma_layout(size_t size, int cnt, size_t page_size,
+                          bf_dma_layout_t *layout) {
+  memset(layout, 0, sizeof(*layout));
+  layout->stride = size;
+  if (size > page_size) {
+    layout->stride = ALIGN_TO_PAGE_SIZE(size, page_size);
+    layout->size = layout->stride * cnt;
+  } else if (size * cnt <= page_size) {
+    layout->size = page_size;
+  } else if (page_size % size == 0) {
+    layout->size = ALIGN_TO_PAGE_SIZE(size * cnt, page_size);
+  } else {
+    layout->page_bufs = page_size / size;
+    layout->size =
+        ((size_t)cnt + layout->page_bufs - 1) / layout->page_bufs * page_size;
+  }
+}
+
+/**
+ * Map the huge pages for slot_cnt buffers of the pool and set up the pool's
+ * huge page table. A pool asking for 1GB pages falls back to 2MB pages.
+ * Buffers larger than a huge page are rounded up to whole pages and start on
+ * a page boundary.
+ * @param dma_pool pool to map the pages for
+ * @param size size of each buffer
+ * @param page_size requested huge page size
+ * @param slot_cnt number of buffer slots to map
+ * @return Status 0 on Success, -1 on failure
+ */
+static int bf_dma_pool_map(bf_huge_pool_t *dma_pool, size_t size,
+                           size_t page_size, int slot_cnt) {
+  bf_dma_layout_t layout;
+  bf_huge_page_info_t *huge_page_info;
+  size_t map_size;
+  void *map_base;
+
+  for (;;) {
+    bf_dma_layout(size, slot_cnt, page_size, &layout);
+    map_base = alloc_huge_pages(NULL, -1, layout.size, 0,
+                                page_size, dma_pool->numa_node,
+                                dma_pool->cold ? 0 : dma_pool->populate_threads,
+                                &map_size);
+    if (map_base != NULL || page_size == BF_HUGE_PAGE_SIZE) {
+      break;
+    }
+    /* no 1GB pages available, fall back to 2MB pages */
+    page_size = BF_HUGE_PAGE_SIZE;
+  }
+  if (map_base == NULL) {
+    return -1;
+  }
+
+  /* maintain the base virtual and physical IO bus addresses of all the
+     huge pages in the dma pool, once populated for a cold pool */
+  huge_page_info =
+      dma_pool->cold
+          ? NULL
+          : log_virt_dma_addr(dma_pool->dev_id, dma_pool->subdev_id, map_base,
+                              map_size / page_size, page_size);
+  if (NULL == huge_page_info && !dma_pool->cold) {
+    free_huge_pages(dma_pool->dev_id, dma_pool->subdev_id, NULL, map_base,
+                    map_size, page_size);
+    return -1;
+  }
+  dma_pool->map_base = map_base;
+  dma_pool->map_size = map_size;
+  dma_pool->pool_hdr_offset = 0;
+  dma_pool->pool_ptr = map_base;
+  /* pool_ptr is huge page aligned, no further alignment necessary */
+  dma_pool->buf_start = dma_pool->pool_ptr;
+  dma_pool->buf_cnt = slot_cnt;
+  dma_pool->buf_size = layout.stride;
+  dma_pool->page_bufs = layout.page_bufs;
+  dma_pool->huge_page_info_ptr = huge_page_info;
+  dma_pool->num_huge_pages = map_size / page_size;
+  dma_pool->page_size = page_size;
+  dma_pool->page_shift = __builtin_ctzl(page_size);
+  return 0;
+}
+
+/**
+ * Build the path of a persistent pool's file on the first writable hugetlbfs
+ * mount of the given page size, any page size if page_size is 0. Slashes in
+ * the pool name are replaced so that the file sits right on the mount.
+ * @return Status 0 on Success, -1 if there is no such mount
+ */
+static int bf_dma_file_path(const char *pool_name, size_t page_size,
+                            char *path, size_t len) {
+  struct mntent *ent;
+  struct statfs sfs;
+  FILE *mnt;
+  char *p;
+  int ret = -1;
+
+  mnt = setmntent("/proc/mounts", "r");
+  if (mnt == NULL) {
+    return -1;
+  }
+  while ((ent = getmntent(mnt)) != NULL) {
+    if (strcmp(ent->mnt_type, "hugetlbfs") || statfs(ent->mnt_dir, &sfs) ||
+        (page_size && (size_t)sfs.f_bsize != page_size) ||
+        access(ent->mnt_dir, W_OK)) {
+      continue;
+    }
+    if (snprintf(path, len, "%s/%s%s", ent->mnt_dir, BF_DMA_FILE_PREFIX,
+                 pool_name) >= (int)len) {
+      break;
+    }
+    for (p = path + strlen(ent->mnt_dir) + 1; *p; p++) {
+      if (*p == '/') {
+        *p = '_';
+      }
+    }
+    ret = 0;
+    break;
+  }
+  endmntent(mnt);
+  return ret;
+}
+
+/* take or test an open file description lock on one byte of a pool's file,
+ * held until released or the file is closed
+ */
+static int bf_dma_file_lock(int fd, short type, off_t byte, int wait) {
+  struct flock fl;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = byte;
+  fl.l_len = 1;
+  return fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+}
+
+/**
+ * Map the huge pages of a persistent pool from a hugetlbfs file named after
+ * the pool. The file holds the pool metadata, the freelist and the huge page
+ * dma address table on pages of its own, followed by the buffers laid out as
+ * for bf_dma_pool_map. An existing file of the same geometry is re-attached
+ * to as is, pages, freelist and all; a new one is sized and initialized, the
+ * magic being written last so that a file left half initialized is
+ * initialized again.
+ * Every attached pool holds a shared lock on the file. The first one to
+ * attach translates and bus maps the pages and publishes their dma
+ * addresses in the file, the others of a shared pool take them from there
+ * so that a dma address means the same buffer in all the processes.
+ * @param dma_pool pool to map the pages for
+ * @param size size of each buffer, at most a huge page
+ * @param page_size requested huge page size
+ * @param cnt number of buffers
+ * @param shared 1 to let other processes attach at the same time
+ * @return Status 0 on Success, -1 on failure
+ */
+static int bf_dma_pool_map_file(bf_huge_pool_t *dma_pool, size_t size,
+                                size_t page_size, int cnt, int shared) {
+  char path[PATH_MAX];
+  bf_dma_file_hdr_t *hdr;
+  bf_huge_page_info_t *huge_page_info;
+  bf_dma_addr_t *dma_tbl;
+  bf_dma_layout_t layout;
+  size_t meta_size, buf_map_size, file_size, map_size;
+  struct stat st;
+  int fd, i, alone, page_cnt;
+
+  for (;;) {
+    if (size > page_size) {
+      return -1;
+    }
+    if (bf_dma_file_path(dma_pool->name, page_size, path, sizeof(path)) == 0) {
+      break;
+    }
+    if (page_size == BF_HUGE_PAGE_SIZE) {
+      printf("No hugetlbfs mount for persistent pool %s\n", dma_pool->name);
+      return -1;
+    }
+    /* no 1GB page mount, fall back to 2MB pages */
+    page_size = BF_HUGE_PAGE_SIZE;
+  }
+  bf_dma_layout(size, cnt, page_size, &layout);
+  buf_map_size = layout.size;
+  page_cnt = buf_map_size / page_size;
+  meta_size = ALIGN_TO_PAGE_SIZE(BF_DMA_FILE_TBL_OFFSET(cnt) +
+                                     page_cnt * sizeof(bf_dma_addr_t),
+                                 page_size);
+  file_size = meta_size + buf_map_size;
+
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    printf("Cannot open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  /* serialize with other processes attaching to or detaching from the same
+   * file; closing the file drops the locks
+   */
+  if (bf_dma_file_lock(fd, F_WRLCK, BF_DMA_FILE_LOCK_SETUP, 1) ||
+      fstat(fd, &st)) {
+    close(fd);
+    return -1;
+  }
+  alone = bf_dma_file_lock(fd, F_WRLCK, BF_DMA_FILE_LOCK_ATTACH, 0) == 0;
+  if (!alone && !shared) {
+    printf("Persistent pool %s is in use by another process\n",
+           dma_pool->name);
+    close(fd);
+    return -1;
+  }
+  /* only a new file is sized, resizing would drop the pages of the pool
+   * kept in it
+   */
+  if ((size_t)st.st_size != file_size &&
+      (st.st_size != 0 || !alone || ftruncate(fd, file_size))) {
+    printf("Persistent pool %s does not match the pool in %s\n",
+           dma_pool->name, path);
+    close(fd);
+    return -1;
+  }
+  hdr = alloc_huge_pages(NULL, fd, file_size, 0, page_size,
+                         dma_pool->numa_node, dma_pool->populate_threads,
+                         &map_size);
+  if (hdr == NULL) {
+    close(fd);
+    return -1;
+  }
+  if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == BF_DMA_FILE_MAGIC) {
+    if (hdr->version != BF_DMA_FILE_VERSION || hdr->page_size != page_size ||
+        hdr->buf_size != size || hdr->buf_cnt != cnt ||
+        hdr->hdr_offset != 0 ||
+        hdr->page_bufs != layout.page_bufs || hdr->page_cnt != page_cnt ||
+        (!alone && !hdr->shared)) {
+      printf("Persistent pool %s does not match the pool in %s\n",
+             dma_pool->name, path);
+      goto error;
+    }
+    dma_pool->restored = 1;
+  } else if (alone) {
+    /* all the buffers start out free, in address order */
+    for (i = 0; i < cnt; i++) {
+      hdr->free_next[i] = i + 1 < cnt ? (uint32_t)(i + 1) : BF_DMA_FREE_END;
+    }
+    hdr->free_head = BF_DMA_FREE_HEAD(0, cnt ? 0 : BF_DMA_FREE_END);
+    hdr->version = BF_DMA_FILE_VERSION;
+    hdr->hdr_offset = 0;
+    hdr->page_bufs = layout.page_bufs;
+    hdr->page_size = page_size;
+    hdr->buf_size = size;
+    hdr->buf_cnt = cnt;
+    hdr->page_cnt = page_cnt;
+    __atomic_store_n(&hdr->magic, BF_DMA_FILE_MAGIC, __ATOMIC_RELEASE);
+  } else {
+    goto error;
+  }
+
+  dma_tbl = (bf_dma_addr_t *)((uint8_t *)hdr + BF_DMA_FILE_TBL_OFFSET(cnt));
+  if (alone) {
+    huge_page_info =
+        log_virt_dma_addr(dma_pool->dev_id, dma_pool->subdev_id,
+                          (uint8_t *)hdr + meta_size, page_cnt, page_size);
+    if (NULL == huge_page_info) {
+      goto error;
+    }
+    for (i = 0; i < page_cnt; i++) {
+      dma_tbl[i] = huge_page_info[i].base_dma_addr;
+    }
+    hdr->shared = shared;
+  } else {
+    /* the pages are bus mapped already, at the same place in this process's
+     * view of them
+     */
+    huge_page_info = bf_sys_calloc(page_cnt, sizeof(bf_huge_page_info_t));
+    if (NULL == huge_page_info) {
+      goto error;
+    }
+    for (i = 0; i < page_cnt; i++) {
+      huge_page_info[i].base_dma_addr = dma_tbl[i];
+      huge_page_info[i].base_virt_addr =
+          (uint8_t *)hdr + meta_size + (size_t)i * page_size;
+    }
+  }
+  /* stay attached until the pool is destroyed */
+  bf_dma_file_lock(fd, F_RDLCK, BF_DMA_FILE_LOCK_ATTACH, 0);
+  bf_dma_file_lock(fd, F_UNLCK, BF_DMA_FILE_LOCK_SETUP, 0);
+
+  dma_pool->file_hdr = hdr;
+  dma_pool->file_size = map_size;
+  dma_pool->file_fd = fd;
+  dma_pool->map_base = (uint8_t *)hdr + meta_size;
+  dma_pool->map_size = buf_map_size;
+  dma_pool->pool_hdr_offset = 0;
+  dma_pool->pool_ptr = dma_pool->map_base;
+  dma_pool->buf_start = dma_pool->pool_ptr;
+  dma_pool->buf_cnt = cnt;
+  dma_pool->buf_size = size;
+  dma_pool->page_bufs = layout.page_bufs;
+  dma_pool->huge_page_info_ptr = huge_page_info;
+  dma_pool->num_huge_pages = page_cnt;
+  dma_pool->page_size = page_size;
+  dma_pool->page_shift = __builtin_ctzl(page_size);
+  return 0;
+
+error:
+  munmap(hdr, map_size);
+  close(fd);
+  return -1;
+}
+
+/* detach from a persistent pool's file; the last process to detach bus
+ * unmaps the pages, which the file keeps for the next attach
+ */
+static void bf_dma_pool_unmap_file(bf_huge_pool_t *dma_pool) {
+  int fd = dma_pool->file_fd;
+
+  bf_dma_file_lock(fd, F_WRLCK, BF_DMA_FILE_LOCK_SETUP, 1);
+  if (bf_dma_file_lock(fd, F_WRLCK, BF_DMA_FILE_LOCK_ATTACH, 0) == 0) {
+    bf_dma_bus_unmap_pages(dma_pool->dev_id, dma_pool->subdev_id,
+                           dma_pool->huge_page_info_ptr,
+                           dma_pool->num_huge_pages, dma_pool->page_size);
+  }
+  munmap(dma_pool->file_hdr, dma_pool->file_size);
+  close(fd);
+  dma_pool->file_hdr = NULL;
+  dma_pool->file_fd = -1;
+}
+
+/**
+ *  Remove the hugetlbfs file of a persistent DMA memory pool
+ */
+int bf_sys_dma_pool_remove(char *pool_name) {
+  char path[PATH_MAX];
+
+  assert(pool_name);
+  if (bf_dma_file_path(pool_name, BF_HUGE_PAGE_SIZE_1G, path, sizeof(path)) ==
+          0 &&
+      unlink(path) == 0) {
+    return 0;
+  }
+  if (bf_dma_file_path(pool_name, BF_HUGE_PAGE_SIZE, path, sizeof(path)) ==
+          0 &&
+      unlink(path) == 0) {
+    return 0;
+  }
+  return -1;
+}
+
+/* find out which numa nodes the pool's huge pages landed on */
+static void bf_dma_pool_numa_check(bf_huge_pool_t *dma_pool) {
+  int num_huge_pages = dma_pool->num_huge_pages;
+  void **pages;
+  int *status;
+  int i;
+
+  memset(dma_pool->numa_pages, 0, sizeof(dma_pool->numa_pages));
+  pages = bf_sys_calloc(num_huge_pages, sizeof(void *));
+  status = bf_sys_calloc(num_huge_pages, sizeof(int));
+  if (pages == NULL || status == NULL) {
+    goto done;
+  }
+  for (i = 0; i < num_huge_pages; i++) {
+    pages[i] = dma_pool->huge_page_info_ptr[i].base_virt_addr;
+  }
+  /* move_pages() without target nodes only reports the current nodes */
+  if (syscall(SYS_move_pages, 0, (unsigned long)num_huge_pages, pages, NULL,
+              status, 0)) {
+    goto done;
+  }
+  for (i = 0; i < num_huge_pages; i++) {
+    if (status[i] >= 0 && status[i] < BF_SYS_DMA_NUMA_NODE_MAX) {
+      dma_pool->numa_pages[status[i]]++;
+    }
+  }
+  if (dma_pool->numa_node >= 0 &&
+      dma_pool->numa_pages[dma_pool->numa_node] != num_huge_pages) {
+    printf("DMA pool %s: only %d of %d huge pages on numa node %d\n",
+           dma_pool->name, dma_pool->numa_pages[dma_pool->numa_node],
+           num_huge_pages, dma_pool->numa_node);
+  }
+done:
+  bf_sys_free(pages);
+  bf_sys_free(status);
+}
+
+static int bf_dma_rsv_unit_used(bf_dma_rsv_t *rsv, size_t unit) {
+  return (rsv->unit_map[unit / 64] >> (unit % 64)) & 1;
+}
+
+/* mark the 4K units of a range of the reservation as carved out or free */
+static void bf_dma_rsv_mark(bf_dma_rsv_t *rsv, size_t offset, size_t len,
+                            int used) {
+  size_t unit, end = (offset + len) / POOL_HDR_SIZE;
+
+  for (unit = offset / POOL_HDR_SIZE; unit < end; unit++) {
+    if (used) {
+      rsv->unit_map[unit / 64] |= 1ULL << (unit % 64);
+    } else {
+      rsv->unit_map[unit / 64] &= ~(1ULL << (unit % 64));
+    }
+  }
+}
+
+/**
+ * Claim the lowest free range of the reservation
+ * @param rsv reservation
+ * @param len length of the range, a multiple of POOL_HDR_SIZE
+ * @param align alignment of the range, a power of 2 of at least POOL_HDR_SIZE
+ * @param in_page 1 if the range must not cross a huge page boundary
+ * @return offset of the range in the reservation, -1 if there is no room
+ */
+static ssize_t bf_dma_rsv_claim(bf_dma_rsv_t *rsv, size_t len, size_t align,
+                                int in_page) {
+  size_t offset = 0, unit, end;
+
+  pthread_mutex_lock(&rsv->lock);
+  while (offset + len <= rsv->size) {
+    if (in_page && (offset & (rsv->page_size - 1)) + len > rsv->page_size) {
+      offset = ALIGN_TO_PAGE_SIZE(offset + 1, rsv->page_size);
+      continue;
+    }
+    end = (offset + len) / POOL_HDR_SIZE;
+    for (unit = offset / POOL_HDR_SIZE; unit < end; unit++) {
+      if (bf_dma_rsv_unit_used(rsv, unit)) {
+        break;
+      }
+    }
+    if (unit == end) {
+      bf_dma_rsv_mark(rsv, offset, len, 1);
+      rsv->pool_cnt++;
+      pthread_mutex_unlock(&rsv->lock);
+      return offset;
+    }
+    /* resume past the unit in use */
+    offset = ALIGN_TO_PAGE_SIZE((unit + 1) * POOL_HDR_SIZE, align);
+  }
+  pthread_mutex_unlock(&rsv->lock);
+  return -1;
+}
+
+static void bf_dma_rsv_release(bf_dma_rsv_t *rsv, size_t offset,
+                               size_t len) {
+  pthread_mutex_lock(&rsv->lock);
+  bf_dma_rsv_mark(rsv, offset, len, 0);
+  rsv->pool_cnt--;
+  pthread_mutex_unlock(&rsv->lock);
+}
+
+/**
+ * Carve the buffers of a pool out of the init reservation, the counterpart
+ * of bf_dma_pool_map for the pools that the reservation can hold
+ * @param dma_pool pool to place
+ * @param size size of each buffer
+ * @param page_size huge page size asked for, 0 if any
+ * @param cnt number of buffers
+ * @return Status 0 on Success, -1 if the pool needs huge pages of its own
+ */
+static int bf_dma_pool_carve(bf_huge_pool_t *dma_pool, size_t size,
+                             size_t page_size, int cnt) {
+  bf_dma_rsv_t *rsv = bf_dma_rsv;
+  size_t len, align, first;
+  ssize_t offset;
+  int page_bufs = 0;
+
+  /* multi-page buffers need runs of contiguous pages, they are not carved */
+  if (rsv == NULL || rsv->dev_id != dma_pool->dev_id ||
+      rsv->subdev_id != dma_pool->subdev_id ||
+      (page_size != 0 && page_size != rsv->page_size) ||
+      (dma_pool->numa_node >= 0 && dma_pool->numa_node != rsv->numa_node) ||
+      size > rsv->page_size) {
+    return -1;
+  }
+  len = ALIGN_TO_PAGE_SIZE(size * cnt, POOL_HDR_SIZE);
+  if (len == 0) {
+    len = POOL_HDR_SIZE;
+  }
+  /* align the range like the buffers, so that none of the buffers spills
+   * over from a huge page
+   */
+  align = size & -size;
+  if (align < POOL_HDR_SIZE) {
+    align = POOL_HDR_SIZE;
+  } else if (align > rsv->page_size) {
+    align = rsv->page_size;
+  }
+  if (len > rsv->page_size && rsv->page_size % size) {
+    /* other sizes are packed in whole pages, as by bf_dma_layout */
+    page_bufs = rsv->page_size / size;
+    len = ((size_t)cnt + page_bufs - 1) / page_bufs * rsv->page_size;
+    align = rsv->page_size;
+  }
+  offset = bf_dma_rsv_claim(rsv, len, align, len <= rsv->page_size);
+  if (offset < 0) {
+    return -1;
+  }
+  first = (size_t)offset >> rsv->page_shift;
+  dma_pool->carved = 1;
+  dma_pool->map_base = rsv->base + offset;
+  dma_pool->map_size = len;
+  dma_pool->pool_hdr_offset = offset & (rsv->page_size - 1);
+  dma_pool->pool_ptr = dma_pool->map_base;
+  dma_pool->buf_start = dma_pool->pool_ptr;
+  dma_pool->buf_cnt = cnt;
+  dma_pool->buf_size = size;
+  dma_pool->page_bufs = page_bufs;
+  dma_pool->huge_page_info_ptr = &rsv->huge_page_info[first];
+  dma_pool->num_huge_pages =
+      ((offset + len - 1) >> rsv->page_shift) - first + 1;
+  dma_pool->page_size = rsv->page_size;
+  dma_pool->page_shift = rsv->page_shift;
+  return 0;
+}
+
+/**
+ *  Initialize DMA library init attributes with the defaults
+ */
+void bf_sys_dma_lib_attr_init(bf_sys_dma_lib_attr_t *attr) {
+  assert(attr);
+  memset(attr, 0, sizeof(*attr));
+  attr->numa_node = BF_SYS_DMA_NUMA_NODE_ANY;
+}
+
+/**
+ * Platform specific init for dma memory mgmt
+ * param1 : register function pointer that provides bus mapping services
+ * param3 : optional bf_sys_dma_lib_attr_t, reserves huge page memory that
+ *          is mapped and bus mapped once for the pools to be carved out of
+ */
+int bf_sys_dma_lib_init(void *param1, void *param2, void *param3) {
+  const bf_sys_dma_lib_attr_t *attr = (const bf_sys_dma_lib_attr_t *)param3;
+  bf_dma_rsv_t *rsv;
+  size_t page_size;
+  int threads;
+  (void)param1;
+  (void)param2;
+
+  if (attr == NULL || attr->reserve_size == 0) {
+    return 0;
+  }
+  if (bf_dma_rsv != NULL) {
+    printf("DMA memory is already reserved\n");
+    return -1;
+  }
+  if (attr->page_size == 0) {
+    page_size = BF_HUGE_PAGE_SIZE;
+  } else if (attr->page_size == BF_HUGE_PAGE_SIZE ||
+             attr->page_size == BF_HUGE_PAGE_SIZE_1G) {
+    page_size = attr->page_size;
+  } else {
+    return -1;
+  }
+  if (attr->numa_node < BF_SYS_DMA_NUMA_NODE_ANY ||
+      attr->numa_node >= BF_SYS_DMA_NUMA_NODE_MAX) {
+    return -1;
+  }
+
+  if (attr->populate_threads < 0) {
+    return -1;
+  }
+  threads = attr->populate_threads ? attr->populate_threads : 1;
+
+  rsv = (bf_dma_rsv_t *)bf_sys_calloc(1, sizeof(bf_dma_rsv_t));
+  if (rsv == NULL) {
+    return -1;
+  }
+  rsv->base = alloc_huge_pages(NULL, -1, attr->reserve_size, 0, page_size,
+                               attr->numa_node, threads, &rsv->size);
+  if (rsv->base == NULL && page_size != BF_HUGE_PAGE_SIZE) {
+    /* no 1GB pages available, fall back to 2MB pages */
+    page_size = BF_HUGE_PAGE_SIZE;
+    rsv->base = alloc_huge_pages(NULL, -1, attr->reserve_size, 0, page_size,
+                                 attr->numa_node, threads, &rsv->size);
+  }
+  if (rsv->base == NULL) {
+    printf("Error reserving %zu bytes of DMA memory\n", attr->reserve_size);
+    bf_sys_free(rsv);
+    return -1;
+  }
+  rsv->page_size = page_size;
+  rsv->page_shift = __builtin_ctzl(page_size);
+  rsv->numa_node = attr->numa_node;
+  rsv->dev_id = attr->dev_id;
+  rsv->subdev_id = attr->subdev_id;
+  rsv->huge_page_info =
+      log_virt_dma_addr(rsv->dev_id, rsv->subdev_id, rsv->base,
+                        rsv->size / page_size, page_size);
+  rsv->unit_cnt = rsv->size / POOL_HDR_SIZE;
+  rsv->unit_map = bf_sys_calloc((rsv->unit_cnt + 63) / 64, sizeof(uint64_t));
+  if (rsv->huge_page_info == NULL || rsv->unit_map == NULL) {
+    free_huge_pages(rsv->dev_id, rsv->subdev_id, rsv->huge_page_info,
+                    rsv->base, rsv->size, page_size);
+    bf_sys_free(rsv->huge_page_info);
+    bf_sys_free(rsv->unit_map);
+    bf_sys_free(rsv);
+    return -1;
+  }
+  pthread_mutex_init(&rsv->lock, NULL);
+  bf_dma_rsv = rsv;
+  return 0;
+}
+
+/**
+ *  Release the huge page memory reserved at init
+ */
+int bf_sys_dma_lib_fini(void) {
+  bf_dma_rsv_t *rsv = bf_dma_rsv;
+
+  if (rsv == NULL) {
+    return 0;
+  }
+  if (rsv->pool_cnt) {
+    printf("%d DMA pools still use the reserved DMA memory\n", rsv->pool_cnt);
+    return -1;
+  }
+  free_huge_pages(rsv->dev_id, rsv->subdev_id, rsv->huge_page_info, rsv->base,
+                  rsv->size, rsv->page_size);
+  bf_sys_free(rsv->huge_page_info);
+  bf_sys_free(rsv->unit_map);
+  pthread_mutex_destroy(&rsv->lock);
+  bf_sys_free(rsv);
+  bf_dma_rsv = NULL;
+  return 0;
+}
+
+static void bf_dma_pool_unmap(bf_huge_pool_t *dma_pool) {
+  if (dma_pool->carved) {
+    /* the pages and their table stay with the reservation */
+    bf_dma_rsv_release(bf_dma_rsv,
+                       (size_t)((uint8_t *)dma_pool->map_base -
+                                bf_dma_rsv->base),
+                       dma_pool->map_size);
+    dma_pool->huge_page_info_ptr = NULL;
+    dma_pool->map_base = NULL;
+    return;
+  }
+  if (dma_pool->file_hdr) {
+    bf_dma_pool_unmap_file(dma_pool);
+    bf_sys_free(dma_pool->huge_page_info_ptr);
+    dma_pool->huge_page_info_ptr = NULL;
+    dma_pool->map_base = NULL;
+    return;
+  }
+  if (dma_pool->grow_pages) {
+    /* only part of an elastic pool's reserved address space is mapped */
+    bf_dma_bus_unmap_pages(dma_pool->dev_id, dma_pool->subdev_id,
+                           dma_pool->huge_page_info_ptr,
+                           dma_pool->num_huge_pages, dma_pool->page_size);
+    munmap(dma_pool->map_base, dma_pool->map_size);
+    bf_sys_free(dma_pool->huge_page_info_ptr);
+    dma_pool->huge_page_info_ptr = NULL;
+    dma_pool->map_base = NULL;
+    return;
+  }
+  free_huge_pages(dma_pool->dev_id, dma_pool->subdev_id,
+                  dma_pool->huge_page_info_ptr, dma_pool->map_base,
+                  dma_pool->map_size, dma_pool->page_size);
+  bf_sys_free(dma_pool->huge_page_info_ptr);
+  dma_pool->huge_page_info_ptr = NULL;
+  dma_pool->map_base = NULL;
+}
+
+/* check that all the huge pages of a buffer slot are contiguous in dma
+ * address space, which is always the case for buffers within one page
+ */
+static int bf_dma_slot_contig(bf_huge_pool_t *dma_pool, int slot) {
+  bf_huge_page_info_t *page_info;
+  size_t pages, j;
+
+  if (dma_pool->buf_size <= dma_pool->page_size) {
+    return 1;
+  }
+  pages = dma_pool->buf_size >> dma_pool->page_shift;
+  page_info = &dma_pool->huge_page_info_ptr[slot * pages];
+  for (j = 1; j < pages; j++) {
+    if (page_info[j].base_dma_addr !=
+        page_info[0].base_dma_addr + (j << dma_pool->page_shift)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int bf_dma_contig_slot_cnt(bf_huge_pool_t *dma_pool) {
+  int i, n = 0;
+
+  for (i = 0; i < dma_pool->buf_cnt; i++) {
+    n += bf_dma_slot_contig(dma_pool, i);
+  }
+  return n;
+}
+
+/* number of buffer slots held by the first pages of an elastic pool */
+static int bf_dma_elastic_slot_cnt(bf_huge_pool_t *dma_pool, int pages) {
+  size_t n = dma_pool->page_bufs
+                 ? (size_t)pages * dma_pool->page_bufs
+                 : (((size_t)pages << dma_pool->page_shift) -
+                    dma_pool->pool_hdr_offset) /
+                       dma_pool->buf_size;
+
+  return n < (size_t)dma_pool->max_cnt ? (int)n : dma_pool->max_cnt;
+}
+
+/**
+ * Map the huge pages of an elastic pool. Address space for max_cnt buffers
+ * is reserved up front so that the pool grows in place and its huge page
+ * table stays indexed by offset, but only the pages of the first cnt
+ * buffers are mapped. The pool grows by as many pages at a time.
+ * @param dma_pool pool to map the pages for
+ * @param size size of each buffer, at most a huge page
+ * @param page_size requested huge page size
+ * @param cnt number of buffers to map pages for
+ * @param max_cnt number of buffers to reserve address space for
+ * @return Status 0 on Success, -1 on failure
+ */
+static int bf_dma_pool_map_elastic(bf_huge_pool_t *dma_pool, size_t size,
+                                   size_t page_size, int cnt, int max_cnt) {
+  bf_dma_layout_t layout, init_layout;
+  bf_huge_page_info_t *huge_page_info, *page_info;
+  size_t va_size, init_size, map_size;
+  uint8_t *va;
+
+  for (;;) {
+    if (size > page_size) {
+      return -1;
+    }
+    /* lay the buffers out as for a fixed size pool of max_cnt buffers */
+    bf_dma_layout(size, max_cnt, page_size, &layout);
+    bf_dma_layout(size, cnt, page_size, &init_layout);
+    va_size = layout.size;
+    init_size = init_layout.size;
+    va = bf_dma_va_reserve(NULL, va_size, page_size);
+    if (va == NULL) {
+      return -1;
+    }
+    if (alloc_huge_pages(va, -1, init_size, 0, page_size, dma_pool->numa_node,
+                         dma_pool->populate_threads, &map_size)) {
+      break;
+    }
+    munmap(va, va_size);
+    if (page_size == BF_HUGE_PAGE_SIZE) {
+      return -1;
+    }
+    /* no 1GB pages available, fall back to 2MB pages */
+    page_size = BF_HUGE_PAGE_SIZE;
+  }
+
+  huge_page_info =
+      bf_sys_calloc(va_size / page_size, sizeof(bf_huge_page_info_t));
+  page_info = log_virt_dma_addr(dma_pool->dev_id, dma_pool->subdev_id, va,
+                                map_size / page_size, page_size);
+  if (huge_page_info == NULL || page_info == NULL) {
+    if (page_info) {
+      bf_dma_bus_unmap_pages(dma_pool->dev_id, dma_pool->subdev_id, page_info,
+                             map_size / page_size, page_size);
+    }
+    munmap(va, va_size);
+    bf_sys_free(huge_page_info);
+    bf_sys_free(page_info);
+    return -1;
+  }
+  memcpy(huge_page_info, page_info,
+         map_size / page_size * sizeof(bf_huge_page_info_t));
+  bf_sys_free(page_info);
+
+  dma_pool->map_base = va;
+  dma_pool->map_size = va_size;
+  dma_pool->pool_hdr_offset = 0;
+  dma_pool->pool_ptr = va;
+  dma_pool->buf_start = dma_pool->pool_ptr;
+  dma_pool->buf_size = size;
+  dma_pool->page_bufs = layout.page_bufs;
+  dma_pool->huge_page_info_ptr = huge_page_info;
+  dma_pool->num_huge_pages = map_size / page_size;
+  dma_pool->page_size = page_size;
+  dma_pool->page_shift = __builtin_ctzl(page_size);
+  dma_pool->max_cnt = max_cnt;
+  dma_pool->max_pages = va_size / page_size;
+  dma_pool->base_pages = dma_pool->num_huge_pages;
+  dma_pool->grow_pages = dma_pool->num_huge_pages;
+  dma_pool->buf_cnt =
+      bf_dma_elastic_slot_cnt(dma_pool, dma_pool->num_huge_pages);
+  return 0;
+}
+
+static int bf_push_free_bufs(bf_huge_pool_t *pool, void **buf_ptr, int cnt);
+
+/**
+ * Grow an elastic pool whose freelist ran dry by mapping the next pages of
+ * its reserved address space
+ * @param dma_pool elastic pool
+ * @return Status 0 if the pool has free buffers again, -1 once it is at its
+ *  cap or out of huge pages
+ */
+static int bf_dma_pool_grow(bf_huge_pool_t *dma_pool) {
+  bf_huge_page_info_t *page_info = NULL;
+  int num, pages, new_cnt, old_cnt, i, ret = -1;
+  size_t map_size = 0;
+  void **bufs = NULL;
+  uint8_t *addr;
+
+  pthread_mutex_lock(&dma_pool->grow_lock);
+  /* another thread may have grown the pool or freed buffers meanwhile */
+  num = dma_pool->num_huge_pages;
+  if (BF_DMA_FREE_IDX(__atomic_load_n(dma_pool->free_head,
+                                      __ATOMIC_ACQUIRE)) != BF_DMA_FREE_END) {
+    ret = 0;
+    goto done;
+  }
+  pages = dma_pool->max_pages - num;
+  if (pages > dma_pool->grow_pages) {
+    pages = dma_pool->grow_pages;
+  }
+  old_cnt = dma_pool->buf_cnt;
+  new_cnt = bf_dma_elastic_slot_cnt(dma_pool, num + pages);
+  if (new_cnt == old_cnt) {
+    goto done;
+  }
+  bufs = bf_sys_calloc(new_cnt - old_cnt, sizeof(void *));
+  if (bufs == NULL) {
+    goto done;
+  }
+  addr = (uint8_t *)dma_pool->map_base + ((size_t)num << dma_pool->page_shift);
+  if (alloc_huge_pages(addr, -1, (size_t)pages << dma_pool->page_shift, 0,
+                       dma_pool->page_size, dma_pool->numa_node,
+                       dma_pool->populate_threads, &map_size) == NULL) {
+    /* a failed fixed mapping may have taken the reservation with it */
+    bf_dma_va_reserve(addr, (size_t)pages << dma_pool->page_shift,
+                      dma_pool->page_size);
+    goto done;
+  }
+  page_info = log_virt_dma_addr(dma_pool->dev_id, dma_pool->subdev_id, addr,
+                                pages, dma_pool->page_size);
+  if (page_info == NULL) {
+    bf_dma_va_reserve(addr, map_size, dma_pool->page_size);
+    goto done;
+  }
+  memcpy(&dma_pool->huge_page_info_ptr[num], page_info,
+         pages * sizeof(bf_huge_page_info_t));
+  if (bf_dma_index_build(dma_pool, num + pages) ||
+      bf_dma_lookup_update(dma_pool, num + pages)) {
+    /* back to the pages the pool had; out of memory only leaves stale
+     * pages in the lookup index
+     */
+    if (dma_pool->dma_index) {
+      bf_dma_index_build(dma_pool, num);
+    }
+    memset(&dma_pool->huge_page_info_ptr[num], 0,
+           pages * sizeof(bf_huge_page_info_t));
+    bf_dma_bus_unmap_pages(dma_pool->dev_id, dma_pool->subdev_id, page_info,
+                           pages, dma_pool->page_size);
+    bf_dma_va_reserve(addr, map_size, dma_pool->page_size);
+    goto done;
+  }
+  /* publish the pages, then hand out their buffers */
+  __atomic_store_n(&dma_pool->num_huge_pages, num + pages, __ATOMIC_RELEASE);
+  __atomic_store_n(&dma_pool->buf_cnt, new_cnt, __ATOMIC_RELEASE);
+  bf_dma_pool_numa_check(dma_pool);
+  for (i = 0; i < new_cnt - old_cnt; i++) {
+    bufs[i] = dma_pool->buf_start + bf_dma_slot_off(dma_pool, old_cnt + i);
+  }
+  ret = bf_push_free_bufs(dma_pool, bufs, new_cnt - old_cnt);
+
+done:
+  pthread_mutex_unlock(&dma_pool->grow_lock);
+  bf_sys_free(page_info);
+  bf_sys_free(bufs);
+  return ret;
+}
+
+/**
+ * Populate and bus map the huge pages of a cold pool, on its first
+ * allocation
+ * @param dma_pool cold pool
+ * @return Status 0 once the pool's pages are populated, -1 on failure
+ */
+static int bf_dma_pool_warm(bf_huge_pool_t *dma_pool) {
+  bf_huge_page_info_t *huge_page_info;
+  uint64_t start_usec = bf_dma_usec_now();
+  int ret = -1;
+
+  pthread_mutex_lock(&dma_pool->grow_lock);
+  /* another thread may have got there first */
+  if (!dma_pool->cold) {
+    ret = 0;
+    goto done;
+  }
+  if (bf_dma_populate(dma_pool->map_base, dma_pool->map_size,
+                      dma_pool->page_size, dma_pool->populate_threads)) {
+    printf("Error populating cold pool %s\n", dma_pool->name);
+    goto done;
+  }
+  huge_page_info =
+      log_virt_dma_addr(dma_pool->dev_id, dma_pool->subdev_id,
+                        dma_pool->map_base, dma_pool->num_huge_pages,
+                        dma_pool->page_size);
+  if (huge_page_info == NULL) {
+    goto done;
+  }
+  dma_pool->huge_page_info_ptr = huge_page_info;
+  if (bf_dma_index_build(dma_pool, dma_pool->num_huge_pages) ||
+      bf_dma_lookup_update(dma_pool, dma_pool->num_huge_pages)) {
+    bf_dma_bus_unmap_pages(dma_pool->dev_id, dma_pool->subdev_id,
+                           huge_page_info, dma_pool->num_huge_pages,
+                           dma_pool->page_size);
+    dma_pool->huge_page_info_ptr = NULL;
+    bf_sys_free(huge_page_info);
+    goto done;
+  }
+  bf_dma_pool_numa_check(dma_pool);
+  dma_pool->base_phy_addr = bf_mem_virt2phy(dma_pool->buf_start);
+  dma_pool->warm_usec = bf_dma_usec_now() - start_usec;
+  /* allocations go ahead once the page table is complete */
+  __atomic_store_n(&dma_pool->cold, 0, __ATOMIC_RELEASE);
+  ret = 0;
+
+done:
+  pthread_mutex_unlock(&dma_pool->grow_lock);
+  return ret;
+}
 
-  for (i = 0; i < num_huge_pages; i++) {
-    if ((dma_addr >= huge_page_info[i].base_dma_addr) &&
-        (dma_addr < (huge_page_info[i].base_dma_addr + BF_HUGE_PAGE_SIZE))) {
-      /* Found the huge page to which the given address belongs to */
-      virtaddr = (unsigned long)(huge_page_info[i].base_virt_addr) +
-                 (dma_addr - huge_page_info[i].base_dma_addr);
+/**
+ *  Return the fully free pages at the end of an elastic DMA memory pool
+ */
+int bf_sys_dma_pool_shrink(bf_sys_dma_pool_handle_t hndl) {
+  bf_huge_pool_t *dma_pool = (bf_huge_pool_t *)hndl;
+  int num, keep, chunks, chunk, chunk_slots, first_page, last_page, new_cnt;
+  uint32_t idx, first, last;
+  uint64_t head, new_head;
+  int *chunk_free;
+  size_t end;
+  uint8_t *addr;
+
+  assert(dma_pool);
+  if (dma_pool->grow_pages == 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&dma_pool->grow_lock);
+  num = dma_pool->num_huge_pages;
+  chunks = (num - dma_pool->base_pages + dma_pool->grow_pages - 1) /
+           dma_pool->grow_pages;
+  chunk_free = chunks ? bf_sys_calloc(chunks, sizeof(int)) : NULL;
+  if (chunk_free == NULL) {
+    pthread_mutex_unlock(&dma_pool->grow_lock);
+    return chunks ? -1 : 0;
+  }
+
+  /* take the whole freelist; buffers freed meanwhile count as in use */
+  head = __atomic_load_n(dma_pool->free_head, __ATOMIC_ACQUIRE);
+  do {
+    new_head = BF_DMA_FREE_HEAD(BF_DMA_FREE_TAG(head) + 1, BF_DMA_FREE_END);
+  } while (!__atomic_compare_exchange_n(dma_pool->free_head, &head, new_head,
+                                        1, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE));
+  /* count the free buffers of each growth chunk, a buffer belongs to the
+   * chunk holding its last byte
+   */
+  for (idx = BF_DMA_FREE_IDX(head); idx != BF_DMA_FREE_END;
+       idx = dma_pool->free_next[idx]) {
+    end = dma_pool->pool_hdr_offset + bf_dma_slot_off(dma_pool, idx) +
+          dma_pool->buf_size - 1;
+    last_page = end >> dma_pool->page_shift;
+    if (last_page >= dma_pool->base_pages) {
+      chunk_free[(last_page - dma_pool->base_pages) / dma_pool->grow_pages]++;
+    }
+  }
+  /* release trailing chunks for as long as all their buffers are free */
+  keep = num;
+  for (chunk = chunks - 1; chunk >= 0; chunk--) {
+    first_page = dma_pool->base_pages + chunk * dma_pool->grow_pages;
+    chunk_slots = bf_dma_elastic_slot_cnt(dma_pool, keep) -
+                  bf_dma_elastic_slot_cnt(dma_pool, first_page);
+    if (chunk_free[chunk] != chunk_slots) {
       break;
     }
+    keep = first_page;
+  }
+  new_cnt = bf_dma_elastic_slot_cnt(dma_pool, keep);
+
+  /* put the remaining free buffers back */
+  first = last = BF_DMA_FREE_END;
+  for (idx = BF_DMA_FREE_IDX(head); idx != BF_DMA_FREE_END;
+       idx = dma_pool->free_next[idx]) {
+    if (idx >= (uint32_t)new_cnt) {
+      continue;
+    }
+    if (first == BF_DMA_FREE_END) {
+      first = idx;
+    } else {
+      dma_pool->free_next[last] = idx;
+    }
+    last = idx;
+  }
+  if (first != BF_DMA_FREE_END) {
+    head = __atomic_load_n(dma_pool->free_head, __ATOMIC_RELAXED);
+    do {
+      __atomic_store_n(&dma_pool->free_next[last], BF_DMA_FREE_IDX(head),
+                       __ATOMIC_RELAXED);
+      new_head = BF_DMA_FREE_HEAD(BF_DMA_FREE_TAG(head) + 1, first);
+    } while (!__atomic_compare_exchange_n(dma_pool->free_head, &head,
+                                          new_head, 1, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
   }
 
-  if (i == num_huge_pages) {
-    /* Indicates that the given physical address doesn't belong
-       to any of the huge pages in the given DMA memory pool */
-    return NULL;
+  if (keep < num) {
+    __atomic_store_n(&dma_pool->buf_cnt, new_cnt, __ATOMIC_RELEASE);
+    __atomic_store_n(&dma_pool->num_huge_pages, keep, __ATOMIC_RELEASE);
+    if (dma_pool->dma_index) {
+      /* out of memory only leaves stale pages in the lookup index */
+      bf_dma_index_build(dma_pool, keep);
+    }
+    bf_dma_lookup_update(dma_pool, keep);
+    bf_dma_bus_unmap_pages(dma_pool->dev_id, dma_pool->subdev_id,
+                           &dma_pool->huge_page_info_ptr[keep], num - keep,
+                           dma_pool->page_size);
+    /* replacing the pages keeps the address space reserved */
+    addr =
+        (uint8_t *)dma_pool->map_base + ((size_t)keep << dma_pool->page_shift);
+    bf_dma_va_reserve(addr, (size_t)(num - keep) << dma_pool->page_shift,
+                      dma_pool->page_size);
+    bf_dma_pool_numa_check(dma_pool);
   }
+  pthread_mutex_unlock(&dma_pool->grow_lock);
+  bf_sys_free(chunk_free);
+  return num - keep;
+}
 
-  return (void *)virtaddr;
+/**
+ *  Initialize DMA memory pool attributes with the defaults
+ */
+void bf_sys_dma_pool_attr_init(bf_sys_dma_pool_attr_t *attr) {
+  assert(attr);
+  memset(attr, 0, sizeof(*attr));
+  attr->numa_node = BF_SYS_DMA_NUMA_NODE_ANY;
 }
 
 /**
@@ -340,26 +2414,62 @@ void *bf_mem_dma2virt(bf_sys_dma_pool_handle_t hndl, bf_dma_addr_t dma_addr) {
 int bf_sys_dma_pool_create(char *pool_name, bf_sys_dma_pool_handle_t *hndl,
                            int dev_id, uint32_t subdev_id, size_t size, int cnt,
                            unsigned align) {
-  bf_huge_pool_t *dma_pool;
-  char *buf_ptr;
-  void *vhuge, **vbuf_q;
-  int i;
-  size_t alloced_size;
-  void *huge_ptr;
-  int num_huge_pages;
-  unsigned int header_offset = 0;
-  bf_huge_page_info_t *huge_page_info;
+  return bf_sys_dma_pool_create_ext(pool_name, hndl, dev_id, subdev_id, size,
+                                    cnt, align, NULL);
+}
+
+/**
+ *  Create an aligned DMA memory pool with the given attributes
+ */
+int bf_sys_dma_pool_create_ext(char *pool_name, bf_sys_dma_pool_handle_t *hndl,
+                               int dev_id, uint32_t subdev_id, size_t size,
+                               int cnt, unsigned align,
+                               const bf_sys_dma_pool_attr_t *attr) {
+  bf_sys_dma_pool_attr_t def_attr;
+  bf_huge_pool_t *dma_pool, prev_pool;
+  uint32_t *free_next = NULL, last;
+  int i, n, attempt, slot_cnt, usable_cnt = 0;
+  size_t page_size;
+  uint64_t start_usec = bf_dma_usec_now();
 
   assert(hndl);
+  if (attr == NULL) {
+    bf_sys_dma_pool_attr_init(&def_attr);
+    attr = &def_attr;
+  }
   /* check if align is power of 2 */
   if (align & (align - 1)) {
     return -1;
   }
+  if (attr->mag_depth < 0 || attr->mag_depth > BF_DMA_MAG_DEPTH_MAX) {
+    return -1;
+  }
+  if (attr->populate_threads < 0) {
+    return -1;
+  }
+  /* reference counts are kept in process memory */
+  if (attr->refcnt && (attr->persistent || attr->shared)) {
+    return -1;
+  }
 
-  /* current implementation guarantees correct creation of the pool
-   * only if the size of a single buffer is less than a single
-   * huge page */
-  if (size > BF_HUGE_PAGE_SIZE) {
+  if (attr->page_size == 0) {
+    page_size = BF_HUGE_PAGE_SIZE;
+  } else if (attr->page_size == BF_HUGE_PAGE_SIZE ||
+             attr->page_size == BF_HUGE_PAGE_SIZE_1G) {
+    page_size = attr->page_size;
+  } else {
+    return -1;
+  }
+  if (attr->numa_node < BF_SYS_DMA_NUMA_NODE_ANY ||
+      attr->numa_node >= BF_SYS_DMA_NUMA_NODE_MAX) {
+    return -1;
+  }
+  if (attr->max_cnt && attr->max_cnt < cnt) {
+    return -1;
+  }
+  /* persistent pools are of a fixed size */
+  if ((attr->persistent || attr->shared) &&
+      (attr->max_cnt > cnt || pool_name == NULL || pool_name[0] == '\0')) {
     return -1;
   }
 
@@ -376,99 +2486,154 @@ int bf_sys_dma_pool_create(char *pool_name, bf_sys_dma_pool_handle_t *hndl,
   if (dma_pool == NULL) {
     return -1;
   }
+  dma_pool->dev_id = dev_id;
+  dma_pool->subdev_id = subdev_id;
+  dma_pool->numa_node = attr->numa_node;
+  dma_pool->populate_threads =
+      attr->populate_threads ? attr->populate_threads : 1;
+  strncpy(dma_pool->name, pool_name, sizeof(dma_pool->name) - 1);
+  /* null terminate the name, just in case */
+  dma_pool->name[sizeof(dma_pool->name) - 1] = 0;
 
-  vbuf_q = bf_sys_calloc(cnt, sizeof(void *));
-  if (vbuf_q == NULL) {
-    bf_sys_free(dma_pool);
-    return -1;
-  }
-
-  /* Use extra POOL_HDR_SIZE bytes for allocation metadata
-   * ensure that POOL_HDR_SIZE is big enough to hold meta data
+  /* Buffers larger than a huge page need physically contiguous runs of
+   * pages. Map more slots than asked for when some of them are not, holding
+   * on to the previous mapping so that the next one gets other pages.
    */
-  assert(POOL_HDR_SIZE >= sizeof(size_t));
-  header_offset = POOL_HDR_SIZE;
-  /* offset the allocation of the buffers so that none of the
-   * buffers in the memory pool spill over from a physical
-   * page
-   */
-  if (((size * cnt) + header_offset) > BF_HUGE_PAGE_SIZE) {
-    /* Change the offset only if the total required size is more than
-       the size of a huge page */
-    header_offset = size;
-    /* modify offset to the next alignment boundary */
-    header_offset = conv_to_next_aligned(header_offset, POOL_HDR_SIZE);
+  prev_pool.map_base = NULL;
+  slot_cnt = cnt;
+  usable_cnt = cnt;
+  if (attr->max_cnt > cnt) {
+    if (size == 0 ||
+        bf_dma_pool_map_elastic(dma_pool, size, page_size, cnt,
+                                attr->max_cnt)) {
+      bf_sys_free(dma_pool);
+      return -1;
+    }
+    /* all the buffers of the mapped pages start out free */
+    cnt = slot_cnt = usable_cnt = dma_pool->buf_cnt;
+  } else if (attr->persistent || attr->shared) {
+    if (size == 0 || bf_dma_pool_map_file(dma_pool, size, page_size, cnt,
+                                          attr->shared)) {
+      bf_sys_free(dma_pool);
+      return -1;
+    }
+  } else if (bf_dma_pool_carve(dma_pool, size, attr->page_size, cnt)) {
+    /* pools the init reservation cannot hold get pages of their own; only
+     * those can be cold, multi-page buffers need their pages to be checked
+     * for contiguity up front
+     */
+    dma_pool->cold = attr->cold && size <= BF_HUGE_PAGE_SIZE;
+    for (attempt = 0;; attempt++) {
+      if (bf_dma_pool_map(dma_pool, size, page_size, slot_cnt)) {
+        break;
+      }
+      usable_cnt = bf_dma_contig_slot_cnt(dma_pool);
+      if (usable_cnt >= cnt || attempt == BF_DMA_CONTIG_RETRY_MAX) {
+        break;
+      }
+      if (prev_pool.map_base) {
+        bf_dma_pool_unmap(&prev_pool);
+      }
+      prev_pool = *dma_pool;
+      dma_pool->map_base = NULL;
+      slot_cnt += 2 * (cnt - usable_cnt);
+    }
+    if (prev_pool.map_base) {
+      bf_dma_pool_unmap(&prev_pool);
+    }
   }
-
-  vhuge = alloc_huge_pages(size * cnt, header_offset);
-  if (vhuge == NULL) {
+  if (dma_pool->map_base == NULL) {
     bf_sys_free(dma_pool);
-    bf_sys_free(vbuf_q);
     return -1;
   }
+  if (usable_cnt < cnt) {
+    printf("Error getting physically contiguous pages for pool %s\n",
+           pool_name);
+    goto cleanup;
+  }
 
-  /* Jump back to the page with metadata */
-  huge_ptr = (char *)vhuge - header_offset;
-
-  /* Get the original allocation size */
-  alloced_size = *((size_t *)huge_ptr);
-
-  /* Get the number of pages that have been allocated */
-  num_huge_pages = alloced_size / BF_HUGE_PAGE_SIZE;
-
-  /* maintain the base virtual and physical IO bus addresses of all the
-     huge pages in the dma pool */
-  huge_page_info =
-      log_virt_dma_addr(dev_id, subdev_id, huge_ptr, num_huge_pages);
-  if (NULL == huge_page_info) {
-    bf_sys_free(dma_pool);
-    bf_sys_free(vbuf_q);
-    bf_sys_free(vhuge);
-    return -1;
+  n = dma_pool->grow_pages ? dma_pool->max_cnt : slot_cnt;
+  if (dma_pool->file_hdr == NULL) {
+    free_next = bf_sys_calloc(1, BF_DMA_FREE_LINKS_SIZE(n));
+    if (free_next == NULL) {
+      goto cleanup;
+    }
+    dma_pool->free_next = free_next;
+    dma_pool->free_head = &dma_pool->local_free_head;
+  } else {
+    /* a persistent pool's freelist lives in its file */
+    dma_pool->free_next = dma_pool->file_hdr->free_next;
+    dma_pool->free_head = &dma_pool->file_hdr->free_head;
+  }
+  dma_pool->alloc_map =
+      (uint64_t *)((uint8_t *)dma_pool->free_next + BF_DMA_ALLOC_MAP_OFFSET(n));
+  if (attr->refcnt) {
+    dma_pool->refcnt = bf_sys_calloc(n, sizeof(uint32_t));
+    if (dma_pool->refcnt == NULL) {
+      goto cleanup;
+    }
   }
   /* init bf_dma_pool struct  and ensure that there are no reasons to
    * fail any more in the rest of the function */
   dma_pool->hdr_size = POOL_HDR_SIZE;
-  dma_pool->pool_ptr = vhuge;
-  /* with current scheme vhuge would be POOL_HDR_SIZE (4K) aligned
-   * so, no further alignment necessary
-   */
-  dma_pool->dev_id = dev_id;
-  dma_pool->subdev_id = subdev_id;
-  dma_pool->buf_start = vhuge;
-  dma_pool->buf_cnt = cnt;
-  dma_pool->buf_size = size;
   dma_pool->alignment = align;
-  dma_pool->pool_buf_ptr = vbuf_q;
-  dma_pool->pool_buf_offset = 0;
-  dma_pool->pool_gate = 0;
-  dma_pool->huge_page_info_ptr = huge_page_info;
-  dma_pool->num_huge_pages = num_huge_pages;
-  dma_pool->pool_hdr_offset = header_offset;
+  bf_dma_buf_div_init(dma_pool);
+  dma_pool->mag_depth = attr->mag_depth;
+  /* move half a magazine at a time so that a thread alternating between
+   * alloc and free does not hit the pool LIFO on every call
+   */
+  dma_pool->mag_batch = (attr->mag_depth + 1) / 2;
 
-  strncpy(dma_pool->name, pool_name, sizeof(dma_pool->name) - 1);
-  /* null terminate the name, just in case */
-  dma_pool->name[sizeof(dma_pool->name) - 1] = 0;
-  /* get the base physical address of base buffer */
-  dma_pool->base_phy_addr = bf_mem_virt2phy(dma_pool->buf_start);
+  /* a cold pool's pages are looked at once populated */
+  if (!dma_pool->cold) {
+    bf_dma_pool_numa_check(dma_pool);
+    /* get the base physical address of base buffer */
+    dma_pool->base_phy_addr = bf_mem_virt2phy(dma_pool->buf_start);
 
-  if (dma_pool->base_phy_addr == BF_INVALID_PHY_ADDR) {
-    printf("Error getting DMA buf base physical address\n");
-    bf_sys_free(dma_pool);
-    bf_sys_free(vbuf_q);
-    bf_sys_free(vhuge);
-    bf_sys_free(huge_page_info);
-    return -1;
+    if (dma_pool->base_phy_addr == BF_INVALID_PHY_ADDR) {
+      printf("Error getting DMA buf base physical address\n");
+      goto cleanup;
+    }
+    if (bf_dma_index_build(dma_pool, dma_pool->num_huge_pages)) {
+      goto cleanup;
+    }
   }
-  /* intialize the LIFO queue with free buffer pointers */
-  buf_ptr = (char *)(dma_pool->buf_start);
-  for (i = 0; i < cnt; i++) {
-    dma_pool->pool_buf_ptr[i] = (void *)buf_ptr;
-    buf_ptr += size;
+  /* intialize the LIFO with cnt buffers in address order, skipping the
+   * slots that are not physically contiguous; a persistent pool's file has
+   * its freelist set up already
+   */
+  if (dma_pool->file_hdr == NULL) {
+    last = BF_DMA_FREE_END;
+    for (i = slot_cnt - 1, n = 0; i >= 0; i--) {
+      if (bf_dma_slot_contig(dma_pool, i) && usable_cnt - n++ <= cnt) {
+        dma_pool->free_next[i] = last;
+        last = i;
+      }
+    }
+    dma_pool->local_free_head = BF_DMA_FREE_HEAD(0, last);
   }
+  /* last, a pool in the global lookup index may be found by other threads */
+  if (!dma_pool->cold &&
+      bf_dma_lookup_update(dma_pool, dma_pool->num_huge_pages)) {
+    goto cleanup;
+  }
+  pthread_mutex_init(&dma_pool->grow_lock, NULL);
   dma_pool->pool_inited = 1;
+  dma_pool->create_usec = bf_dma_usec_now() - start_usec;
+  pthread_mutex_lock(&bf_dma_pool_list_lock);
+  dma_pool->next = bf_dma_pool_list;
+  bf_dma_pool_list = dma_pool;
+  pthread_mutex_unlock(&bf_dma_pool_list_lock);
   *hndl = (bf_sys_dma_pool_handle_t)dma_pool;
   return 0;
+
+cleanup:
+  bf_dma_pool_unmap(dma_pool);
+  bf_dma_index_free(dma_pool->dma_index);
+  bf_sys_free(free_next);
+  bf_sys_free(dma_pool->refcnt);
+  bf_sys_free(dma_pool);
+  return -1;
 }
 
 /**
@@ -476,56 +2641,533 @@ int bf_sys_dma_pool_create(char *pool_name, bf_sys_dma_pool_handle_t *hndl,
  */
 void bf_sys_dma_pool_destroy(bf_sys_dma_pool_handle_t hndl) {
   bf_huge_pool_t *dma_pool = (bf_huge_pool_t *)hndl;
+  bf_huge_pool_t **prev;
+  int i;
   assert(dma_pool);
 
-  /* free the hugepages pool containing the buffers */
-  free_huge_pages(dma_pool->dev_id, dma_pool->subdev_id,
-                  dma_pool->huge_page_info_ptr, dma_pool->pool_ptr,
-                  dma_pool->pool_hdr_offset);
-  /* free the queue containing the pointers to buffers */
-  bf_sys_free(dma_pool->pool_buf_ptr);
-  /* free the array of structures containing the base physical
-     and virtual addresses of the huge pages in the memory pool */
-  bf_sys_free(dma_pool->huge_page_info_ptr);
+  pthread_mutex_lock(&bf_dma_pool_list_lock);
+  for (prev = &bf_dma_pool_list; *prev; prev = &(*prev)->next) {
+    if (*prev == dma_pool) {
+      *prev = dma_pool->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&bf_dma_pool_list_lock);
+  /* once out of the global lookup index no lookup can find the pool */
+  bf_dma_lookup_update(dma_pool, 0);
+  /* return the buffers cached in the per-thread magazines and free the
+   * magazines; a persistent pool's freelist outlives the process, and a
+   * shared pool's is used by the other processes still attached
+   */
+  for (i = 0; i < BF_DMA_MAG_THREAD_MAX; i++) {
+    if (dma_pool->mags[i]) {
+      bf_push_free_bufs(dma_pool, dma_pool->mags[i]->bufs,
+                        dma_pool->mags[i]->cnt);
+      bf_sys_free(dma_pool->mags[i]->raw);
+    }
+  }
+  /* free the hugepages pool containing the buffers and the array of
+     structures containing the base physical and virtual addresses of the
+     huge pages in the memory pool */
+  bf_dma_pool_unmap(dma_pool);
+  /* free the freelist links and allocation map, and the reverse lookup
+   * index */
+  if (dma_pool->free_next != NULL &&
+      dma_pool->free_head == &dma_pool->local_free_head) {
+    bf_sys_free(dma_pool->free_next);
+  }
+  bf_sys_free(dma_pool->refcnt);
+  bf_dma_index_free(dma_pool->dma_index);
+  pthread_mutex_destroy(&dma_pool->grow_lock);
   /* finally, free the bf_huge_pool_t struct */
   bf_sys_free(dma_pool);
 }
 
-static int bf_pop_free_buf(bf_huge_pool_t *pool, void **buf_ptr) {
-  int err = 0;
+/**
+ *  Get the geometry and placement of a DMA memory pool
+ */
+int bf_sys_dma_pool_info_get(bf_sys_dma_pool_handle_t hndl,
+                             bf_sys_dma_pool_info_t *info) {
+  bf_huge_pool_t *dma_pool = (bf_huge_pool_t *)hndl;
+
+  assert(dma_pool);
+  assert(info);
+  memset(info, 0, sizeof(*info));
+  memcpy(info->name, dma_pool->name, sizeof(info->name));
+  info->buf_size = dma_pool->buf_size;
+  info->buf_cnt = dma_pool->buf_cnt;
+  info->page_size = dma_pool->page_size;
+  info->num_pages = dma_pool->num_huge_pages;
+  info->numa_node = dma_pool->numa_node;
+  memcpy(info->numa_pages, dma_pool->numa_pages, sizeof(info->numa_pages));
+  info->carved = dma_pool->carved;
+  info->max_buf_cnt =
+      dma_pool->grow_pages ? dma_pool->max_cnt : dma_pool->buf_cnt;
+  info->restored = dma_pool->restored;
+  info->cold = __atomic_load_n(&dma_pool->cold, __ATOMIC_ACQUIRE);
+  info->create_usec = dma_pool->create_usec;
+  info->warm_usec = dma_pool->warm_usec;
+  info->page_bufs = dma_pool->page_bufs;
+  /* a carved pool shares its pages with others */
+  info->map_size = dma_pool->carved
+                       ? dma_pool->map_size
+                       : (size_t)info->num_pages << dma_pool->page_shift;
+  if (info->map_size) {
+    info->efficiency =
+        (int)((uint64_t)info->buf_cnt * info->buf_size * 1000 / info->map_size);
+  }
+  return 0;
+}
+
+/**
+ *  Get the usage counters of a DMA memory pool
+ */
+int bf_sys_dma_pool_stats_get(bf_sys_dma_pool_handle_t hndl,
+                              bf_sys_dma_pool_stats_t *stats) {
+  bf_huge_pool_t *dma_pool = (bf_huge_pool_t *)hndl;
+  bf_dma_mag_t *mag;
+  int i;
+
+  assert(dma_pool);
+  assert(stats);
+  memset(stats, 0, sizeof(*stats));
+  stats->allocs = __atomic_load_n(&dma_pool->cnt.allocs, __ATOMIC_RELAXED);
+  stats->frees = __atomic_load_n(&dma_pool->cnt.frees, __ATOMIC_RELAXED);
+  /* the magazines' counters are read racily, good enough for statistics */
+  for (i = 0; i < BF_DMA_MAG_THREAD_MAX; i++) {
+    mag = dma_pool->mags[i];
+    if (mag) {
+      stats->allocs += mag->allocs;
+      stats->frees += mag->frees;
+      stats->cached += mag->cnt;
+    }
+  }
+  /* buffers allocated before a persistent pool was restored are freed
+   * without having been counted
+   */
+  stats->in_use =
+      stats->allocs > stats->frees ? stats->allocs - stats->frees : 0;
+  stats->alloc_fails =
+      __atomic_load_n(&dma_pool->cnt.alloc_fails, __ATOMIC_RELAXED);
+  stats->cas_retries =
+      __atomic_load_n(&dma_pool->cnt.cas_retries, __ATOMIC_RELAXED);
+  stats->bad_frees =
+      __atomic_load_n(&dma_pool->cnt.bad_frees, __ATOMIC_RELAXED);
+  stats->taken_hwm =
+      (uint64_t)__atomic_load_n(&dma_pool->cnt.taken_hwm, __ATOMIC_RELAXED);
+  stats->buf_cnt = __atomic_load_n(&dma_pool->buf_cnt, __ATOMIC_RELAXED);
+  stats->num_pages =
+      __atomic_load_n(&dma_pool->num_huge_pages, __ATOMIC_RELAXED);
+  stats->page_size = dma_pool->page_size;
+  return 0;
+}
+
+/**
+ *  Call a function for each live DMA memory pool
+ */
+int bf_sys_dma_pool_iterate(bf_sys_dma_pool_iter_fn fn, void *cookie) {
+  bf_huge_pool_t *dma_pool;
+  int n = 0;
+
+  assert(fn);
+  pthread_mutex_lock(&bf_dma_pool_list_lock);
+  for (dma_pool = bf_dma_pool_list; dma_pool; dma_pool = dma_pool->next) {
+    n++;
+    if (fn((bf_sys_dma_pool_handle_t)dma_pool, dma_pool->name, cookie)) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&bf_dma_pool_list_lock);
+  return n;
+}
+
+/* count n buffers taken off the freelist, negative for buffers put back */
+static void bf_dma_taken_add(bf_huge_pool_t *pool, int64_t n) {
+  int64_t taken, hwm;
+
+  if (n == 0) {
+    return;
+  }
+  taken = __atomic_add_fetch(&pool->cnt.taken, n, __ATOMIC_RELAXED);
+  if (n < 0) {
+    return;
+  }
+  hwm = __atomic_load_n(&pool->cnt.taken_hwm, __ATOMIC_RELAXED);
+  while (taken > hwm &&
+         !__atomic_compare_exchange_n(&pool->cnt.taken_hwm, &hwm, taken, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+/* pop up to cnt buffers off the freelist with a single compare-and-swap,
+ * returns number of buffers popped
+ */
+static int bf_pop_free_bufs(bf_huge_pool_t *pool, void **buf_ptr, int cnt) {
+  uint64_t head, new_head;
+  uint32_t idx;
+  int n, retries;
+
+retry:
+  retries = -1;
+  head = __atomic_load_n(pool->free_head, __ATOMIC_ACQUIRE);
+  do {
+    /* The links read here may be stale if another thread updates the list
+     * concurrently, in which case the head tag has moved on and the
+     * compare-and-swap below fails. Links only ever hold valid indices.
+     */
+    retries++;
+    idx = BF_DMA_FREE_IDX(head);
+    for (n = 0; n < cnt && idx != BF_DMA_FREE_END; n++) {
+      buf_ptr[n] = pool->buf_start + bf_dma_slot_off(pool, idx);
+      idx = __atomic_load_n(&pool->free_next[idx], __ATOMIC_RELAXED);
+    }
+    if (n == 0) {
+      if (retries > 0) {
+        __atomic_fetch_add(&pool->cnt.cas_retries, retries, __ATOMIC_RELAXED);
+      }
+      /* an elastic pool grows once its freelist runs dry */
+      if (pool->grow_pages && bf_dma_pool_grow(pool) == 0) {
+        goto retry;
+      }
+      return 0;
+    }
+    new_head = BF_DMA_FREE_HEAD(BF_DMA_FREE_TAG(head) + 1, idx);
+  } while (!__atomic_compare_exchange_n(pool->free_head, &head, new_head, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  if (retries > 0) {
+    __atomic_fetch_add(&pool->cnt.cas_retries, retries, __ATOMIC_RELAXED);
+  }
+  return n;
+}
+
+/* push cnt buffers onto the freelist with a single compare-and-swap */
+static int bf_push_free_bufs(bf_huge_pool_t *pool, void **buf_ptr, int cnt) {
+  uint64_t head, new_head;
+  uint32_t first, last;
+  ptrdiff_t delta;
+  size_t idx;
+  int i, retries = -1;
+
+  if (cnt == 0) {
+    return 0;
+  }
+  /* link the buffers into a chain first, outside of the shared head */
+  first = last = BF_DMA_FREE_END;
+  for (i = cnt - 1; i >= 0; i--) {
+    delta = (uint8_t *)buf_ptr[i] - pool->buf_start;
+    if (delta < 0) {
+      return -1;
+    }
+    idx = bf_dma_slot_idx(pool, (size_t)delta);
+    if (idx >= (size_t)pool->buf_cnt) {
+      return -1;
+    }
+    if (first == BF_DMA_FREE_END) {
+      last = (uint32_t)idx;
+    } else {
+      /* concurrent poppers may read a stale link of this buffer */
+      __atomic_store_n(&pool->free_next[idx], first, __ATOMIC_RELAXED);
+    }
+    first = (uint32_t)idx;
+  }
 
-  /* close the gate to assist atomic operation */
+  head = __atomic_load_n(pool->free_head, __ATOMIC_RELAXED);
   do {
-  } while (__sync_val_compare_and_swap(&pool->pool_gate, 0, 1) == 1);
+    retries++;
+    __atomic_store_n(&pool->free_next[last], BF_DMA_FREE_IDX(head),
+                     __ATOMIC_RELAXED);
+    new_head = BF_DMA_FREE_HEAD(BF_DMA_FREE_TAG(head) + 1, first);
+  } while (!__atomic_compare_exchange_n(pool->free_head, &head, new_head, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (retries > 0) {
+    __atomic_fetch_add(&pool->cnt.cas_retries, retries, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+static int bf_pop_free_buf(bf_huge_pool_t *pool, void **buf_ptr) {
+  return bf_pop_free_bufs(pool, buf_ptr, 1) == 1 ? 0 : -1;
+}
+
+static int bf_push_free_buf(bf_huge_pool_t *pool, void *buf_ptr) {
+  return bf_push_free_bufs(pool, &buf_ptr, 1);
+}
+
+/* return the calling thread's magazine for the pool, NULL if the pool has no
+ * magazines or the thread could not get a magazine slot
+ */
+static bf_dma_mag_t *bf_dma_mag_get(bf_huge_pool_t *pool) {
+  bf_dma_mag_t *mag;
+  void *raw;
+  size_t sz;
+  int slot;
+
+  if (pool->mag_depth == 0) {
+    return NULL;
+  }
+  slot = bf_dma_mag_slot_get();
+  if (slot >= BF_DMA_MAG_THREAD_MAX) {
+    return NULL;
+  }
+  mag = pool->mags[slot];
+  if (mag) {
+    return mag;
+  }
+  /* cache line align the magazine so that it does not share a line with
+   * another thread's magazine
+   */
+  sz = sizeof(bf_dma_mag_t) + pool->mag_depth * sizeof(void *);
+  sz = (sz + BF_DMA_CACHE_LINE_SIZE - 1) &
+       ~(size_t)(BF_DMA_CACHE_LINE_SIZE - 1);
+  raw = bf_sys_calloc(1, sz + BF_DMA_CACHE_LINE_SIZE);
+  if (raw == NULL) {
+    return NULL;
+  }
+  mag = (bf_dma_mag_t *)(((uintptr_t)raw + BF_DMA_CACHE_LINE_SIZE - 1) &
+                         ~(uintptr_t)(BF_DMA_CACHE_LINE_SIZE - 1));
+  mag->raw = raw;
+  pool->mags[slot] = mag;
+  return mag;
+}
+
+/* mark buffers as allocated as they are handed out */
+static void bf_dma_mark_alloc(bf_huge_pool_t *pool, void **buf_ptr, int cnt) {
+  size_t idx;
+  uint64_t bit;
+  int i;
+
+  for (i = 0; i < cnt; i++) {
+    idx = bf_dma_slot_idx(pool,
+                          (size_t)((uint8_t *)buf_ptr[i] - pool->buf_start));
+    bit = 1ULL << (idx % 64);
+    if (__atomic_fetch_or(&pool->alloc_map[idx / 64], bit, __ATOMIC_RELAXED) &
+        bit) {
+      /* only a double free that got past the checks can cause this */
+      printf("DMA pool %s: buffer %p handed out twice\n", pool->name,
+             buf_ptr[i]);
+    }
+    if (pool->refcnt) {
+      __atomic_store_n(&pool->refcnt[idx], 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* look up the index of a buffer, -1 if buf_ptr is not a buffer of the pool */
+static int bf_dma_buf_slot(bf_huge_pool_t *pool, void *buf_ptr, size_t *idx) {
+  ptrdiff_t delta = (uint8_t *)buf_ptr - pool->buf_start;
+
+  if (delta < 0) {
+    return -1;
+  }
+  *idx = bf_dma_slot_idx(pool, (size_t)delta);
+  if (*idx >= (size_t)__atomic_load_n(&pool->buf_cnt, __ATOMIC_RELAXED) ||
+      bf_dma_slot_off(pool, *idx) != (size_t)delta) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Mark a buffer as free as it is given back, checking that it is a buffer of
+ * the pool and that it is allocated. The buffer of a reference counted pool
+ * is only freed with its last reference.
+ * @return Status 0 if the buffer may go back to the pool, 1 if it is still
+ *  referenced, -1 if it may not be freed
+ */
+static int bf_dma_mark_free(bf_huge_pool_t *pool, void *buf_ptr) {
+  size_t idx;
+  uint64_t bit;
+  uint32_t ref;
+
+  if (bf_dma_buf_slot(pool, buf_ptr, &idx)) {
+    printf("DMA pool %s: free of %p, not a buffer of the pool\n", pool->name,
+           buf_ptr);
+    __atomic_fetch_add(&pool->cnt.bad_frees, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  if (pool->refcnt) {
+    /* a count of 0 is a free buffer, caught as a double free below; the
+     * owner dropping the last reference sees the other owners' writes
+     */
+    ref = __atomic_load_n(&pool->refcnt[idx], __ATOMIC_RELAXED);
+    while (ref > 0 &&
+           !__atomic_compare_exchange_n(&pool->refcnt[idx], &ref, ref - 1, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    }
+    if (ref > 1) {
+      return 1;
+    }
+  }
+  bit = 1ULL << (idx % 64);
+  if (__atomic_fetch_and(&pool->alloc_map[idx / 64], ~bit, __ATOMIC_RELAXED) &
+      bit) {
+    return 0;
+  }
+  printf("DMA pool %s: double free of buffer %p\n", pool->name, buf_ptr);
+  __atomic_fetch_add(&pool->cnt.bad_frees, 1, __ATOMIC_RELAXED);
+  return -1;
+}
+
+static int bf_dma_mag_pop(bf_huge_pool_t *pool, void **buf_ptr) {
+  bf_dma_mag_t *mag = bf_dma_mag_get(pool);
+
+  if (mag == NULL) {
+    if (bf_pop_free_buf(pool, buf_ptr)) {
+      __atomic_fetch_add(&pool->cnt.alloc_fails, 1, __ATOMIC_RELAXED);
+      return -1;
+    }
+    bf_dma_mark_alloc(pool, buf_ptr, 1);
+    __atomic_fetch_add(&pool->cnt.allocs, 1, __ATOMIC_RELAXED);
+    bf_dma_taken_add(pool, 1);
+    return 0;
+  }
+  if (mag->cnt == 0) {
+    mag->cnt = bf_pop_free_bufs(pool, mag->bufs, pool->mag_batch);
+    if (mag->cnt == 0) {
+      __atomic_fetch_add(&pool->cnt.alloc_fails, 1, __ATOMIC_RELAXED);
+      return -1;
+    }
+    bf_dma_taken_add(pool, mag->cnt);
+  }
+  *buf_ptr = mag->bufs[--mag->cnt];
+  bf_dma_mark_alloc(pool, buf_ptr, 1);
+  mag->allocs++;
+  return 0;
+}
+
+static int bf_dma_mag_push(bf_huge_pool_t *pool, void *buf_ptr) {
+  bf_dma_mag_t *mag;
+  int rc = bf_dma_mark_free(pool, buf_ptr);
+
+  if (rc) {
+    return rc < 0 ? -1 : 0;
+  }
+  mag = bf_dma_mag_get(pool);
+  if (mag == NULL) {
+    if (bf_push_free_buf(pool, buf_ptr)) {
+      return -1;
+    }
+    __atomic_fetch_add(&pool->cnt.frees, 1, __ATOMIC_RELAXED);
+    bf_dma_taken_add(pool, -1);
+    return 0;
+  }
+  if (mag->cnt == pool->mag_depth) {
+    /* spill the oldest buffers, keep the recently freed (cache hot) ones */
+    if (bf_push_free_bufs(pool, mag->bufs, pool->mag_batch)) {
+      return -1;
+    }
+    bf_dma_taken_add(pool, -pool->mag_batch);
+    mag->cnt -= pool->mag_batch;
+    memmove(mag->bufs, &mag->bufs[pool->mag_batch],
+            mag->cnt * sizeof(void *));
+  }
+  mag->bufs[mag->cnt++] = buf_ptr;
+  mag->frees++;
+  return 0;
+}
+
+/* pop cnt buffers, from the calling thread's magazine first and the rest
+ * straight off the freelist; all or nothing
+ */
+static int bf_dma_mag_pop_bulk(bf_huge_pool_t *pool, void **buf_ptr, int cnt) {
+  bf_dma_mag_t *mag = bf_dma_mag_get(pool);
+  int n = 0, cached;
+
+  if (mag) {
+    while (n < cnt && mag->cnt) {
+      buf_ptr[n++] = mag->bufs[--mag->cnt];
+    }
+  }
+  cached = n;
+  while (n < cnt) {
+    int popped = bf_pop_free_bufs(pool, &buf_ptr[n], cnt - n);
 
-  if (pool->pool_buf_offset >= (uint32_t)(pool->buf_cnt)) {
-    err = -1;
+    if (popped == 0) {
+      break;
+    }
+    n += popped;
+  }
+  if (n < cnt) {
+    /* give back what was taken */
+    if (n) {
+      bf_push_free_bufs(pool, buf_ptr, n);
+    }
+    /* the magazine's buffers were counted as taken when it was refilled */
+    bf_dma_taken_add(pool, -cached);
+    __atomic_fetch_add(&pool->cnt.alloc_fails, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  bf_dma_mark_alloc(pool, buf_ptr, cnt);
+  bf_dma_taken_add(pool, cnt - cached);
+  if (mag) {
+    mag->allocs += cnt;
+  } else {
+    __atomic_fetch_add(&pool->cnt.allocs, cnt, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+/* push cnt buffers, into the calling thread's magazine while it has room and
+ * the rest straight onto the freelist; bad and still referenced buffers are
+ * skipped and runs of the others in between go onto the freelist together
+ */
+static int bf_dma_mag_push_bulk(bf_huge_pool_t *pool, void **buf_ptr,
+                                int cnt) {
+  bf_dma_mag_t *mag = bf_dma_mag_get(pool);
+  int i, held, run = 0, freed = 0, pushed = 0, rc = 0;
+
+  for (i = 0; i < cnt; i++) {
+    held = bf_dma_mark_free(pool, buf_ptr[i]);
+    if (held) {
+      if (bf_push_free_bufs(pool, &buf_ptr[i - run], run) == 0) {
+        pushed += run;
+      }
+      run = 0;
+      if (held < 0) {
+        rc = -1;
+      }
+      continue;
+    }
+    freed++;
+    if (mag && run == 0 && mag->cnt < pool->mag_depth) {
+      mag->bufs[mag->cnt++] = buf_ptr[i];
+    } else {
+      run++;
+    }
+  }
+  if (bf_push_free_bufs(pool, &buf_ptr[cnt - run], run)) {
+    rc = -1;
+  } else {
+    pushed += run;
+  }
+  bf_dma_taken_add(pool, -pushed);
+  if (mag) {
+    mag->frees += freed;
   } else {
-    *buf_ptr = (pool->pool_buf_ptr)[pool->pool_buf_offset++];
+    __atomic_fetch_add(&pool->cnt.frees, freed, __ATOMIC_RELAXED);
   }
-  /* open the gate */
-  __sync_val_compare_and_swap(&pool->pool_gate, 1, 0);
-  return err;
+  return rc;
 }
 
-static int bf_push_free_buf(bf_huge_pool_t *pool, void *buf_ptr) {
-  int err = 0;
-
-  /* close the gate to assist atomic operation */
-  do {
-  } while (__sync_val_compare_and_swap(&pool->pool_gate, 0, 1) == 1);
+/**
+ *  Return the calling thread's cached buffers to the pool
+ */
+void bf_sys_dma_pool_mag_flush(bf_sys_dma_pool_handle_t hndl) {
+  bf_huge_pool_t *dma_pool = (bf_huge_pool_t *)hndl;
+  bf_dma_mag_t *mag;
 
-  if (pool->pool_buf_offset == 0 ||
-      pool->pool_buf_offset > (uint32_t)(pool->buf_cnt)) {
-    err = -1;
-  } else {
-    pool->pool_buf_offset--;
-    (pool->pool_buf_ptr)[pool->pool_buf_offset] = buf_ptr;
+  assert(dma_pool);
+  if (dma_pool->mag_depth == 0 || bf_dma_mag_slot < 0) {
+    return;
+  }
+  mag = dma_pool->mags[bf_dma_mag_slot];
+  if (mag == NULL || mag->cnt == 0) {
+    return;
+  }
+  if (bf_push_free_bufs(dma_pool, mag->bufs, mag->cnt) == 0) {
+    bf_dma_taken_add(dma_pool, -mag->cnt);
+    mag->cnt = 0;
   }
-
-  /* open the gate */
-  __sync_val_compare_and_swap(&pool->pool_gate, 1, 0);
-  return err;
 }
 
 /**
@@ -540,7 +3182,9 @@ int bf_sys_dma_alloc(bf_sys_dma_pool_handle_t hndl, size_t size, void **v_addr,
 
   assert(size <= dma_pool->buf_size);
 
-  if (bf_pop_free_buf(dma_pool, v_addr) < 0) {
+  if ((__atomic_load_n(&dma_pool->cold, __ATOMIC_ACQUIRE) &&
+       bf_dma_pool_warm(dma_pool)) ||
+      bf_dma_mag_pop(dma_pool, v_addr) < 0) {
     *v_addr = NULL;
     *phys_addr = 0;
     return -1;
@@ -557,21 +3201,82 @@ int bf_sys_dma_alloc(bf_sys_dma_pool_handle_t hndl, size_t size, void **v_addr,
   return 0;
 }
 
+/**
+ *  Allocate a burst of buffers from a DMA memory pool
+ */
+int bf_sys_dma_alloc_bulk(bf_sys_dma_pool_handle_t hndl, int cnt,
+                          void **v_addrs, bf_phys_addr_t *phys_addrs) {
+  bf_huge_pool_t *dma_pool = (bf_huge_pool_t *)hndl;
+  bf_huge_page_info_t *page_info = NULL;
+  uint8_t *pool_base_vaddr;
+  size_t page_index, last_page_index = (size_t)-1;
+  int i;
+
+  assert(dma_pool);
+  assert(v_addrs);
+  assert(phys_addrs);
+
+  if (cnt <= 0) {
+    return cnt == 0 ? 0 : -1;
+  }
+  if (__atomic_load_n(&dma_pool->cold, __ATOMIC_ACQUIRE) &&
+      bf_dma_pool_warm(dma_pool)) {
+    return -1;
+  }
+  if (bf_dma_mag_pop_bulk(dma_pool, v_addrs, cnt) < 0) {
+    return -1;
+  }
+  /* single pass over the huge page table, buffers popped together mostly
+   * sit on the same huge page
+   */
+  pool_base_vaddr = dma_pool->buf_start - dma_pool->pool_hdr_offset;
+  for (i = 0; i < cnt; i++) {
+    page_index =
+        (size_t)((uint8_t *)v_addrs[i] - pool_base_vaddr) >>
+        dma_pool->page_shift;
+    if (page_index != last_page_index) {
+      assert(page_index < (size_t)dma_pool->num_huge_pages);
+      page_info = &dma_pool->huge_page_info_ptr[page_index];
+      last_page_index = page_index;
+    }
+    phys_addrs[i] = page_info->base_dma_addr +
+                    (size_t)((uint8_t *)v_addrs[i] -
+                             (uint8_t *)page_info->base_virt_addr);
+  }
+  return 0;
+}
+
+/**
+ *  Free a burst of buffers into a DMA memory pool
+ */
+void bf_sys_dma_free_bulk(bf_sys_dma_pool_handle_t hndl, int cnt,
+                          void **v_addrs) {
+  bf_huge_pool_t *dma_pool = (bf_huge_pool_t *)hndl;
+  assert(dma_pool);
+  assert(cnt == 0 || v_addrs);
+
+  if (cnt <= 0) {
+    return;
+  }
+  bf_dma_mag_push_bulk(dma_pool, v_addrs, cnt);
+}
+
 /**
  *  Map a buffer to an index within the buffer pool.
  */
 int bf_sys_dma_buffer_index(bf_sys_dma_pool_handle_t hndl, void *v_addr) {
   char *buff_v_addr;
   char *pool_v_addr;
-  ptrdiff_t idx;
+  size_t idx;
 
   bf_huge_pool_t *dma_pool = (bf_huge_pool_t *)hndl;
   assert(dma_pool);
   buff_v_addr = v_addr;
   pool_v_addr = dma_pool->pool_ptr;
-  idx = (buff_v_addr - pool_v_addr) / dma_pool->buf_size;
-  assert(idx >= 0 && idx < dma_pool->buf_cnt);
-  return idx;
+  assert(buff_v_addr >= pool_v_addr);
+  idx = bf_dma_slot_idx(dma_pool, (size_t)(buff_v_addr - pool_v_addr));
+  assert(idx < (size_t)dma_pool->buf_cnt);
+  return (int)idx;
 }
 
 /**
@@ -590,7 +3295,7 @@ int bf_sys_dma_get_phy_addr_from_pool(bf_sys_dma_pool_handle_t hndl,
   assert(v_addr);
   pool_base_vaddr = dma_pool->buf_start - dma_pool->pool_hdr_offset;
   delta = (size_t)((uint8_t *)v_addr - pool_base_vaddr);
-  page_index = delta / BF_HUGE_PAGE_SIZE;
+  page_index = delta >> dma_pool->page_shift;
   /* v_addr must belong to this pool */
   assert(page_index < dma_pool->num_huge_pages);
   base_phy_addr = dma_pool->huge_page_info_ptr[page_index].base_dma_addr;
@@ -601,6 +3306,63 @@ int bf_sys_dma_get_phy_addr_from_pool(bf_sys_dma_pool_handle_t hndl,
   return 0;
 }
 
+/**
+ *  Split a virtual address range of a pool into dma contiguous ranges
+ */
+int bf_sys_dma_sg_build(bf_sys_dma_pool_handle_t hndl, void *v_addr,
+                        size_t len, bf_sys_dma_sg_t *sg, int max) {
+  bf_huge_pool_t *dma_pool = (bf_huge_pool_t *)hndl;
+  bf_huge_page_info_t *page_info;
+  uint8_t *pool_base_vaddr, *va = v_addr;
+  bf_dma_addr_t dma_addr;
+  size_t page, last_page, off, chunk;
+  int n = 0;
+
+  assert(dma_pool);
+  assert(sg || max == 0);
+  if (len == 0) {
+    return 0;
+  }
+  /* a cold pool's pages are not bus mapped yet */
+  if (__atomic_load_n(&dma_pool->cold, __ATOMIC_ACQUIRE)) {
+    return -1;
+  }
+  pool_base_vaddr = dma_pool->buf_start - dma_pool->pool_hdr_offset;
+  if (va < pool_base_vaddr) {
+    return -1;
+  }
+  page = (size_t)(va - pool_base_vaddr) >> dma_pool->page_shift;
+  last_page = (size_t)(va + len - 1 - pool_base_vaddr) >> dma_pool->page_shift;
+  if (last_page >= (size_t)__atomic_load_n(&dma_pool->num_huge_pages,
+                                           __ATOMIC_ACQUIRE)) {
+    return -1;
+  }
+  /* one page at a time, extending the last entry while the pages are
+   * contiguous in dma address space
+   */
+  for (; page <= last_page; page++) {
+    page_info = &dma_pool->huge_page_info_ptr[page];
+    off = (size_t)(va - (uint8_t *)page_info->base_virt_addr);
+    dma_addr = page_info->base_dma_addr + off;
+    chunk = dma_pool->page_size - off;
+    if (chunk > len) {
+      chunk = len;
+    }
+    if (n > 0 && sg[n - 1].dma_addr + sg[n - 1].len == dma_addr) {
+      sg[n - 1].len += chunk;
+    } else if (n == max) {
+      return -1;
+    } else {
+      sg[n].dma_addr = dma_addr;
+      sg[n].len = chunk;
+      n++;
+    }
+    va += chunk;
+    len -= chunk;
+  }
+  return n;
+}
+
 /**
  *  Free a buffer into a DMA memory pool
  */
@@ -609,7 +3371,38 @@ void bf_sys_dma_free(bf_sys_dma_pool_handle_t hndl, void *v_addr) {
   assert(dma_pool);
   assert(v_addr);
 
-  bf_push_free_buf(dma_pool, v_addr);
+  bf_dma_mag_push(dma_pool, v_addr);
+}
+
+/**
+ *  Take another reference to a buffer of a reference counted pool
+ */
+int bf_sys_dma_buf_ref(bf_sys_dma_pool_handle_t hndl, void *v_addr) {
+  bf_huge_pool_t *dma_pool = (bf_huge_pool_t *)hndl;
+  size_t idx;
+  uint32_t ref;
+
+  assert(dma_pool);
+  if (dma_pool->refcnt == NULL || bf_dma_buf_slot(dma_pool, v_addr, &idx)) {
+    return -1;
+  }
+  ref = __atomic_load_n(&dma_pool->refcnt[idx], __ATOMIC_RELAXED);
+  do {
+    /* a free buffer cannot be referenced */
+    if (ref == 0 || ref == UINT32_MAX) {
+      return -1;
+    }
+  } while (!__atomic_compare_exchange_n(&dma_pool->refcnt[idx], &ref, ref + 1,
+                                        1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+  return 0;
+}
+
+/**
+ *  Drop a reference to a buffer of a reference counted pool
+ */
+void bf_sys_dma_buf_unref(bf_sys_dma_pool_handle_t hndl, void *v_addr) {
+  bf_sys_dma_free(hndl, v_addr);
 }
 
 /* convenient wrapper APIs if the pool needs just one buffer */
@@ -641,20 +3434,307 @@ void bf_sys_dma_buffer_free(bf_sys_dma_pool_handle_t hndl, void *v_addr) {
   bf_sys_dma_pool_destroy(hndl);
 }
 
+/* check that a virtual address lies within the huge pages of a pool */
+static int bf_dma_pool_holds(bf_huge_pool_t *dma_pool, const void *v_addr) {
+  uint8_t *pool_base_vaddr = dma_pool->buf_start - dma_pool->pool_hdr_offset;
+  size_t size = (size_t)__atomic_load_n(&dma_pool->num_huge_pages,
+                                        __ATOMIC_ACQUIRE)
+                << dma_pool->page_shift;
+
+  return (const uint8_t *)v_addr >= pool_base_vaddr &&
+         (const uint8_t *)v_addr < pool_base_vaddr + size;
+}
+
+/**
+ * Look up the physical address of each pinned page, reading their pagemap
+ * entries at once
+ * @return Status 0 on success, -1 if the addresses cannot be read
+ */
+static int bf_dma_map_phys(uintptr_t start, size_t len,
+                           bf_phys_addr_t *phys_addrs) {
+  size_t page_size = getpagesize();
+  int i, cnt = len / page_size;
+
+  if (bf_mem_virt2phy_range((void *)start, page_size, cnt, phys_addrs)) {
+    return -1;
+  }
+  for (i = 0; i < cnt; i++) {
+    /* page frame numbers read as 0 without CAP_SYS_ADMIN */
+    if (phys_addrs[i] < page_size) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* bus map the pinned pages of a mapping with the range map function, the
+ * pages need not be physically contiguous
+ */
+static int bf_dma_map_bus_map_range(bf_dma_map_ent_t *ent) {
+  size_t page_size = getpagesize();
+  int i, cnt = ent->pin_len / page_size;
+  bf_dma_addr_t *dma_addrs;
+  int ret = -1;
+
+  dma_addrs = bf_sys_calloc(cnt, sizeof(bf_dma_addr_t));
+  if (dma_addrs) {
+    ret = bf_sys_dma_map_range_fn(ent->dev_id, ent->subdev_id,
+                                  ent->phys_addrs, cnt, page_size, dma_addrs)
+              ? -1
+              : 0;
+  }
+  /* the range is handed out as a single dma address */
+  for (i = 1; i < cnt && ret == 0; i++) {
+    if (dma_addrs[i] != dma_addrs[0] + (size_t)i * page_size) {
+      if (bf_sys_dma_unmap_range_fn) {
+        bf_sys_dma_unmap_range_fn(ent->dev_id, ent->subdev_id, dma_addrs, cnt,
+                                  page_size);
+      }
+      ret = -1;
+    }
+  }
+  if (ret == 0) {
+    ent->dma_addr = dma_addrs[0];
+  }
+  bf_sys_free(dma_addrs);
+  return ret;
+}
+
+/* bus map the pinned pages of a mapping, in one call */
+static int bf_dma_map_bus_map(bf_dma_map_ent_t *ent) {
+  size_t page_size = getpagesize();
+  int i, cnt = ent->pin_len / page_size;
+  void *dma_addr;
+
+  if (bf_sys_dma_map_range_fn) {
+    return bf_dma_map_bus_map_range(ent);
+  }
+  /* without an iommu, or with a map function taking a single physical
+   * address, the range has to be physically contiguous
+   */
+  for (i = 1; i < cnt; i++) {
+    if (ent->phys_addrs[i] != ent->phys_addrs[0] + (size_t)i * page_size) {
+      return -1;
+    }
+  }
+  ent->dma_addr = (bf_dma_addr_t)ent->phys_addrs[0];
+  if (bf_sys_dma_map_fn) {
+    if (bf_sys_dma_map_fn(ent->dev_id, ent->subdev_id,
+                          (void *)(uintptr_t)ent->phys_addrs[0], ent->pin_len,
+                          &dma_addr)) {
+      return -1;
+    }
+    ent->dma_addr = (bf_dma_addr_t)(uintptr_t)dma_addr;
+  }
+  return 0;
+}
+
+static void bf_dma_map_bus_unmap(bf_dma_map_ent_t *ent) {
+  size_t page_size = getpagesize();
+  int i, cnt = ent->pin_len / page_size;
+  bf_dma_addr_t *dma_addrs;
+
+  if (bf_sys_dma_unmap_range_fn) {
+    dma_addrs = bf_sys_calloc(cnt, sizeof(bf_dma_addr_t));
+    if (dma_addrs == NULL) {
+      printf("error allocating the dma unmap range\n");
+      assert(0);
+      return;
+    }
+    for (i = 0; i < cnt; i++) {
+      dma_addrs[i] = ent->dma_addr + (size_t)i * page_size;
+    }
+    bf_sys_dma_unmap_range_fn(ent->dev_id, ent->subdev_id, dma_addrs, cnt,
+                              page_size);
+    bf_sys_free(dma_addrs);
+  } else if (bf_sys_dma_unmap_fn) {
+    bf_sys_dma_unmap_fn(ent->dev_id, ent->subdev_id,
+                        (void *)(uintptr_t)ent->dma_addr, ent->pin_len);
+  }
+}
+
+/* move a mapping to the front of the recency list, called with
+ * bf_dma_map_lock held
+ */
+static void bf_dma_map_touch(bf_dma_map_ent_t *ent) {
+  if (bf_dma_map_list == ent) {
+    return;
+  }
+  if (ent->prev) {
+    ent->prev->next = ent->next;
+  }
+  if (ent->next) {
+    ent->next->prev = ent->prev;
+  }
+  ent->prev = NULL;
+  ent->next = bf_dma_map_list;
+  if (bf_dma_map_list) {
+    bf_dma_map_list->prev = ent;
+  }
+  bf_dma_map_list = ent;
+}
+
+/* unpin the pages of a mapping no longer on the recency list, skipping the
+ * pages another mapping still pins since mlock does not nest, called with
+ * bf_dma_map_lock held
+ */
+static void bf_dma_map_unpin(bf_dma_map_ent_t *ent) {
+  size_t page_size = getpagesize();
+  uintptr_t page, run = 0;
+  uintptr_t end = ent->pin_start + ent->pin_len;
+  bf_dma_map_ent_t *other;
+
+  for (page = ent->pin_start; page <= end; page += page_size) {
+    for (other = bf_dma_map_list; page < end && other; other = other->next) {
+      if (page >= other->pin_start &&
+          page < other->pin_start + other->pin_len) {
+        break;
+      }
+    }
+    /* a page pinned by another mapping, or the end, closes the run of pages
+     * to unpin
+     */
+    if (page < end && other == NULL) {
+      if (run == 0) {
+        run = page;
+      }
+    } else if (run) {
+      /* the caller may have unmapped the memory already */
+      munlock((void *)run, page - run);
+      run = 0;
+    }
+  }
+}
+
+/* unlink an unused mapping, bus unmap and unpin it, called with
+ * bf_dma_map_lock held
+ */
+static void bf_dma_map_release(bf_dma_map_ent_t *ent) {
+  if (ent->prev) {
+    ent->prev->next = ent->next;
+  } else {
+    bf_dma_map_list = ent->next;
+  }
+  if (ent->next) {
+    ent->next->prev = ent->prev;
+  }
+  bf_dma_map_idle--;
+  bf_dma_map_bus_unmap(ent);
+  bf_dma_map_unpin(ent);
+  bf_sys_free(ent);
+}
+
+/* evict the least recently used unused mappings beyond max, called with
+ * bf_dma_map_lock held
+ */
+static void bf_dma_map_evict(int max) {
+  bf_dma_map_ent_t *ent, *prev;
+
+  for (ent = bf_dma_map_list; ent && ent->next; ent = ent->next) {
+  }
+  for (; ent && bf_dma_map_idle > max; ent = prev) {
+    prev = ent->prev;
+    if (ent->users == 0) {
+      bf_dma_map_release(ent);
+    }
+  }
+}
+
+/**
+ * Pin, look up and bus map caller owned memory
+ * @return the new mapping, NULL on failure
+ */
+static bf_dma_map_ent_t *bf_dma_map_create(int dev_id, uint32_t subdev_id,
+                                           uintptr_t vaddr, size_t len,
+                                           bf_sys_dma_dir_t dir) {
+  size_t page_size = getpagesize();
+  uintptr_t pin_start = vaddr & ~(page_size - 1);
+  size_t pin_len = ALIGN_TO_PAGE_SIZE(vaddr + len, page_size) - pin_start;
+  bf_dma_map_ent_t *ent;
+
+  ent = bf_sys_calloc(1, sizeof(bf_dma_map_ent_t) +
+                             pin_len / page_size * sizeof(bf_phys_addr_t));
+  if (ent == NULL) {
+    return NULL;
+  }
+  ent->dev_id = dev_id;
+  ent->subdev_id = subdev_id;
+  ent->vaddr = vaddr;
+  ent->len = len;
+  ent->dir = dir;
+  ent->pin_start = pin_start;
+  ent->pin_len = pin_len;
+  /* pinning faults the pages in, keeping them at their physical address */
+  if (mlock((void *)ent->pin_start, ent->pin_len)) {
+    printf("%s(): cannot pin %p: %s\n", __func__, (void *)vaddr,
+           strerror(errno));
+    bf_sys_free(ent);
+    return NULL;
+  }
+  if (bf_dma_map_phys(ent->pin_start, ent->pin_len, ent->phys_addrs) ||
+      bf_dma_map_bus_map(ent)) {
+    printf("%s(): cannot map %p, %zu bytes\n", __func__, (void *)vaddr, len);
+    bf_dma_map_unpin(ent);
+    bf_sys_free(ent);
+    return NULL;
+  }
+  return ent;
+}
+
 /**
  * bus map a buffer
  */
 int bf_sys_dma_map(bf_sys_dma_pool_handle_t hndl, const void *cpu_vaddr,
                    const bf_phys_addr_t phys_addr, size_t size,
                    bf_dma_addr_t *dma_addr, bf_sys_dma_dir_t direction) {
-  /* Since for our implementation, the physical and the DMA addresses are the
-     same,
-     just return the physical address as the DMA address */
-  *dma_addr = (bf_dma_addr_t)phys_addr;
-  (void)cpu_vaddr;
-  (void)hndl;
-  (void)size;
-  (void)direction;
+  bf_huge_pool_t *dma_pool = (bf_huge_pool_t *)hndl;
+  uintptr_t vaddr = (uintptr_t)cpu_vaddr;
+  bf_dma_map_ent_t *ent;
+  int dev_id = dma_pool ? dma_pool->dev_id : 0;
+  uint32_t subdev_id = dma_pool ? dma_pool->subdev_id : 0;
+
+  assert(dma_addr);
+  /* pool buffers are bus mapped along with the pool's huge pages, and the
+   * physical address of their allocation is their dma address
+   */
+  if (dma_pool && bf_dma_pool_holds(dma_pool, cpu_vaddr)) {
+    *dma_addr = (bf_dma_addr_t)phys_addr;
+    return 0;
+  }
+  if (cpu_vaddr == NULL || size == 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&bf_dma_map_lock);
+  for (ent = bf_dma_map_list; ent; ent = ent->next) {
+    if (ent->vaddr == vaddr && ent->len == size && ent->dir == direction &&
+        ent->dev_id == dev_id && ent->subdev_id == subdev_id) {
+      break;
+    }
+  }
+  /* a hit is not looked up again, callers flush the cache before they
+   * release or remap memory that was bus mapped
+   */
+  if (ent == NULL) {
+    ent = bf_dma_map_create(dev_id, subdev_id, vaddr, size, direction);
+    if (ent == NULL) {
+      pthread_mutex_unlock(&bf_dma_map_lock);
+      return -1;
+    }
+    /* counted as unused until taken below */
+    bf_dma_map_idle++;
+    ent->next = bf_dma_map_list;
+    if (bf_dma_map_list) {
+      bf_dma_map_list->prev = ent;
+    }
+    bf_dma_map_list = ent;
+  }
+  if (ent->users++ == 0) {
+    bf_dma_map_idle--;
+  }
+  bf_dma_map_touch(ent);
+  *dma_addr = ent->dma_addr + (vaddr - ent->pin_start);
+  pthread_mutex_unlock(&bf_dma_map_lock);
   return 0;
 }
 
@@ -663,24 +3743,317 @@ int bf_sys_dma_map(bf_sys_dma_pool_handle_t hndl, const void *cpu_vaddr,
  */
 int bf_sys_dma_unmap(bf_sys_dma_pool_handle_t hndl, const void *cpu_vaddr,
                      size_t size, bf_sys_dma_dir_t direction) {
-  /* nothing to do for this platform */
-  (void)hndl;
-  (void)cpu_vaddr;
-  (void)size;
-  (void)direction;
+  bf_huge_pool_t *dma_pool = (bf_huge_pool_t *)hndl;
+  uintptr_t vaddr = (uintptr_t)cpu_vaddr;
+  bf_dma_map_ent_t *ent;
+  int dev_id = dma_pool ? dma_pool->dev_id : 0;
+  uint32_t subdev_id = dma_pool ? dma_pool->subdev_id : 0;
+
+  if (dma_pool && bf_dma_pool_holds(dma_pool, cpu_vaddr)) {
+    return 0;
+  }
+  pthread_mutex_lock(&bf_dma_map_lock);
+  for (ent = bf_dma_map_list; ent; ent = ent->next) {
+    if (ent->vaddr == vaddr && ent->len == size && ent->dir == direction &&
+        ent->dev_id == dev_id && ent->subdev_id == subdev_id &&
+        ent->users > 0) {
+      break;
+    }
+  }
+  if (ent == NULL) {
+    pthread_mutex_unlock(&bf_dma_map_lock);
+    return -1;
+  }
+  /* keep the mapping for the next bf_sys_dma_map of the same range */
+  if (--ent->users == 0) {
+    bf_dma_map_idle++;
+    bf_dma_map_evict(BF_DMA_MAP_CACHE_MAX);
+  }
+  pthread_mutex_unlock(&bf_dma_map_lock);
   return 0;
 }
 
+/**
+ *  Release the cached bus mappings of caller owned memory
+ */
+void bf_sys_dma_map_cache_flush(void) {
+  pthread_mutex_lock(&bf_dma_map_lock);
+  bf_dma_map_evict(0);
+  pthread_mutex_unlock(&bf_dma_map_lock);
+}
+
+typedef void (*bf_dma_copy_fn)(void *dst, const void *src, size_t len);
+
+#if defined(__x86_64__)
+/* Non-temporal copies: streaming stores fill the dma buffer without pulling
+ * its lines into the cache, streaming loads read write combining memory
+ * without polluting the cache and behave as plain loads otherwise. Each
+ * routine copies the head with memcpy up to the alignment of the streamed
+ * side and the tail with memcpy.
+ */
+__attribute__((target("avx512f"))) static void bf_dma_copy_to_dev_avx512(
+    void *dst, const void *src, size_t len) {
+  uint8_t *d = dst;
+  const uint8_t *s = src;
+  size_t head = -(uintptr_t)d & 63;
+
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  len -= head;
+  for (; len >= 256; d += 256, s += 256, len -= 256) {
+    __m512i v0 = _mm512_loadu_si512((const void *)s);
+    __m512i v1 = _mm512_loadu_si512((const void *)(s + 64));
+    __m512i v2 = _mm512_loadu_si512((const void *)(s + 128));
+    __m512i v3 = _mm512_loadu_si512((const void *)(s + 192));
+    _mm512_stream_si512((void *)d, v0);
+    _mm512_stream_si512((void *)(d + 64), v1);
+    _mm512_stream_si512((void *)(d + 128), v2);
+    _mm512_stream_si512((void *)(d + 192), v3);
+  }
+  for (; len >= 64; d += 64, s += 64, len -= 64) {
+    _mm512_stream_si512((void *)d, _mm512_loadu_si512((const void *)s));
+  }
+  _mm_sfence();
+  memcpy(d, s, len);
+}
+
+__attribute__((target("avx512f"))) static void bf_dma_copy_from_dev_avx512(
+    void *dst, const void *src, size_t len) {
+  uint8_t *d = dst;
+  const uint8_t *s = src;
+  size_t head = -(uintptr_t)s & 63;
+
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  len -= head;
+  for (; len >= 64; d += 64, s += 64, len -= 64) {
+    _mm512_storeu_si512((void *)d, _mm512_stream_load_si512((void *)s));
+  }
+  memcpy(d, s, len);
+}
+
+__attribute__((target("avx2"))) static void bf_dma_copy_to_dev_avx2(
+    void *dst, const void *src, size_t len) {
+  uint8_t *d = dst;
+  const uint8_t *s = src;
+  size_t head = -(uintptr_t)d & 31;
+
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  len -= head;
+  for (; len >= 128; d += 128, s += 128, len -= 128) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i *)s);
+    __m256i v1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+    __m256i v2 = _mm256_loadu_si256((const __m256i *)(s + 64));
+    __m256i v3 = _mm256_loadu_si256((const __m256i *)(s + 96));
+    _mm256_stream_si256((__m256i *)d, v0);
+    _mm256_stream_si256((__m256i *)(d + 32), v1);
+    _mm256_stream_si256((__m256i *)(d + 64), v2);
+    _mm256_stream_si256((__m256i *)(d + 96), v3);
+  }
+  for (; len >= 32; d += 32, s += 32, len -= 32) {
+    _mm256_stream_si256((__m256i *)d,
+                        _mm256_loadu_si256((const __m256i *)s));
+  }
+  _mm_sfence();
+  memcpy(d, s, len);
+}
+
+__attribute__((target("avx2"))) static void bf_dma_copy_from_dev_avx2(
+    void *dst, const void *src, size_t len) {
+  uint8_t *d = dst;
+  const uint8_t *s = src;
+  size_t head = -(uintptr_t)s & 31;
+
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  len -= head;
+  for (; len >= 32; d += 32, s += 32, len -= 32) {
+    _mm256_storeu_si256((__m256i *)d,
+                        _mm256_stream_load_si256((const __m256i *)s));
+  }
+  memcpy(d, s, len);
+}
+
+/* SSE2 streaming stores are there on any x86_64 cpu */
+static void bf_dma_copy_to_dev_sse2(void *dst, const void *src, size_t len) {
+  uint8_t *d = dst;
+  const uint8_t *s = src;
+  size_t head = -(uintptr_t)d & 15;
+
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  len -= head;
+  for (; len >= 64; d += 64, s += 64, len -= 64) {
+    __m128i v0 = _mm_loadu_si128((const __m128i *)s);
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(s + 16));
+    __m128i v2 = _mm_loadu_si128((const __m128i *)(s + 32));
+    __m128i v3 = _mm_loadu_si128((const __m128i *)(s + 48));
+    _mm_stream_si128((__m128i *)d, v0);
+    _mm_stream_si128((__m128i *)(d + 16), v1);
+    _mm_stream_si128((__m128i *)(d + 32), v2);
+    _mm_stream_si128((__m128i *)(d + 48), v3);
+  }
+  _mm_sfence();
+  memcpy(d, s, len);
+}
+#endif /* __x86_64__ */
+
+static void bf_dma_copy_memcpy(void *dst, const void *src, size_t len) {
+  memcpy(dst, src, len);
+}
+
+static bf_dma_copy_fn bf_dma_copy_to_dev_fn = NULL;
+static bf_dma_copy_fn bf_dma_copy_from_dev_fn = NULL;
+static pthread_once_t bf_dma_copy_once = PTHREAD_ONCE_INIT;
+
+/* pick the widest copy routines the cpu supports */
+static void bf_dma_copy_select(void) {
+  bf_dma_copy_to_dev_fn = bf_dma_copy_memcpy;
+  bf_dma_copy_from_dev_fn = bf_dma_copy_memcpy;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    bf_dma_copy_to_dev_fn = bf_dma_copy_to_dev_avx512;
+    bf_dma_copy_from_dev_fn = bf_dma_copy_from_dev_avx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    bf_dma_copy_to_dev_fn = bf_dma_copy_to_dev_avx2;
+    bf_dma_copy_from_dev_fn = bf_dma_copy_from_dev_avx2;
+  } else {
+    bf_dma_copy_to_dev_fn = bf_dma_copy_to_dev_sse2;
+  }
+#endif
+}
+
+/**
+ *  Copy into a dma buffer without caching it
+ */
+void *bf_sys_dma_copy_to_dev(void *dst, const void *src, size_t len) {
+  if (len < BF_DMA_NT_COPY_MIN) {
+    return memcpy(dst, src, len);
+  }
+  pthread_once(&bf_dma_copy_once, bf_dma_copy_select);
+  bf_dma_copy_to_dev_fn(dst, src, len);
+  return dst;
+}
+
+/**
+ *  Copy out of a dma buffer without caching it
+ */
+void *bf_sys_dma_copy_from_dev(void *dst, const void *src, size_t len) {
+  if (len < BF_DMA_NT_COPY_MIN) {
+    return memcpy(dst, src, len);
+  }
+  pthread_once(&bf_dma_copy_once, bf_dma_copy_select);
+  bf_dma_copy_from_dev_fn(dst, src, len);
+  return dst;
+}
+
+#if defined(__x86_64__)
+#define BF_DMA_CPUID7_CLFLUSHOPT (1U << 23)
+#define BF_DMA_CPUID7_CLWB (1U << 24)
+
+/* cache line write back and flush instructions the cpu has, cpuid leaf 7 */
+static unsigned int bf_dma_cpuid7_ebx(void) {
+  static int done = 0;
+  static unsigned int features = 0;
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+      features = ebx;
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+  }
+  return features;
+}
+
+__attribute__((target("clwb"))) static void bf_dma_clwb(uint8_t *p,
+                                                        uint8_t *end) {
+  for (; p < end; p += BF_DMA_CACHE_LINE_SIZE) {
+    _mm_clwb(p);
+  }
+}
+
+__attribute__((target("clflushopt"))) static void bf_dma_clflushopt(
+    uint8_t *p, uint8_t *end) {
+  for (; p < end; p += BF_DMA_CACHE_LINE_SIZE) {
+    _mm_clflushopt(p);
+  }
+}
+
+static void bf_dma_clflush(uint8_t *p, uint8_t *end) {
+  for (; p < end; p += BF_DMA_CACHE_LINE_SIZE) {
+    _mm_clflush(p);
+  }
+}
+#endif /* __x86_64__ */
+
+/**
+ * Write the dirty cache lines of a buffer back to memory for a device that
+ * does not snoop the cpu caches; the lines stay cached where clwb is
+ * available
+ */
 int bf_sys_dma_cache_flush(void *cpu_vaddr, size_t size) {
+#if defined(__x86_64__)
+  uint8_t *p, *end;
+  unsigned int features;
+
+  if (size == 0) {
+    return 0;
+  }
+  p = (uint8_t *)((uintptr_t)cpu_vaddr & ~(uintptr_t)(BF_DMA_CACHE_LINE_SIZE -
+                                                     1));
+  end = (uint8_t *)cpu_vaddr + size;
+  features = bf_dma_cpuid7_ebx();
+  if (features & BF_DMA_CPUID7_CLWB) {
+    bf_dma_clwb(p, end);
+  } else if (features & BF_DMA_CPUID7_CLFLUSHOPT) {
+    bf_dma_clflushopt(p, end);
+  } else {
+    bf_dma_clflush(p, end);
+  }
+  /* order the write backs before the doorbell write that follows */
+  _mm_sfence();
+#else
   /* nothing to do for this platform */
   (void)cpu_vaddr;
   (void)size;
+#endif
   return 0;
 }
 
+/**
+ * Drop the cache lines of a buffer so that the cpu reads what a device that
+ * does not snoop the cpu caches wrote to memory
+ */
 int bf_sys_dma_cache_invalidate(void *cpu_vaddr, size_t size) {
+#if defined(__x86_64__)
+  uint8_t *p, *end;
+
+  if (size == 0) {
+    return 0;
+  }
+  p = (uint8_t *)((uintptr_t)cpu_vaddr & ~(uintptr_t)(BF_DMA_CACHE_LINE_SIZE -
+                                                     1));
+  end = (uint8_t *)cpu_vaddr + size;
+  /* x86 has no invalidate without write back, flushing drops the lines */
+  if (bf_dma_cpuid7_ebx() & BF_DMA_CPUID7_CLFLUSHOPT) {
+    bf_dma_clflushopt(p, end);
+  } else {
+    bf_dma_clflush(p, end);
+  }
+  /* no load of the buffer may pass the flushes */
+  _mm_mfence();
+#else
   /* nothing to do for this platform */
   (void)cpu_vaddr;
   (void)size;
+#endif
   return 0;
 }
@@ -0,0 +1,354 @@
+/*******************************************************************************
+ * Copyright(c) 2021 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this software except as stipulated in the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ******************************************************************************/
+
+/*!
+ * @file bf_sys_dma_malloc.c
+ * @date
+ *
+ * Variable size DMA memory allocator. An arena draws 2MB chunks from a DMA
+ * pool and carves them with a buddy allocator, so that DMA users of mixed
+ * sizes share huge pages instead of each holding a pool of its own.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <target-sys/bf_sal/bf_sys_dma.h>
+#include <target-sys/bf_sal/bf_sys_mem.h>
+
+/* smallest block handed out, one cache line */
+#define BF_DMA_MALLOC_MIN_ORDER 6
+/* chunks are one 2MB huge page, the largest block */
+#define BF_DMA_MALLOC_MAX_ORDER 21
+#define BF_DMA_MALLOC_CHUNK_SIZE (1UL << BF_DMA_MALLOC_MAX_ORDER)
+#define BF_DMA_MALLOC_ORDERS                                                   \
+  (BF_DMA_MALLOC_MAX_ORDER - BF_DMA_MALLOC_MIN_ORDER + 1)
+#define BF_DMA_MALLOC_BLKS_PER_CHUNK                                           \
+  (BF_DMA_MALLOC_CHUNK_SIZE >> BF_DMA_MALLOC_MIN_ORDER)
+/* marks a free block in the chunk's block order table */
+#define BF_DMA_MALLOC_BLK_FREE 0x80
+
+/**
+ * free block, the links live in the free DMA memory itself
+ */
+typedef struct bf_dma_free_blk_s {
+  struct bf_dma_free_blk_s *next;
+  struct bf_dma_free_blk_s *prev;
+} bf_dma_free_blk_t;
+
+/**
+ * chunk of the arena, one buffer of the backing pool
+ */
+typedef struct {
+  uint8_t *vaddr;      /* virtual address of the chunk */
+  bf_phys_addr_t phys; /* physical address of the chunk */
+  size_t used;         /* bytes allocated out of the chunk */
+  /* order of the block starting at each minimum sized block, with
+   * BF_DMA_MALLOC_BLK_FREE set for free blocks; only block starts are valid
+   */
+  uint8_t blk_order[BF_DMA_MALLOC_BLKS_PER_CHUNK];
+} bf_dma_chunk_t;
+
+typedef struct {
+  bf_sys_dma_pool_handle_t pool; /* pool of chunks backing the arena */
+  int chunk_cnt;                 /* number of chunks in the pool */
+  bf_dma_chunk_t **chunks;       /* chunks in use, by pool buffer index */
+  bf_dma_chunk_t *spare;         /* empty chunk kept, NULL if none */
+  uint8_t *lo, *hi;              /* span of the chunks drawn so far */
+  bf_dma_free_blk_t free_list[BF_DMA_MALLOC_ORDERS]; /* free blocks by order */
+  pthread_mutex_t lock;
+} bf_dma_arena_t;
+
+static void bf_dma_blk_link(bf_dma_arena_t *arena, bf_dma_free_blk_t *blk,
+                            int order) {
+  bf_dma_free_blk_t *head = &arena->free_list[order - BF_DMA_MALLOC_MIN_ORDER];
+
+  blk->next = head->next;
+  blk->prev = head;
+  head->next->prev = blk;
+  head->next = blk;
+}
+
+static void bf_dma_blk_unlink(bf_dma_free_blk_t *blk) {
+  blk->prev->next = blk->next;
+  blk->next->prev = blk->prev;
+}
+
+/* index of a block in its chunk's block order table */
+static size_t bf_dma_blk_index(bf_dma_chunk_t *chunk, void *blk) {
+  return (size_t)((uint8_t *)blk - chunk->vaddr) >> BF_DMA_MALLOC_MIN_ORDER;
+}
+
+/* chunk holding vaddr, NULL if vaddr is not in a chunk in use */
+static bf_dma_chunk_t *bf_dma_chunk_of(bf_dma_arena_t *arena, void *vaddr) {
+  bf_dma_chunk_t *chunk;
+  int idx;
+
+  if ((uint8_t *)vaddr < arena->lo || (uint8_t *)vaddr >= arena->hi) {
+    return NULL;
+  }
+  idx = bf_sys_dma_buffer_index(arena->pool, vaddr);
+  if (idx < 0 || idx >= arena->chunk_cnt) {
+    return NULL;
+  }
+  chunk = arena->chunks[idx];
+  if (chunk == NULL || (uint8_t *)vaddr < chunk->vaddr ||
+      (uint8_t *)vaddr >= chunk->vaddr + BF_DMA_MALLOC_CHUNK_SIZE) {
+    return NULL;
+  }
+  return chunk;
+}
+
+/* bring a new chunk from the pool into the arena as one free block */
+static int bf_dma_chunk_add(bf_dma_arena_t *arena) {
+  bf_dma_chunk_t *chunk;
+  void *vaddr;
+  bf_phys_addr_t phys;
+  int idx;
+
+  chunk = bf_sys_calloc(1, sizeof(bf_dma_chunk_t));
+  if (chunk == NULL) {
+    return -1;
+  }
+  if (bf_sys_dma_alloc(arena->pool, BF_DMA_MALLOC_CHUNK_SIZE, &vaddr,
+                       &phys)) {
+    bf_sys_free(chunk);
+    return -1;
+  }
+  chunk->vaddr = vaddr;
+  chunk->phys = phys;
+  if (arena->lo == NULL || chunk->vaddr < arena->lo) {
+    arena->lo = chunk->vaddr;
+  }
+  if (chunk->vaddr + BF_DMA_MALLOC_CHUNK_SIZE > arena->hi) {
+    arena->hi = chunk->vaddr + BF_DMA_MALLOC_CHUNK_SIZE;
+  }
+  chunk->blk_order[0] = BF_DMA_MALLOC_BLK_FREE | BF_DMA_MALLOC_MAX_ORDER;
+  idx = bf_sys_dma_buffer_index(arena->pool, vaddr);
+  arena->chunks[idx] = chunk;
+  bf_dma_blk_link(arena, (bf_dma_free_blk_t *)vaddr, BF_DMA_MALLOC_MAX_ORDER);
+  return 0;
+}
+
+/* return a fully free chunk to the pool */
+static void bf_dma_chunk_remove(bf_dma_arena_t *arena, bf_dma_chunk_t *chunk) {
+  int idx = bf_sys_dma_buffer_index(arena->pool, chunk->vaddr);
+
+  bf_dma_blk_unlink((bf_dma_free_blk_t *)chunk->vaddr);
+  arena->chunks[idx] = NULL;
+  bf_sys_dma_free(arena->pool, chunk->vaddr);
+  bf_sys_free(chunk);
+}
+
+/**
+ *  Create a DMA memory arena for variable size allocations
+ */
+int bf_sys_dma_arena_create(char *arena_name, bf_sys_dma_arena_handle_t *hndl,
+                            int dev_id, uint32_t subdev_id, size_t size,
+                            const bf_sys_dma_pool_attr_t *attr) {
+  bf_dma_arena_t *arena;
+  int i;
+
+  assert(hndl);
+  if (size == 0) {
+    return -1;
+  }
+  arena = bf_sys_calloc(1, sizeof(bf_dma_arena_t));
+  if (arena == NULL) {
+    return -1;
+  }
+  arena->chunk_cnt =
+      (size + BF_DMA_MALLOC_CHUNK_SIZE - 1) / BF_DMA_MALLOC_CHUNK_SIZE;
+  arena->chunks = bf_sys_calloc(arena->chunk_cnt, sizeof(bf_dma_chunk_t *));
+  if (arena->chunks == NULL) {
+    bf_sys_free(arena);
+    return -1;
+  }
+  if (bf_sys_dma_pool_create_ext(arena_name, &arena->pool, dev_id, subdev_id,
+                                 BF_DMA_MALLOC_CHUNK_SIZE, arena->chunk_cnt,
+                                 64, attr)) {
+    bf_sys_free(arena->chunks);
+    bf_sys_free(arena);
+    return -1;
+  }
+  for (i = 0; i < BF_DMA_MALLOC_ORDERS; i++) {
+    arena->free_list[i].next = arena->free_list[i].prev = &arena->free_list[i];
+  }
+  pthread_mutex_init(&arena->lock, NULL);
+  *hndl = (bf_sys_dma_arena_handle_t)arena;
+  return 0;
+}
+
+/**
+ *  Destroy a DMA memory arena
+ */
+void bf_sys_dma_arena_destroy(bf_sys_dma_arena_handle_t hndl) {
+  bf_dma_arena_t *arena = (bf_dma_arena_t *)hndl;
+  int i;
+
+  assert(arena);
+  for (i = 0; i < arena->chunk_cnt; i++) {
+    bf_sys_free(arena->chunks[i]);
+  }
+  bf_sys_dma_pool_destroy(arena->pool);
+  pthread_mutex_destroy(&arena->lock);
+  bf_sys_free(arena->chunks);
+  bf_sys_free(arena);
+}
+
+/**
+ *  Allocate a variable size buffer from a DMA memory arena
+ */
+void *bf_sys_dma_malloc(bf_sys_dma_arena_handle_t hndl, size_t size,
+                        size_t align, bf_phys_addr_t *phys_addr) {
+  bf_dma_arena_t *arena = (bf_dma_arena_t *)hndl;
+  bf_dma_free_blk_t *blk, *head;
+  bf_dma_chunk_t *chunk;
+  int order, blk_order;
+
+  assert(arena);
+  assert(phys_addr);
+  /* check if align is power of 2 */
+  if (size == 0 || size > BF_DMA_MALLOC_CHUNK_SIZE || (align & (align - 1)) ||
+      align > BF_DMA_MALLOC_CHUNK_SIZE) {
+    return NULL;
+  }
+  /* blocks are naturally aligned to their size */
+  if (size < align) {
+    size = align;
+  }
+  order = BF_DMA_MALLOC_MIN_ORDER;
+  while ((1UL << order) < size) {
+    order++;
+  }
+
+  pthread_mutex_lock(&arena->lock);
+  for (;;) {
+    /* smallest free block large enough */
+    for (blk_order = order; blk_order <= BF_DMA_MALLOC_MAX_ORDER;
+         blk_order++) {
+      head = &arena->free_list[blk_order - BF_DMA_MALLOC_MIN_ORDER];
+      if (head->next != head) {
+        break;
+      }
+    }
+    if (blk_order <= BF_DMA_MALLOC_MAX_ORDER) {
+      break;
+    }
+    if (bf_dma_chunk_add(arena)) {
+      pthread_mutex_unlock(&arena->lock);
+      return NULL;
+    }
+  }
+
+  blk = head->next;
+  bf_dma_blk_unlink(blk);
+  chunk = bf_dma_chunk_of(arena, blk);
+  if (chunk == arena->spare) {
+    arena->spare = NULL;
+  }
+  /* split, keeping the lower half and freeing the upper halves */
+  while (blk_order > order) {
+    bf_dma_free_blk_t *buddy;
+
+    blk_order--;
+    buddy = (bf_dma_free_blk_t *)((uint8_t *)blk + (1UL << blk_order));
+    chunk->blk_order[bf_dma_blk_index(chunk, buddy)] =
+        BF_DMA_MALLOC_BLK_FREE | blk_order;
+    bf_dma_blk_link(arena, buddy, blk_order);
+  }
+  chunk->blk_order[bf_dma_blk_index(chunk, blk)] = order;
+  chunk->used += 1UL << order;
+  pthread_mutex_unlock(&arena->lock);
+
+  *phys_addr = chunk->phys + (size_t)((uint8_t *)blk - chunk->vaddr);
+  return blk;
+}
+
+/**
+ *  Free a variable size buffer into a DMA memory arena
+ */
+void bf_sys_dma_mfree(bf_sys_dma_arena_handle_t hndl, void *v_addr) {
+  bf_dma_arena_t *arena = (bf_dma_arena_t *)hndl;
+  bf_sys_dma_pool_info_t info;
+  bf_dma_chunk_t *chunk;
+  uint8_t *blk = v_addr;
+  size_t offset;
+  int order;
+
+  assert(arena);
+  assert(v_addr);
+
+  pthread_mutex_lock(&arena->lock);
+  chunk = bf_dma_chunk_of(arena, blk);
+  /* only block starts have an order, of an allocated block if not free */
+  order = -1;
+  if (chunk && ((size_t)(blk - chunk->vaddr) &
+                ((1UL << BF_DMA_MALLOC_MIN_ORDER) - 1)) == 0) {
+    order = chunk->blk_order[bf_dma_blk_index(chunk, blk)];
+  }
+  if (order < BF_DMA_MALLOC_MIN_ORDER || (order & BF_DMA_MALLOC_BLK_FREE)) {
+    pthread_mutex_unlock(&arena->lock);
+    bf_sys_dma_pool_info_get(arena->pool, &info);
+    if (order > 0 && (order & BF_DMA_MALLOC_BLK_FREE)) {
+      printf("DMA arena %s: double free of buffer %p\n", info.name, v_addr);
+    } else {
+      printf("DMA arena %s: free of %p, not a buffer of the arena\n",
+             info.name, v_addr);
+    }
+    return;
+  }
+  chunk->used -= 1UL << order;
+
+  /* merge with the buddy for as long as it is free and whole */
+  while (order < BF_DMA_MALLOC_MAX_ORDER) {
+    uint8_t *buddy;
+
+    offset = (size_t)(blk - chunk->vaddr);
+    buddy = chunk->vaddr + (offset ^ (1UL << order));
+    if (chunk->blk_order[bf_dma_blk_index(chunk, buddy)] !=
+        (BF_DMA_MALLOC_BLK_FREE | order)) {
+      break;
+    }
+    bf_dma_blk_unlink((bf_dma_free_blk_t *)buddy);
+    /* the upper half no longer starts a block */
+    if (buddy < blk) {
+      chunk->blk_order[bf_dma_blk_index(chunk, blk)] = 0;
+      blk = buddy;
+    } else {
+      chunk->blk_order[bf_dma_blk_index(chunk, buddy)] = 0;
+    }
+    order++;
+  }
+  chunk->blk_order[bf_dma_blk_index(chunk, blk)] =
+      BF_DMA_MALLOC_BLK_FREE | order;
+  bf_dma_blk_link(arena, (bf_dma_free_blk_t *)blk, order);
+
+  /* keep one empty chunk, so that a buffer allocated and freed over and
+   * over does not take a chunk from the pool and return it every time
+   */
+  if (chunk->used == 0) {
+    if (arena->spare == NULL) {
+      arena->spare = chunk;
+    } else {
+      bf_dma_chunk_remove(arena, chunk);
+    }
+  }
+  pthread_mutex_unlock(&arena->lock);
+}
@@ -0,0 +1,307 @@
+/*******************************************************************************
+ * Copyright(c) 2021 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this software except as stipulated in the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ******************************************************************************/
+
+/*!
+ * @file bf_sys_dma_ring.c
+ * @date
+ *
+ * Lock-free descriptor rings in DMA memory. A ring is one buffer of a DMA
+ * pool holding the producer and consumer indices, each on a cache line of
+ * its own, followed by the slot array, so that a device or another process
+ * can consume the ring by physical address.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <target-sys/bf_sal/bf_sys_dma.h>
+#include <target-sys/bf_sal/bf_sys_mem.h>
+
+#define BF_DMA_RING_LINE_SIZE 64
+/* pauses before a producer waiting on another one yields the cpu */
+#define BF_DMA_RING_SPINS 256
+
+/**
+ * ring header at the start of the ring buffer, the indices run freely and
+ * wrap at 2^32
+ */
+typedef struct {
+  /* producer cache line */
+  uint32_t prod_head;       /* next slot to reserve */
+  uint32_t prod_tail;       /* slots below are filled */
+  uint32_t prod_cons_cache; /* last cons_tail the producer read */
+  uint8_t prod_pad[BF_DMA_RING_LINE_SIZE - 3 * sizeof(uint32_t)];
+  /* consumer cache line */
+  uint32_t cons_tail;       /* slots below are consumed */
+  uint32_t cons_prod_cache; /* last prod_tail the consumer read */
+  uint8_t cons_pad[BF_DMA_RING_LINE_SIZE - 2 * sizeof(uint32_t)];
+} bf_dma_ring_hdr_t;
+
+typedef struct {
+  bf_sys_dma_pool_handle_t pool; /* pool the ring buffer came from */
+  bf_dma_ring_hdr_t *hdr;        /* ring buffer */
+  uint8_t *slots;                /* slot array following the header */
+  bf_phys_addr_t phys;           /* physical address of the ring buffer */
+  bf_dma_addr_t dma_addr;        /* dma address of the ring buffer */
+  uint32_t mask;                 /* slot count - 1 */
+  uint32_t slot_size;            /* bytes per slot */
+  int flags;                     /* BF_SYS_DMA_RING_F_xxx */
+} bf_dma_ring_t;
+
+static inline void bf_dma_ring_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/**
+ *  Create a ring in a buffer of a DMA pool
+ */
+int bf_sys_dma_ring_create(bf_sys_dma_pool_handle_t pool, uint32_t slot_cnt,
+                           uint32_t slot_size, int flags,
+                           bf_sys_dma_ring_handle_t *hndl) {
+  bf_dma_ring_t *ring;
+  bf_sys_dma_pool_info_t info;
+  bf_sys_dma_sg_t sg;
+  uint64_t size;
+  void *vaddr;
+  bf_phys_addr_t phys;
+
+  if (pool == NULL || hndl == NULL || slot_size == 0 || slot_cnt < 2 ||
+      (slot_cnt & (slot_cnt - 1)) != 0 || slot_cnt > (1U << 31) ||
+      (flags & ~BF_SYS_DMA_RING_F_MP) != 0) {
+    printf("%s: invalid ring of %u slots of %u bytes\n", __func__, slot_cnt,
+           slot_size);
+    return -1;
+  }
+  size = sizeof(bf_dma_ring_hdr_t) + (uint64_t)slot_cnt * slot_size;
+  if (bf_sys_dma_pool_info_get(pool, &info) || size > info.buf_size) {
+    printf("%s: ring of %" PRIu64 " bytes does not fit a buffer of the pool\n",
+           __func__, size);
+    return -1;
+  }
+  ring = bf_sys_calloc(1, sizeof(bf_dma_ring_t));
+  if (ring == NULL) {
+    return -1;
+  }
+  if (bf_sys_dma_alloc(pool, (size_t)size, &vaddr, &phys)) {
+    bf_sys_free(ring);
+    return -1;
+  }
+  /* the indices each need a cache line of their own and a device needs the
+   * ring in one piece
+   */
+  if (((uintptr_t)vaddr & (BF_DMA_RING_LINE_SIZE - 1)) != 0 ||
+      bf_sys_dma_sg_build(pool, vaddr, (size_t)size, &sg, 1) != 1) {
+    printf("%s: ring of %" PRIu64 " bytes not aligned or not contiguous\n",
+           __func__, size);
+    bf_sys_dma_free(pool, vaddr);
+    bf_sys_free(ring);
+    return -1;
+  }
+  ring->pool = pool;
+  ring->hdr = vaddr;
+  ring->slots = (uint8_t *)vaddr + sizeof(bf_dma_ring_hdr_t);
+  ring->phys = phys;
+  ring->dma_addr = sg.dma_addr;
+  ring->mask = slot_cnt - 1;
+  ring->slot_size = slot_size;
+  ring->flags = flags;
+  memset(ring->hdr, 0, sizeof(bf_dma_ring_hdr_t));
+  *hndl = ring;
+  return 0;
+}
+
+/**
+ *  Destroy a ring, returning its buffer to the pool
+ */
+void bf_sys_dma_ring_destroy(bf_sys_dma_ring_handle_t hndl) {
+  bf_dma_ring_t *ring = hndl;
+
+  if (ring == NULL) {
+    return;
+  }
+  bf_sys_dma_free(ring->pool, ring->hdr);
+  bf_sys_free(ring);
+}
+
+/**
+ *  Get the addresses and geometry of a ring
+ */
+int bf_sys_dma_ring_info_get(bf_sys_dma_ring_handle_t hndl,
+                             bf_sys_dma_ring_info_t *info) {
+  bf_dma_ring_t *ring = hndl;
+
+  if (ring == NULL || info == NULL) {
+    return -1;
+  }
+  info->slot_cnt = ring->mask + 1;
+  info->slot_size = ring->slot_size;
+  info->slots_v_addr = ring->slots;
+  info->slots_phys_addr = ring->phys + sizeof(bf_dma_ring_hdr_t);
+  info->slots_dma_addr = ring->dma_addr + sizeof(bf_dma_ring_hdr_t);
+  info->prod_idx_dma_addr =
+      ring->dma_addr + offsetof(bf_dma_ring_hdr_t, prod_tail);
+  info->cons_idx_dma_addr =
+      ring->dma_addr + offsetof(bf_dma_ring_hdr_t, cons_tail);
+  return 0;
+}
+
+/* copy n slots between the ring, starting at free running index idx, and a
+ * flat array, in one or two pieces around the end of the ring
+ */
+static void bf_dma_ring_copy_in(bf_dma_ring_t *ring, uint32_t idx,
+                                const uint8_t *src, uint32_t n) {
+  uint32_t pos = idx & ring->mask;
+  uint32_t first = ring->mask + 1 - pos;
+
+  if (first > n) {
+    first = n;
+  }
+  memcpy(ring->slots + (size_t)pos * ring->slot_size, src,
+         (size_t)first * ring->slot_size);
+  memcpy(ring->slots, src + (size_t)first * ring->slot_size,
+         (size_t)(n - first) * ring->slot_size);
+}
+
+static void bf_dma_ring_copy_out(bf_dma_ring_t *ring, uint32_t idx,
+                                 uint8_t *dst, uint32_t n) {
+  uint32_t pos = idx & ring->mask;
+  uint32_t first = ring->mask + 1 - pos;
+
+  if (first > n) {
+    first = n;
+  }
+  memcpy(dst, ring->slots + (size_t)pos * ring->slot_size,
+         (size_t)first * ring->slot_size);
+  memcpy(dst + (size_t)first * ring->slot_size, ring->slots,
+         (size_t)(n - first) * ring->slot_size);
+}
+
+/**
+ *  Enqueue up to cnt slots
+ */
+uint32_t bf_sys_dma_ring_enqueue_burst(bf_sys_dma_ring_handle_t hndl,
+                                       const void *slots, uint32_t cnt) {
+  bf_dma_ring_t *ring = hndl;
+  bf_dma_ring_hdr_t *hdr = ring->hdr;
+  uint32_t size = ring->mask + 1;
+  uint32_t head, cons, n, spins;
+
+  if (ring->flags & BF_SYS_DMA_RING_F_MP) {
+    /* reserve slots by moving prod_head, fill them, then publish them in
+     * reservation order
+     */
+    head = __atomic_load_n(&hdr->prod_head, __ATOMIC_RELAXED);
+    do {
+      cons = __atomic_load_n(&hdr->cons_tail, __ATOMIC_ACQUIRE);
+      n = size - (head - cons);
+      if (n > cnt) {
+        n = cnt;
+      }
+      if (n == 0) {
+        return 0;
+      }
+    } while (!__atomic_compare_exchange_n(&hdr->prod_head, &head, head + n, 1,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    bf_dma_ring_copy_in(ring, head, slots, n);
+    /* earlier reservations still being filled, yield the cpu now and then
+     * in case their producers were preempted
+     */
+    for (spins = 1;
+         __atomic_load_n(&hdr->prod_tail, __ATOMIC_RELAXED) != head;
+         spins++) {
+      if (spins % BF_DMA_RING_SPINS == 0) {
+        sched_yield();
+      } else {
+        bf_dma_ring_pause();
+      }
+    }
+    __atomic_store_n(&hdr->prod_tail, head + n, __ATOMIC_RELEASE);
+    return n;
+  }
+
+  /* single producer, the consumer line is only read when the cached
+   * consumer index shows the ring full
+   */
+  head = hdr->prod_tail;
+  n = size - (head - hdr->prod_cons_cache);
+  if (n < cnt) {
+    hdr->prod_cons_cache = __atomic_load_n(&hdr->cons_tail, __ATOMIC_ACQUIRE);
+    n = size - (head - hdr->prod_cons_cache);
+  }
+  if (n > cnt) {
+    n = cnt;
+  }
+  if (n == 0) {
+    return 0;
+  }
+  bf_dma_ring_copy_in(ring, head, slots, n);
+  hdr->prod_head = head + n;
+  __atomic_store_n(&hdr->prod_tail, head + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+/**
+ *  Dequeue up to cnt slots
+ */
+uint32_t bf_sys_dma_ring_dequeue_burst(bf_sys_dma_ring_handle_t hndl,
+                                       void *slots, uint32_t cnt) {
+  bf_dma_ring_t *ring = hndl;
+  bf_dma_ring_hdr_t *hdr = ring->hdr;
+  uint32_t tail, n;
+
+  tail = hdr->cons_tail;
+  n = hdr->cons_prod_cache - tail;
+  if (n < cnt) {
+    hdr->cons_prod_cache = __atomic_load_n(&hdr->prod_tail, __ATOMIC_ACQUIRE);
+    n = hdr->cons_prod_cache - tail;
+  }
+  if (n > cnt) {
+    n = cnt;
+  }
+  if (n == 0) {
+    return 0;
+  }
+  bf_dma_ring_copy_out(ring, tail, slots, n);
+  __atomic_store_n(&hdr->cons_tail, tail + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+/**
+ *  Number of filled slots in a ring
+ */
+uint32_t bf_sys_dma_ring_count(bf_sys_dma_ring_handle_t hndl) {
+  bf_dma_ring_t *ring = hndl;
+  uint32_t cons = __atomic_load_n(&ring->hdr->cons_tail, __ATOMIC_ACQUIRE);
+  uint32_t prod = __atomic_load_n(&ring->hdr->prod_tail, __ATOMIC_ACQUIRE);
+
+  return prod - cons;
+}
+
+/**
+ *  Number of free slots in a ring
+ */
+uint32_t bf_sys_dma_ring_free_count(bf_sys_dma_ring_handle_t hndl) {
+  bf_dma_ring_t *ring = hndl;
+
+  return ring->mask + 1 - bf_sys_dma_ring_count(hndl);
+}
@@ -0,0 +1,267 @@
+/*******************************************************************************
+ * Copyright(c) 2021 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this software except as stipulated in the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ******************************************************************************/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <target-sys/bf_sal/bf_sys_dma.h>
+
+/* Micro benchmarks of the DMA pool address translation paths */
+
+#define BENCH_LOOKUPS (1 << 20)
+#define BENCH_BUF_SIZE 4096
+
+typedef struct {
+  bf_dma_addr_t dma;
+  uint8_t *virt;
+} bench_page_t;
+
+static double now_sec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* reference linear scan over the pool's huge pages */
+static void *bench_scan(bench_page_t *pages, int cnt, bf_dma_addr_t dma) {
+  int i;
+
+  for (i = 0; i < cnt; i++) {
+    if (dma >= pages[i].dma && dma < pages[i].dma + BF_HUGE_PAGE_SIZE) {
+      return pages[i].virt + (dma - pages[i].dma);
+    }
+  }
+  return NULL;
+}
+
+static int bench_dma2virt(int num_pages) {
+  bf_sys_dma_pool_handle_t hndl;
+  bench_page_t *pages;
+  bf_dma_addr_t *lookups;
+  void **bufs;
+  bf_phys_addr_t phys;
+  uintptr_t sum_scan = 0, sum_index = 0;
+  double t_scan, t_index;
+  int buf_cnt, page_cnt = 0;
+  int i, j;
+
+  /* one 4K pool header, the buffers fill the rest of the huge pages */
+  buf_cnt = num_pages * (BF_HUGE_PAGE_SIZE / BENCH_BUF_SIZE) - 1;
+  if (bf_sys_dma_pool_create("benchpool", &hndl, 0, 0, BENCH_BUF_SIZE, buf_cnt,
+                             64)) {
+    printf("dma2virt %4d pages: cannot create pool, skipped\n", num_pages);
+    return 0;
+  }
+  bufs = calloc(buf_cnt, sizeof(void *));
+  pages = calloc(num_pages, sizeof(bench_page_t));
+  lookups = calloc(BENCH_LOOKUPS, sizeof(bf_dma_addr_t));
+  assert(bufs && pages && lookups);
+
+  /* recover the pool's page table from the buffers' addresses */
+  for (i = 0; i < buf_cnt; i++) {
+    assert(bf_sys_dma_alloc(hndl, BENCH_BUF_SIZE, &bufs[i], &phys) == 0);
+    bf_dma_addr_t page_dma = phys & ~(bf_dma_addr_t)(BF_HUGE_PAGE_SIZE - 1);
+    for (j = 0; j < page_cnt && pages[j].dma != page_dma; j++) {
+    }
+    if (j == page_cnt) {
+      pages[page_cnt].dma = page_dma;
+      pages[page_cnt].virt = (uint8_t *)bufs[i] - (phys - page_dma);
+      page_cnt++;
+    }
+  }
+  srand(1);
+  for (i = 0; i < BENCH_LOOKUPS; i++) {
+    j = rand() % page_cnt;
+    lookups[i] = pages[j].dma + rand() % BF_HUGE_PAGE_SIZE;
+  }
+
+  t_scan = now_sec();
+  for (i = 0; i < BENCH_LOOKUPS; i++) {
+    sum_scan += (uintptr_t)bench_scan(pages, page_cnt, lookups[i]);
+  }
+  t_scan = now_sec() - t_scan;
+
+  t_index = now_sec();
+  for (i = 0; i < BENCH_LOOKUPS; i++) {
+    sum_index += (uintptr_t)bf_mem_dma2virt(hndl, lookups[i]);
+  }
+  t_index = now_sec() - t_index;
+
+  printf("dma2virt %4d pages: scan %8.2f ns, pool %6.2f ns per lookup\n",
+         page_cnt, t_scan * 1e9 / BENCH_LOOKUPS, t_index * 1e9 / BENCH_LOOKUPS);
+
+  for (i = 0; i < buf_cnt; i++) {
+    bf_sys_dma_free(hndl, bufs[i]);
+  }
+  bf_sys_dma_pool_destroy(hndl);
+  free(lookups);
+  free(pages);
+  free(bufs);
+  return sum_scan == sum_index ? 0 : -1;
+}
+
+static int bench_buffer_index(size_t buf_size) {
+  bf_sys_dma_pool_handle_t hndl;
+  bf_sys_dma_pool_info_t info;
+  volatile size_t div_size = buf_size;
+  size_t delta, page_bufs;
+  uint8_t *base;
+  void **bufs, **lookups;
+  bf_phys_addr_t phys;
+  size_t sum_div = 0, sum_index = 0;
+  double t_div, t_index;
+  int buf_cnt, i;
+
+  buf_cnt = 64 * (BF_HUGE_PAGE_SIZE / buf_size) - 1;
+  if (bf_sys_dma_pool_create("benchpool", &hndl, 0, 0, buf_size, buf_cnt,
+                             64)) {
+    printf("buffer index %5zu: cannot create pool, skipped\n", buf_size);
+    return 0;
+  }
+  bufs = calloc(buf_cnt, sizeof(void *));
+  lookups = calloc(BENCH_LOOKUPS, sizeof(void *));
+  assert(bufs && lookups);
+  for (i = 0; i < buf_cnt; i++) {
+    assert(bf_sys_dma_alloc(hndl, buf_size, &bufs[i], &phys) == 0);
+  }
+  base = bufs[0];
+  for (i = 1; i < buf_cnt; i++) {
+    if ((uint8_t *)bufs[i] < base) {
+      base = bufs[i];
+    }
+  }
+  srand(1);
+  for (i = 0; i < BENCH_LOOKUPS; i++) {
+    lookups[i] = bufs[rand() % buf_cnt];
+  }
+  bf_sys_dma_pool_info_get(hndl, &info);
+  page_bufs = info.page_bufs;
+
+  /* reference division by a buffer size unknown at compile time, per huge
+   * page for a pool packing its buffers into each page
+   */
+  t_div = now_sec();
+  for (i = 0; i < BENCH_LOOKUPS; i++) {
+    delta = (uint8_t *)lookups[i] - base;
+    if (page_bufs) {
+      sum_div += (delta / BF_HUGE_PAGE_SIZE) * page_bufs +
+                 (delta % BF_HUGE_PAGE_SIZE) / div_size;
+    } else {
+      sum_div += delta / div_size;
+    }
+  }
+  t_div = now_sec() - t_div;
+
+  t_index = now_sec();
+  for (i = 0; i < BENCH_LOOKUPS; i++) {
+    sum_index += bf_sys_dma_buffer_index(hndl, lookups[i]);
+  }
+  t_index = now_sec() - t_index;
+
+  printf("buffer index %5zu: div %6.2f ns, pool %6.2f ns per lookup\n",
+         buf_size, t_div * 1e9 / BENCH_LOOKUPS,
+         t_index * 1e9 / BENCH_LOOKUPS);
+
+  for (i = 0; i < buf_cnt; i++) {
+    bf_sys_dma_free(hndl, bufs[i]);
+  }
+  bf_sys_dma_pool_destroy(hndl);
+  free(lookups);
+  free(bufs);
+  return sum_div == sum_index ? 0 : -1;
+}
+
+static int bench_lookup(int pool_cnt) {
+  bf_sys_dma_pool_handle_t hndls[64];
+  bf_dma_addr_t *lookups;
+  void *buf, *vaddr;
+  bf_phys_addr_t phys;
+  uintptr_t sum_scan = 0, sum_index = 0;
+  double t_scan, t_index;
+  char name[32];
+  int i, j;
+
+  assert(pool_cnt <= 64);
+  lookups = calloc(BENCH_LOOKUPS, sizeof(bf_dma_addr_t));
+  assert(lookups);
+  for (i = 0; i < pool_cnt; i++) {
+    snprintf(name, sizeof(name), "benchpool%d", i);
+    if (bf_sys_dma_pool_create(name, &hndls[i], 0, 0, BENCH_BUF_SIZE,
+                               2 * (BF_HUGE_PAGE_SIZE / BENCH_BUF_SIZE) - 1,
+                               64)) {
+      printf("lookup %3d pools: cannot create pools, skipped\n", pool_cnt);
+      pool_cnt = i;
+      goto done;
+    }
+  }
+  /* buffers picked at random across the pools */
+  srand(1);
+  for (i = 0; i < BENCH_LOOKUPS; i++) {
+    j = rand() % pool_cnt;
+    assert(bf_sys_dma_alloc(hndls[j], BENCH_BUF_SIZE, &buf, &phys) == 0);
+    lookups[i] = phys + rand() % BENCH_BUF_SIZE;
+    bf_sys_dma_free(hndls[j], buf);
+  }
+
+  /* reference search trying each pool in turn */
+  t_scan = now_sec();
+  for (i = 0; i < BENCH_LOOKUPS; i++) {
+    for (j = 0; j < pool_cnt; j++) {
+      vaddr = bf_mem_dma2virt(hndls[j], lookups[i]);
+      if (vaddr) {
+        sum_scan += (uintptr_t)vaddr;
+        break;
+      }
+    }
+  }
+  t_scan = now_sec() - t_scan;
+
+  t_index = now_sec();
+  for (i = 0; i < BENCH_LOOKUPS; i++) {
+    if (bf_sys_dma_lookup(0, 0, lookups[i], NULL, &vaddr, NULL) == 0) {
+      sum_index += (uintptr_t)vaddr;
+    }
+  }
+  t_index = now_sec() - t_index;
+
+  printf("lookup %3d pools: per pool %8.2f ns, global %6.2f ns per lookup\n",
+         pool_cnt, t_scan * 1e9 / BENCH_LOOKUPS,
+         t_index * 1e9 / BENCH_LOOKUPS);
+
+done:
+  for (i = 0; i < pool_cnt; i++) {
+    bf_sys_dma_pool_destroy(hndls[i]);
+  }
+  free(lookups);
+  return sum_scan == sum_index ? 0 : -1;
+}
+
+int main() {
+  assert(bench_dma2virt(1) == 0);
+  assert(bench_dma2virt(64) == 0);
+  assert(bench_dma2virt(1024) == 0);
+  assert(bench_buffer_index(2048) == 0);
+  assert(bench_buffer_index(1536) == 0);
+  assert(bench_buffer_index(9216) == 0);
+  assert(bench_lookup(4) == 0);
+  assert(bench_lookup(16) == 0);
+  assert(bench_lookup(64) == 0);
+  return 0;
+}
@@ -15,8 +15,13 @@
  ******************************************************************************/
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <target-sys/bf_sal/bf_sys_dma.h>
 
@@ -101,6 +106,1714 @@ static int test_dma_2_virt(void) {
   return 0;
 }
 
+static int test_dma_mag(void) {
+  bf_sys_dma_pool_attr_t attr;
+  bf_sys_dma_pool_handle_t mag_hndl;
+  static void *bufs[DMA_BUF_MAX_CNT];
+  bf_phys_addr_t phys;
+  int i, round, cnt = 1000;
+  int result = 0;
+
+  bf_sys_dma_pool_attr_init(&attr);
+  attr.mag_depth = 32;
+  if (bf_sys_dma_pool_create_ext("magpool", &mag_hndl, 0, 0, 2048, cnt, 64,
+                                 &attr) != 0) {
+    printf("cannot create magazine pool\n");
+    return -1;
+  }
+  /* two rounds, the second one is served partly from the magazine */
+  for (round = 0; round < 2 && result == 0; round++) {
+    for (i = 0; i < cnt; i++) {
+      if (bf_sys_dma_alloc(mag_hndl, 2048, &bufs[i], &phys) != 0) {
+        printf("magazine pool alloc failed at %d\n", i);
+        result = -1;
+        break;
+      }
+    }
+    if (result == 0 &&
+        bf_sys_dma_alloc(mag_hndl, 2048, &bufs[cnt], &phys) == 0) {
+      printf("magazine pool over-allocated\n");
+      result = -1;
+    }
+    while (--i >= 0) {
+      bf_sys_dma_free(mag_hndl, bufs[i]);
+    }
+  }
+  bf_sys_dma_pool_mag_flush(mag_hndl);
+  bf_sys_dma_pool_destroy(mag_hndl);
+  if (result == 0) {
+    printf("DMA pool magazine test OK\n");
+  }
+  return result;
+}
+
+static int test_dma_bulk(void) {
+  bf_sys_dma_pool_handle_t bulk_hndl;
+  static void *bufs[DMA_BUF_MAX_CNT];
+  static bf_phys_addr_t phys[DMA_BUF_MAX_CNT];
+  bf_phys_addr_t p_addr;
+  int i, cnt = 1536;
+  int result = 0;
+
+  if (bf_sys_dma_pool_create("bulkpool", &bulk_hndl, 0, 0, 4096, cnt, 64)) {
+    printf("cannot create bulk pool\n");
+    return -1;
+  }
+  /* three bursts of 512 span a few huge pages, the fourth must fail */
+  for (i = 0; i < cnt; i += 512) {
+    if (bf_sys_dma_alloc_bulk(bulk_hndl, 512, &bufs[i], &phys[i])) {
+      printf("bulk alloc failed at %d\n", i);
+      result = -1;
+      goto done;
+    }
+  }
+  if (bf_sys_dma_alloc_bulk(bulk_hndl, 1, &bufs[cnt], &phys[cnt]) == 0) {
+    printf("bulk pool over-allocated\n");
+    result = -1;
+    goto done;
+  }
+  for (i = 0; i < cnt; i++) {
+    bf_sys_dma_get_phy_addr_from_pool(bulk_hndl, bufs[i], &p_addr);
+    if (p_addr != phys[i]) {
+      printf("bulk alloc phys addr mismatch for buff %d\n", i);
+      result = -1;
+      goto done;
+    }
+  }
+  bf_sys_dma_free_bulk(bulk_hndl, cnt, bufs);
+  if (bf_sys_dma_alloc_bulk(bulk_hndl, cnt, bufs, phys)) {
+    printf("bulk alloc of the whole pool failed\n");
+    result = -1;
+    goto done;
+  }
+  printf("DMA pool bulk alloc/free test OK\n");
+done:
+  bf_sys_dma_pool_destroy(bulk_hndl);
+  return result;
+}
+
+static int test_dma_1g_pages(void) {
+  bf_sys_dma_pool_attr_t attr;
+  bf_sys_dma_pool_handle_t pg_hndl;
+  void *bufs[8];
+  bf_phys_addr_t phys[8];
+  int i, result = 0;
+
+  /* uses 2MB pages when the system has no 1GB pages reserved */
+  bf_sys_dma_pool_attr_init(&attr);
+  attr.page_size = BF_HUGE_PAGE_SIZE_1G;
+  if (bf_sys_dma_pool_create_ext("pgpool", &pg_hndl, 0, 0, 1024 * 1024, 8, 64,
+                                 &attr)) {
+    printf("cannot create 1GB page pool\n");
+    return -1;
+  }
+  if (bf_sys_dma_alloc_bulk(pg_hndl, 8, bufs, phys)) {
+    printf("cannot alloc from 1GB page pool\n");
+    result = -1;
+  }
+  for (i = 0; i < 8 && result == 0; i++) {
+    if (bf_mem_dma2virt(pg_hndl, phys[i] + 1000) != (char *)bufs[i] + 1000) {
+      printf("1GB page pool dma to virtual mismatch for buff %d\n", i);
+      result = -1;
+    }
+  }
+  bf_sys_dma_pool_destroy(pg_hndl);
+  if (result == 0) {
+    printf("DMA pool 1GB page test OK\n");
+  }
+  return result;
+}
+
+static int test_dma_large_bufs(void) {
+  bf_sys_dma_pool_handle_t lg_hndl;
+  size_t size = 8 * 1024 * 1024, off;
+  void *bufs[4];
+  bf_phys_addr_t phys[4];
+  bf_sys_dma_sg_t sg[1];
+  int i, result = 0;
+
+  if (bf_sys_dma_pool_create("lgpool", &lg_hndl, 0, 0, size, 4, 64)) {
+    printf("cannot create multi-page buffer pool\n");
+    return -1;
+  }
+  if (bf_sys_dma_alloc_bulk(lg_hndl, 4, bufs, phys)) {
+    printf("cannot alloc from multi-page buffer pool\n");
+    result = -1;
+  }
+  /* each buffer must be physically contiguous */
+  for (i = 0; i < 4 && result == 0; i++) {
+    for (off = 0; off < size; off += BF_HUGE_PAGE_SIZE) {
+      if (bf_mem_virt2phy((char *)bufs[i] + off) != phys[i] + off ||
+          bf_mem_dma2virt(lg_hndl, phys[i] + off) != (char *)bufs[i] + off) {
+        printf("multi-page buffer %d not contiguous at %zx\n", i, off);
+        result = -1;
+        break;
+      }
+    }
+  }
+  /* a multi-page buffer is a single dma range */
+  if (result == 0 && (bf_sys_dma_sg_build(lg_hndl, bufs[0], size, sg, 1) != 1 ||
+                      sg[0].dma_addr != phys[0] || sg[0].len != size)) {
+    printf("multi-page buffer not a single sg entry\n");
+    result = -1;
+  }
+  bf_sys_dma_pool_destroy(lg_hndl);
+  if (result == 0) {
+    printf("DMA pool multi-page buffer test OK\n");
+  }
+  return result;
+}
+
+#define DMA_PACK_BUF_SIZE 9000
+#define DMA_PACK_BUF_CNT 1000
+
+static int test_dma_packing(void) {
+  bf_sys_dma_pool_handle_t pk_hndl;
+  bf_sys_dma_pool_info_t info;
+  static void *bufs[DMA_PACK_BUF_CNT];
+  static bf_phys_addr_t phys[DMA_PACK_BUF_CNT];
+  size_t last;
+  int i, result = 0;
+
+  if (bf_sys_dma_pool_create("packpool", &pk_hndl, 0, 0, DMA_PACK_BUF_SIZE,
+                             DMA_PACK_BUF_CNT, 64)) {
+    printf("cannot create packed pool\n");
+    return -1;
+  }
+  bf_sys_dma_pool_info_get(pk_hndl, &info);
+  if (info.page_bufs != (int)(BF_HUGE_PAGE_SIZE / info.buf_size) ||
+      info.num_pages !=
+          (DMA_PACK_BUF_CNT + info.page_bufs - 1) / info.page_bufs ||
+      info.efficiency < 850) {
+    printf("packed pool laid out as %d buffers on %d pages, %d/1000\n",
+           info.page_bufs, info.num_pages, info.efficiency);
+    result = -1;
+  }
+  if (result == 0 &&
+      bf_sys_dma_alloc_bulk(pk_hndl, DMA_PACK_BUF_CNT, bufs, phys)) {
+    printf("cannot alloc from packed pool\n");
+    result = -1;
+  }
+  /* no buffer straddles two huge pages, and indexes map back */
+  last = DMA_PACK_BUF_SIZE - 1;
+  for (i = 0; i < DMA_PACK_BUF_CNT && result == 0; i++) {
+    if (bf_mem_virt2phy((char *)bufs[i] + last) != phys[i] + last ||
+        bf_sys_dma_buffer_index(pk_hndl, bufs[i]) != i) {
+      printf("packed buffer %d at %p straddles a page or is misindexed\n", i,
+             bufs[i]);
+      result = -1;
+    }
+  }
+  if (result == 0) {
+    bf_sys_dma_free_bulk(pk_hndl, DMA_PACK_BUF_CNT, bufs);
+  }
+  bf_sys_dma_pool_destroy(pk_hndl);
+  if (result == 0) {
+    printf("DMA pool buffer packing test OK\n");
+  }
+  return result;
+}
+
+#define DMA_PAGE_BUF_SIZE (3 * BF_HUGE_PAGE_SIZE / 4)
+#define DMA_PAGE_BUF_CNT 3
+
+/* buffers over half a page that do not divide it get a page each */
+static int test_dma_page_bufs(void) {
+  bf_sys_dma_pool_handle_t pb_hndl;
+  bf_sys_dma_pool_info_t info;
+  void *bufs[DMA_PAGE_BUF_CNT];
+  bf_phys_addr_t phys[DMA_PAGE_BUF_CNT];
+  size_t last = DMA_PAGE_BUF_SIZE - 1;
+  int i, j, result = 0;
+
+  if (bf_sys_dma_pool_create("pagebufpool", &pb_hndl, 0, 0,
+                             DMA_PAGE_BUF_SIZE, DMA_PAGE_BUF_CNT, 64)) {
+    printf("cannot create pool of a buffer per page\n");
+    return -1;
+  }
+  bf_sys_dma_pool_info_get(pb_hndl, &info);
+  if (info.page_bufs != 1 || info.num_pages != DMA_PAGE_BUF_CNT) {
+    printf("pool of a buffer per page laid out as %d buffers on %d pages\n",
+           info.page_bufs, info.num_pages);
+    result = -1;
+  }
+  if (result == 0 &&
+      bf_sys_dma_alloc_bulk(pb_hndl, DMA_PAGE_BUF_CNT, bufs, phys)) {
+    printf("cannot alloc from pool of a buffer per page\n");
+    result = -1;
+  }
+  for (i = 0; i < DMA_PAGE_BUF_CNT && result == 0; i++) {
+    for (j = 0; j < i; j++) {
+      if (phys[j] == phys[i]) {
+        printf("buffer %d handed out as buffer %d too\n", i, j);
+        result = -1;
+      }
+    }
+    if (phys[i] / BF_HUGE_PAGE_SIZE != (phys[i] + last) / BF_HUGE_PAGE_SIZE ||
+        bf_mem_virt2phy((char *)bufs[i] + last) != phys[i] + last ||
+        bf_sys_dma_buffer_index(pb_hndl, bufs[i]) != i) {
+      printf("buffer %d of a page at %p straddles a page or is misindexed\n",
+             i, bufs[i]);
+      result = -1;
+    }
+  }
+  if (result == 0) {
+    bf_sys_dma_free_bulk(pb_hndl, DMA_PAGE_BUF_CNT, bufs);
+  }
+  bf_sys_dma_pool_destroy(pb_hndl);
+  if (result == 0) {
+    printf("DMA pool buffer per page test OK\n");
+  }
+  return result;
+}
+
+#define DMA_ONE_PAGE_BUF_SIZE (64 * 1024)
+#define DMA_ONE_PAGE_BUF_CNT 31
+
+/* a pool fitting in one page starts at the page, buffers keep their
+ * natural alignment
+ */
+static int test_dma_one_page(void) {
+  bf_sys_dma_pool_handle_t op_hndl;
+  bf_sys_dma_pool_info_t info;
+  void *bufs[DMA_ONE_PAGE_BUF_CNT];
+  bf_phys_addr_t phys[DMA_ONE_PAGE_BUF_CNT];
+  int i, result = 0;
+
+  if (bf_sys_dma_pool_create("onepagepool", &op_hndl, 0, 0,
+                             DMA_ONE_PAGE_BUF_SIZE, DMA_ONE_PAGE_BUF_CNT,
+                             64)) {
+    printf("cannot create pool of one page\n");
+    return -1;
+  }
+  bf_sys_dma_pool_info_get(op_hndl, &info);
+  if (info.num_pages != 1) {
+    printf("pool of one page laid out on %d pages\n", info.num_pages);
+    result = -1;
+  }
+  if (result == 0 &&
+      bf_sys_dma_alloc_bulk(op_hndl, DMA_ONE_PAGE_BUF_CNT, bufs, phys)) {
+    printf("cannot alloc from pool of one page\n");
+    result = -1;
+  }
+  for (i = 0; i < DMA_ONE_PAGE_BUF_CNT && result == 0; i++) {
+    if ((uintptr_t)bufs[i] % DMA_ONE_PAGE_BUF_SIZE ||
+        phys[i] % DMA_ONE_PAGE_BUF_SIZE) {
+      printf("buffer %d of pool of one page at %p is not %d aligned\n", i,
+             bufs[i], DMA_ONE_PAGE_BUF_SIZE);
+      result = -1;
+    }
+  }
+  if (result == 0) {
+    bf_sys_dma_free_bulk(op_hndl, DMA_ONE_PAGE_BUF_CNT, bufs);
+  }
+  bf_sys_dma_pool_destroy(op_hndl);
+  if (result == 0) {
+    printf("DMA pool of one page test OK\n");
+  }
+  return result;
+}
+
+#define DMA_SG_PAGES 4
+#define DMA_SG_MAX 8
+
+static int test_dma_sg(void) {
+  bf_sys_dma_pool_handle_t sg_hndl;
+  bf_sys_dma_sg_t sg[DMA_SG_MAX];
+  size_t len = DMA_SG_PAGES * BF_HUGE_PAGE_SIZE - 8192, total = 0;
+  uint8_t *va;
+  bf_phys_addr_t phys;
+  int cnt = DMA_SG_PAGES * BF_HUGE_PAGE_SIZE / 4096;
+  int i, n, result = 0;
+
+  if (bf_sys_dma_pool_create("sgpool", &sg_hndl, 0, 0, 4096, cnt, 64)) {
+    printf("cannot create sg pool\n");
+    return -1;
+  }
+  /* all the buffers but the first and the last, across all the pages */
+  bf_sys_dma_alloc(sg_hndl, 4096, (void **)&va, &phys);
+  va += 4096;
+  n = bf_sys_dma_sg_build(sg_hndl, va, len, sg, DMA_SG_MAX);
+  if (n < 1 || n > DMA_SG_PAGES) {
+    printf("sg list of %d entries for %d pages\n", n, DMA_SG_PAGES);
+    result = -1;
+  }
+  for (i = 0; i < n && result == 0; i++) {
+    if (bf_mem_virt2phy(va + total) != sg[i].dma_addr ||
+        bf_mem_virt2phy(va + total + sg[i].len - 1) !=
+            sg[i].dma_addr + sg[i].len - 1 ||
+        (i > 0 && sg[i - 1].dma_addr + sg[i - 1].len == sg[i].dma_addr)) {
+      printf("sg entry %d not a maximal contiguous range\n", i);
+      result = -1;
+    }
+    total += sg[i].len;
+  }
+  if (result == 0 && total != len) {
+    printf("sg list covers %zu of %zu bytes\n", total, len);
+    result = -1;
+  }
+  /* ranges outside the pool or needing too many entries are refused */
+  if (bf_sys_dma_sg_build(sg_hndl, va, len, sg, 0) != -1 ||
+      bf_sys_dma_sg_build(sg_hndl, va, len + 8192, sg, DMA_SG_MAX) != -1) {
+    printf("bad sg range accepted\n");
+    result = -1;
+  }
+  bf_sys_dma_pool_destroy(sg_hndl);
+  if (result == 0) {
+    printf("DMA scatter-gather list test OK (%d entries)\n", n);
+  }
+  return result;
+}
+
+static int test_dma_numa(void) {
+  bf_sys_dma_pool_attr_t attr;
+  bf_sys_dma_pool_handle_t numa_hndl;
+  bf_sys_dma_pool_info_t info;
+  int result = 0;
+
+  bf_sys_dma_pool_attr_init(&attr);
+  attr.numa_node = 0;
+  if (bf_sys_dma_pool_create_ext("numapool", &numa_hndl, 0, 0, 65536, 100, 64,
+                                 &attr)) {
+    printf("cannot create numa node 0 pool\n");
+    return -1;
+  }
+  bf_sys_dma_pool_info_get(numa_hndl, &info);
+  if (info.numa_node != 0 || info.numa_pages[0] != info.num_pages) {
+    printf("numa pool has %d of %d pages on node 0\n", info.numa_pages[0],
+           info.num_pages);
+    result = -1;
+  }
+  bf_sys_dma_pool_destroy(numa_hndl);
+  if (result == 0) {
+    printf("DMA pool numa placement test OK\n");
+  }
+  return result;
+}
+
+#define DMA_MALLOC_CNT 256
+
+static int test_dma_malloc(void) {
+  bf_sys_dma_arena_handle_t arena;
+  static uint8_t *bufs[DMA_MALLOC_CNT];
+  static size_t sizes[DMA_MALLOC_CNT];
+  bf_phys_addr_t phys;
+  size_t align, k;
+  int i, j, result = 0;
+
+  if (bf_sys_dma_arena_create("arena", &arena, 0, 0, 16 * BF_HUGE_PAGE_SIZE,
+                              NULL)) {
+    printf("cannot create dma arena\n");
+    return -1;
+  }
+  for (i = 0; i < DMA_MALLOC_CNT && result == 0; i++) {
+    sizes[i] = 1 + ((size_t)i * 7919) % (i % 16 == 0 ? 262144 : 4096);
+    align = (size_t)1 << (i % 13);
+    bufs[i] = bf_sys_dma_malloc(arena, sizes[i], align, &phys);
+    if (bufs[i] == NULL || ((uintptr_t)bufs[i] & (align - 1)) ||
+        phys != bf_mem_virt2phy(bufs[i]) ||
+        phys != bf_mem_virt2phy(bufs[i] + sizes[i] - 1) - (sizes[i] - 1)) {
+      printf("dma malloc %d of %zu bytes failed\n", i, sizes[i]);
+      result = -1;
+      break;
+    }
+    for (k = 0; k < sizes[i]; k++) {
+      bufs[i][k] = (uint8_t)i;
+    }
+  }
+  /* buffers must not overlap */
+  for (j = 0; j < i && result == 0; j++) {
+    for (k = 0; k < sizes[j]; k++) {
+      if (bufs[j][k] != (uint8_t)j) {
+        printf("dma malloc buffer %d overwritten\n", j);
+        result = -1;
+        break;
+      }
+    }
+  }
+  /* free every other buffer and reuse the holes */
+  for (j = 0; j < i; j += 2) {
+    bf_sys_dma_mfree(arena, bufs[j]);
+    bufs[j] = NULL;
+  }
+  for (j = 0; j < i && result == 0; j += 2) {
+    bufs[j] = bf_sys_dma_malloc(arena, sizes[j], 64, &phys);
+    if (bufs[j] == NULL) {
+      printf("dma malloc realloc %d failed\n", j);
+      result = -1;
+    }
+  }
+  for (j = 0; j < i; j++) {
+    if (bufs[j]) {
+      bf_sys_dma_mfree(arena, bufs[j]);
+    }
+  }
+  /* with everything freed a whole chunk must be available again */
+  if (result == 0) {
+    bufs[0] = bf_sys_dma_malloc(arena, BF_HUGE_PAGE_SIZE, 64, &phys);
+    if (bufs[0] == NULL) {
+      printf("dma malloc of a whole chunk failed\n");
+      result = -1;
+    } else {
+      bf_sys_dma_mfree(arena, bufs[0]);
+    }
+  }
+  /* double frees and pointers that are not buffers are rejected, leaving
+   * the arena intact
+   */
+  if (result == 0) {
+    bufs[0] = bf_sys_dma_malloc(arena, 256, 64, &phys);
+    bufs[1] = bf_sys_dma_malloc(arena, 100, 64, &phys);
+    if (bufs[0] == NULL || bufs[1] == NULL) {
+      printf("dma malloc for bad frees failed\n");
+      result = -1;
+    } else {
+      bf_sys_dma_mfree(arena, bufs[1]);
+      bf_sys_dma_mfree(arena, bufs[1]);
+      bf_sys_dma_mfree(arena, bufs[0] + 64);
+      bf_sys_dma_mfree(arena, bufs[0] + 1);
+      bf_sys_dma_mfree(arena, &phys);
+      bufs[1] = bf_sys_dma_malloc(arena, 100, 64, &phys);
+      bufs[2] = bf_sys_dma_malloc(arena, 100, 64, &phys);
+      if (bufs[1] == NULL || bufs[2] == NULL || bufs[1] == bufs[2] ||
+          (bufs[1] >= bufs[0] && bufs[1] < bufs[0] + 256) ||
+          (bufs[2] >= bufs[0] && bufs[2] < bufs[0] + 256)) {
+        printf("dma arena corrupted by bad frees\n");
+        result = -1;
+      }
+      bf_sys_dma_mfree(arena, bufs[0]);
+      bf_sys_dma_mfree(arena, bufs[1]);
+      bf_sys_dma_mfree(arena, bufs[2]);
+    }
+  }
+  bf_sys_dma_arena_destroy(arena);
+  if (result == 0) {
+    printf("DMA arena malloc test OK\n");
+  }
+  return result;
+}
+
+#define DMA_RSV_POOL_CNT 8
+#define DMA_RSV_BUF_CNT 100
+
+static int test_dma_reserve(void) {
+  bf_sys_dma_lib_attr_t lib_attr;
+  bf_sys_dma_pool_handle_t rsv_hndl[DMA_RSV_POOL_CNT] = {NULL}, big_hndl;
+  bf_sys_dma_pool_handle_t found;
+  static void *bufs[DMA_RSV_POOL_CNT][DMA_RSV_BUF_CNT];
+  bf_sys_dma_pool_info_t info;
+  bf_phys_addr_t phys;
+  void *v;
+  size_t size;
+  int i, j, idx, result = 0;
+
+  bf_sys_dma_lib_attr_init(&lib_attr);
+  lib_attr.reserve_size = 8 * BF_HUGE_PAGE_SIZE;
+  if (bf_sys_dma_lib_init(NULL, NULL, &lib_attr)) {
+    printf("cannot reserve dma memory\n");
+    return -1;
+  }
+  for (i = 0; i < DMA_RSV_POOL_CNT && result == 0; i++) {
+    size = 64 << i;
+    if (bf_sys_dma_pool_create("rsvpool", &rsv_hndl[i], 0, 0, size,
+                               DMA_RSV_BUF_CNT, 64)) {
+      printf("cannot create pool %d in reserved memory\n", i);
+      result = -1;
+      break;
+    }
+    bf_sys_dma_pool_info_get(rsv_hndl[i], &info);
+    if (!info.carved) {
+      printf("pool %d not carved out of reserved memory\n", i);
+      result = -1;
+    }
+    for (j = 0; j < DMA_RSV_BUF_CNT && result == 0; j++) {
+      if (bf_sys_dma_alloc(rsv_hndl[i], size, &bufs[i][j], &phys) ||
+          phys != bf_mem_virt2phy(bufs[i][j]) ||
+          bf_mem_dma2virt(rsv_hndl[i], phys) != bufs[i][j]) {
+        printf("bad buffer %d of reserved pool %d\n", j, i);
+        result = -1;
+        break;
+      }
+      memset(bufs[i][j], i, size);
+    }
+  }
+  /* the first pools share a huge page of the reservation, the global
+   * lookup tells their buffers apart
+   */
+  if (result == 0 && (uintptr_t)bufs[0][0] / BF_HUGE_PAGE_SIZE !=
+                         (uintptr_t)bufs[1][0] / BF_HUGE_PAGE_SIZE) {
+    printf("reserved pools 0 and 1 on different huge pages\n");
+    result = -1;
+  }
+  for (i = 0; i < DMA_RSV_POOL_CNT && result == 0; i++) {
+    j = DMA_RSV_BUF_CNT / 2;
+    if (bf_sys_dma_lookup(0, 0, bf_mem_virt2phy(bufs[i][j]), &found, &v,
+                          &idx) ||
+        found != rsv_hndl[i] || v != bufs[i][j] || idx != j) {
+      printf("bad lookup of buffer %d of reserved pool %d\n", j, i);
+      result = -1;
+    }
+  }
+  /* pools must not overlap */
+  for (i = 0; i < DMA_RSV_POOL_CNT && result == 0; i++) {
+    for (j = 0; j < DMA_RSV_BUF_CNT; j++) {
+      if (((uint8_t *)bufs[i][j])[0] != i ||
+          ((uint8_t *)bufs[i][j])[(64 << i) - 1] != i) {
+        printf("buffer %d of reserved pool %d overwritten\n", j, i);
+        result = -1;
+        break;
+      }
+    }
+  }
+  /* pools the reservation cannot hold get pages of their own */
+  if (result == 0) {
+    if (bf_sys_dma_pool_create("bigpool", &big_hndl, 0, 0, 65536, 512, 64)) {
+      printf("cannot create pool beyond reserved memory\n");
+      result = -1;
+    } else {
+      bf_sys_dma_pool_info_get(big_hndl, &info);
+      if (info.carved) {
+        printf("pool beyond reserved memory carved out of it\n");
+        result = -1;
+      }
+      bf_sys_dma_pool_destroy(big_hndl);
+    }
+  }
+  if (result == 0 && bf_sys_dma_lib_fini() == 0) {
+    printf("reserved memory released with pools in use\n");
+    result = -1;
+  }
+  for (i = 0; i < DMA_RSV_POOL_CNT; i++) {
+    if (rsv_hndl[i]) {
+      bf_sys_dma_pool_destroy(rsv_hndl[i]);
+    }
+  }
+  if (bf_sys_dma_lib_fini()) {
+    result = -1;
+  }
+  if (result == 0) {
+    printf("DMA reserved memory test OK\n");
+  }
+  return result;
+}
+
+/* mock iommu, the pages of a call are mapped to a contiguous bus range at
+ * the physical address of the first page moved up by DMA_MOCK_IOVA_OFFSET
+ */
+#define DMA_MOCK_IOVA_OFFSET (1ULL << 52)
+#define DMA_MOCK_PHYS_MAX 4
+static int mock_map_calls, mock_map_pages;
+static int mock_unmap_calls, mock_unmap_pages;
+static bf_phys_addr_t mock_map_phys[DMA_MOCK_PHYS_MAX];
+
+static int mock_map_range(int dev_id, uint32_t subdev_id,
+                          const bf_phys_addr_t *phy_addrs, int cnt,
+                          size_t page_size, bf_dma_addr_t *dma_addrs) {
+  int i;
+
+  (void)dev_id;
+  (void)subdev_id;
+  for (i = 0; i < cnt; i++) {
+    dma_addrs[i] = phy_addrs[0] + DMA_MOCK_IOVA_OFFSET + (size_t)i * page_size;
+    if (i < DMA_MOCK_PHYS_MAX) {
+      mock_map_phys[i] = phy_addrs[i];
+    }
+  }
+  mock_map_calls++;
+  mock_map_pages += cnt;
+  return 0;
+}
+
+static int mock_unmap_range(int dev_id, uint32_t subdev_id,
+                            const bf_dma_addr_t *dma_addrs, int cnt,
+                            size_t page_size) {
+  int i;
+
+  (void)dev_id;
+  (void)subdev_id;
+  (void)page_size;
+  for (i = 0; i < cnt; i++) {
+    assert(dma_addrs[i] >= DMA_MOCK_IOVA_OFFSET);
+  }
+  mock_unmap_calls++;
+  mock_unmap_pages += cnt;
+  return 0;
+}
+
+static int test_dma_map_range(void) {
+  bf_sys_dma_pool_handle_t map_hndl;
+  bf_sys_dma_pool_info_t info;
+  bf_dma_addr_t dma;
+  void *buf;
+  int result = 0;
+
+  bf_sys_dma_map_range_fn_register(mock_map_range, mock_unmap_range);
+  if (bf_sys_dma_pool_create("mappool", &map_hndl, 0, 0, 4096, 4096, 64)) {
+    printf("cannot create range mapped pool\n");
+    bf_sys_dma_map_range_fn_register(NULL, NULL);
+    return -1;
+  }
+  bf_sys_dma_pool_info_get(map_hndl, &info);
+  if (mock_map_calls != 1 || mock_map_pages != info.num_pages) {
+    printf("%d pages bus mapped in %d calls, expected %d in 1\n",
+           mock_map_pages, mock_map_calls, info.num_pages);
+    result = -1;
+  }
+  if (bf_sys_dma_alloc(map_hndl, 4096, &buf, &dma) ||
+      dma != bf_mem_virt2phy(buf) + DMA_MOCK_IOVA_OFFSET ||
+      bf_mem_dma2virt(map_hndl, dma) != buf) {
+    printf("bad bus address of range mapped buffer\n");
+    result = -1;
+  }
+  bf_sys_dma_pool_destroy(map_hndl);
+  if (mock_unmap_calls != 1 || mock_unmap_pages != info.num_pages) {
+    printf("%d pages bus unmapped in %d calls, expected %d in 1\n",
+           mock_unmap_pages, mock_unmap_calls, info.num_pages);
+    result = -1;
+  }
+  bf_sys_dma_map_range_fn_register(NULL, NULL);
+  if (result == 0) {
+    printf("DMA range bus map test OK\n");
+  }
+  return result;
+}
+
+#define DMA_ELASTIC_BUF_SIZE 65536
+#define DMA_ELASTIC_MAX_CNT 2048
+
+/* check the VmFlags of the mapping holding addr for mlocked pages */
+static int dma_page_locked(const void *addr) {
+  char line[256];
+  uintptr_t start, end;
+  int in_vma = 0, locked = 0;
+  FILE *fp = fopen("/proc/self/smaps", "r");
+
+  if (fp == NULL) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " ", &start, &end) == 2) {
+      in_vma = (uintptr_t)addr >= start && (uintptr_t)addr < end;
+    } else if (in_vma && strncmp(line, "VmFlags:", 8) == 0) {
+      locked = strstr(line, " lo") != NULL;
+    }
+  }
+  fclose(fp);
+  return locked;
+}
+
+/* map a range of several 4K pages, the range map function gets the
+ * physical address of each page, contiguous or not, and unmapping one of
+ * two mappings sharing a page leaves that page pinned for the other
+ */
+static int test_dma_user_map_pages(void) {
+  size_t page_size = getpagesize();
+  uint8_t *buf;
+  bf_dma_addr_t dma, dma2;
+  int i, result = 0;
+
+  buf = mmap(NULL, 3 * page_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    return -1;
+  }
+  mock_map_calls = 0;
+  if (bf_sys_dma_map(hndl[0], buf + 64, 0, 2 * page_size, &dma,
+                     BF_DMA_FROM_CPU) ||
+      mock_map_calls != 1 ||
+      dma != mock_map_phys[0] + DMA_MOCK_IOVA_OFFSET + 64) {
+    printf("cannot map caller owned memory of 3 pages\n");
+    munmap(buf, 3 * page_size);
+    return -1;
+  }
+  for (i = 0; i < 3; i++) {
+    if (mock_map_phys[i] != bf_mem_virt2phy(buf + i * page_size)) {
+      printf("bad physical address of page %d of caller owned memory\n", i);
+      result = -1;
+    }
+  }
+  /* the second mapping shares the last page of the first one */
+  if (bf_sys_dma_map(hndl[0], buf + 2 * page_size, 0, 64, &dma2,
+                     BF_DMA_TO_CPU) ||
+      dma2 != bf_mem_virt2phy(buf + 2 * page_size) + DMA_MOCK_IOVA_OFFSET) {
+    printf("bad bus address of overlapping caller owned memory\n");
+    result = -1;
+  }
+  bf_sys_dma_unmap(hndl[0], buf + 64, 2 * page_size, BF_DMA_FROM_CPU);
+  bf_sys_dma_map_cache_flush();
+  if (dma_page_locked(buf) != 0 ||
+      dma_page_locked(buf + 2 * page_size) != 1) {
+    printf("pages of a released mapping unpinned wrongly\n");
+    result = -1;
+  }
+  bf_sys_dma_unmap(hndl[0], buf + 2 * page_size, 64, BF_DMA_TO_CPU);
+  bf_sys_dma_map_cache_flush();
+  if (dma_page_locked(buf + 2 * page_size) != 0) {
+    printf("pages of caller owned memory left pinned\n");
+    result = -1;
+  }
+  munmap(buf, 3 * page_size);
+  return result;
+}
+
+static int test_dma_user_map(void) {
+  static uint8_t user_buf[4096] __attribute__((aligned(4096)));
+  bf_dma_addr_t dma, dma2;
+  int result = 0;
+
+  bf_sys_dma_map_range_fn_register(mock_map_range, mock_unmap_range);
+  mock_map_calls = mock_unmap_calls = 0;
+  /* pool buffers are mapped already */
+  if (bf_sys_dma_map(hndl[0], v_addr[0][0], dma_addr[0][0], 64, &dma,
+                     BF_DMA_FROM_CPU) ||
+      dma != dma_addr[0][0] || mock_map_calls != 0) {
+    printf("pool buffer bus mapped again\n");
+    result = -1;
+  }
+  /* caller owned memory is bus mapped once, and again for the other
+   * direction
+   */
+  if (bf_sys_dma_map(hndl[0], user_buf + 64, 0, 1024, &dma,
+                     BF_DMA_FROM_CPU) ||
+      dma != bf_mem_virt2phy(user_buf + 64) + DMA_MOCK_IOVA_OFFSET) {
+    printf("bad bus address of caller owned memory\n");
+    result = -1;
+  }
+  bf_sys_dma_unmap(hndl[0], user_buf + 64, 1024, BF_DMA_FROM_CPU);
+  if (bf_sys_dma_map(hndl[0], user_buf + 64, 0, 1024, &dma2,
+                     BF_DMA_FROM_CPU) ||
+      dma2 != dma || mock_map_calls != 1 ||
+      bf_sys_dma_map(hndl[0], user_buf + 64, 0, 1024, &dma2, BF_DMA_TO_CPU) ||
+      mock_map_calls != 2) {
+    printf("caller owned memory bus mapped %d times\n", mock_map_calls);
+    result = -1;
+  }
+  if (bf_sys_dma_unmap(hndl[0], user_buf + 64, 1024, BF_DMA_FROM_CPU) ||
+      bf_sys_dma_unmap(hndl[0], user_buf + 64, 1024, BF_DMA_TO_CPU) ||
+      bf_sys_dma_unmap(hndl[0], user_buf + 64, 1024, BF_DMA_TO_CPU) == 0) {
+    printf("bad unmap of caller owned memory\n");
+    result = -1;
+  }
+  bf_sys_dma_map_cache_flush();
+  if (mock_unmap_calls != 2) {
+    printf("%d cached mappings released, expected 2\n", mock_unmap_calls);
+    result = -1;
+  }
+  if (test_dma_user_map_pages()) {
+    result = -1;
+  }
+  bf_sys_dma_map_range_fn_register(NULL, NULL);
+  if (result == 0) {
+    printf("DMA caller owned memory map test OK\n");
+  }
+  return result;
+}
+
+static int test_dma_elastic(void) {
+  bf_sys_dma_pool_attr_t attr;
+  bf_sys_dma_pool_handle_t el_hndl;
+  bf_sys_dma_pool_info_t info;
+  static void *bufs[DMA_ELASTIC_MAX_CNT];
+  bf_phys_addr_t phys;
+  int i, cnt = 0, base_pages, result = 0;
+  void *extra;
+
+  bf_sys_dma_pool_attr_init(&attr);
+  attr.max_cnt = DMA_ELASTIC_MAX_CNT;
+  attr.mag_depth = 16;
+  if (bf_sys_dma_pool_create_ext("elasticpool", &el_hndl, 0, 0,
+                                 DMA_ELASTIC_BUF_SIZE, 32, 64, &attr)) {
+    printf("cannot create elastic pool\n");
+    return -1;
+  }
+  bf_sys_dma_pool_info_get(el_hndl, &info);
+  base_pages = info.num_pages;
+  if (info.max_buf_cnt != DMA_ELASTIC_MAX_CNT || info.buf_cnt < 32 ||
+      info.buf_cnt >= DMA_ELASTIC_MAX_CNT) {
+    printf("bad elastic pool geometry %d/%d buffers\n", info.buf_cnt,
+           info.max_buf_cnt);
+    result = -1;
+  }
+  /* grow all the way to the cap */
+  for (cnt = 0; cnt < DMA_ELASTIC_MAX_CNT && result == 0; cnt++) {
+    if (bf_sys_dma_alloc(el_hndl, DMA_ELASTIC_BUF_SIZE, &bufs[cnt], &phys) ||
+        phys != bf_mem_virt2phy(bufs[cnt]) ||
+        bf_mem_dma2virt(el_hndl, phys) != bufs[cnt] ||
+        bf_sys_dma_lookup(0, 0, phys, NULL, &extra, NULL) ||
+        extra != bufs[cnt]) {
+      printf("bad elastic pool buffer %d\n", cnt);
+      result = -1;
+      break;
+    }
+    memset(bufs[cnt], 0xa5, DMA_ELASTIC_BUF_SIZE);
+  }
+  if (result == 0 &&
+      bf_sys_dma_alloc(el_hndl, DMA_ELASTIC_BUF_SIZE, &extra, &phys) == 0) {
+    printf("elastic pool grew past its cap\n");
+    result = -1;
+  }
+  bf_sys_dma_pool_info_get(el_hndl, &info);
+  if (result == 0 && info.buf_cnt != DMA_ELASTIC_MAX_CNT) {
+    printf("elastic pool has %d buffers at its cap\n", info.buf_cnt);
+    result = -1;
+  }
+  /* shrink back once the buffers are freed */
+  for (i = 0; i < cnt; i++) {
+    bf_sys_dma_free(el_hndl, bufs[i]);
+  }
+  bf_sys_dma_pool_mag_flush(el_hndl);
+  if (result == 0 &&
+      bf_sys_dma_pool_shrink(el_hndl) != info.num_pages - base_pages) {
+    printf("elastic pool did not shrink back to %d pages\n", base_pages);
+    result = -1;
+  }
+  bf_sys_dma_pool_info_get(el_hndl, &info);
+  if (result == 0 && info.num_pages != base_pages) {
+    printf("elastic pool has %d pages after shrinking\n", info.num_pages);
+    result = -1;
+  }
+  /* and grow again */
+  for (i = 0; i < DMA_ELASTIC_MAX_CNT / 2 && result == 0; i++) {
+    if (bf_sys_dma_alloc(el_hndl, DMA_ELASTIC_BUF_SIZE, &bufs[i], &phys) ||
+        phys != bf_mem_virt2phy(bufs[i])) {
+      printf("bad elastic pool buffer %d after shrinking\n", i);
+      result = -1;
+    }
+  }
+  bf_sys_dma_pool_destroy(el_hndl);
+  if (result == 0) {
+    printf("DMA elastic pool test OK\n");
+  }
+  return result;
+}
+
+#define DMA_PERSIST_BUF_SIZE 8192
+#define DMA_PERSIST_BUF_CNT 300
+
+/* needs a hugetlbfs mount, e.g. mount -t hugetlbfs nodev /dev/hugepages */
+static int test_dma_persistent(void) {
+  bf_sys_dma_pool_attr_t attr;
+  bf_sys_dma_pool_handle_t ps_hndl;
+  bf_sys_dma_pool_info_t info;
+  static void *bufs[DMA_PERSIST_BUF_CNT];
+  bf_phys_addr_t phys, first_phys;
+  int i, idx, result = 0;
+  void *extra;
+
+  bf_sys_dma_pool_remove("persistpool");
+  bf_sys_dma_pool_attr_init(&attr);
+  attr.persistent = 1;
+  if (bf_sys_dma_pool_create_ext("persistpool", &ps_hndl, 0, 0,
+                                 DMA_PERSIST_BUF_SIZE, DMA_PERSIST_BUF_CNT, 64,
+                                 &attr)) {
+    printf("cannot create persistent pool\n");
+    return -1;
+  }
+  bf_sys_dma_pool_info_get(ps_hndl, &info);
+  if (info.restored) {
+    printf("new persistent pool restored\n");
+    result = -1;
+  }
+  /* leave half the buffers allocated and tagged with their index */
+  for (i = 0; i < DMA_PERSIST_BUF_CNT / 2 && result == 0; i++) {
+    if (bf_sys_dma_alloc(ps_hndl, DMA_PERSIST_BUF_SIZE, &bufs[i], &phys) ||
+        phys != bf_mem_virt2phy(bufs[i])) {
+      printf("bad persistent pool buffer %d\n", i);
+      result = -1;
+      break;
+    }
+    memset(bufs[i], i & 0xff, DMA_PERSIST_BUF_SIZE);
+  }
+  bf_sys_dma_get_phy_addr_from_pool(ps_hndl, bufs[0], &first_phys);
+  bf_sys_dma_pool_destroy(ps_hndl);
+  if (result) {
+    bf_sys_dma_pool_remove("persistpool");
+    return result;
+  }
+
+  /* attach again as a restarted process would */
+  if (bf_sys_dma_pool_create_ext("persistpool", &ps_hndl, 0, 0,
+                                 DMA_PERSIST_BUF_SIZE, DMA_PERSIST_BUF_CNT, 64,
+                                 &attr)) {
+    printf("cannot re-attach to persistent pool\n");
+    bf_sys_dma_pool_remove("persistpool");
+    return -1;
+  }
+  bf_sys_dma_pool_info_get(ps_hndl, &info);
+  if (!info.restored) {
+    printf("persistent pool not restored\n");
+    result = -1;
+  }
+  if (bf_mem_virt2phy(bf_mem_dma2virt(ps_hndl, first_phys)) != first_phys) {
+    printf("persistent pool not on the same pages\n");
+    result = -1;
+  }
+  /* only the buffers free at the time are handed out, contents intact */
+  for (i = 0; i < DMA_PERSIST_BUF_CNT / 2 && result == 0; i++) {
+    if (bf_sys_dma_alloc(ps_hndl, DMA_PERSIST_BUF_SIZE, &bufs[i], &phys)) {
+      printf("cannot alloc restored pool buffer %d\n", i);
+      result = -1;
+      break;
+    }
+    idx = bf_sys_dma_buffer_index(ps_hndl, bufs[i]);
+    if (idx < DMA_PERSIST_BUF_CNT / 2) {
+      printf("allocated buffer %d handed out again\n", idx);
+      result = -1;
+    }
+  }
+  if (result == 0 &&
+      bf_sys_dma_alloc(ps_hndl, DMA_PERSIST_BUF_SIZE, &extra, &phys) == 0) {
+    printf("restored pool has too many free buffers\n");
+    result = -1;
+  }
+  for (i = 0; i < DMA_PERSIST_BUF_CNT / 2 && result == 0; i++) {
+    uint8_t *buf = (uint8_t *)bf_mem_dma2virt(
+        ps_hndl, first_phys + (bf_phys_addr_t)i * DMA_PERSIST_BUF_SIZE);
+    if (buf == NULL || buf[0] != (i & 0xff) ||
+        buf[DMA_PERSIST_BUF_SIZE - 1] != (i & 0xff)) {
+      printf("restored pool buffer %d lost its contents\n", i);
+      result = -1;
+    }
+  }
+  bf_sys_dma_pool_destroy(ps_hndl);
+  /* a different geometry does not attach to the file */
+  if (result == 0 &&
+      bf_sys_dma_pool_create_ext("persistpool", &ps_hndl, 0, 0,
+                                 DMA_PERSIST_BUF_SIZE, 10, 64, &attr) == 0) {
+    printf("persistent pool attached with another geometry\n");
+    bf_sys_dma_pool_destroy(ps_hndl);
+    result = -1;
+  }
+  if (bf_sys_dma_pool_remove("persistpool")) {
+    printf("cannot remove persistent pool\n");
+    result = -1;
+  }
+  if (result == 0) {
+    printf("DMA persistent pool test OK\n");
+  }
+  return result;
+}
+
+#define DMA_PERSIST_MAG_BUF_CNT 100
+#define DMA_PERSIST_MAG_CYCLES 3
+
+/* allocate buffers until the pool runs dry, then free them all, returns the
+ * number of free buffers the pool had
+ */
+static int dma_free_cnt(bf_sys_dma_pool_handle_t hndl, size_t size,
+                        void **bufs, int max) {
+  bf_phys_addr_t phys;
+  int cnt;
+
+  for (cnt = 0; cnt < max; cnt++) {
+    if (bf_sys_dma_alloc(hndl, size, &bufs[cnt], &phys)) {
+      break;
+    }
+  }
+  bf_sys_dma_free_bulk(hndl, cnt, bufs);
+  return cnt;
+}
+
+/* buffers cached in magazines at destroy go back to the persistent
+ * freelist instead of being lost to the next process
+ */
+static int test_dma_persistent_mags(void) {
+  bf_sys_dma_pool_attr_t attr;
+  bf_sys_dma_pool_handle_t ps_hndl;
+  static void *bufs[DMA_PERSIST_MAG_BUF_CNT + 1];
+  int i, cnt, result = 0;
+
+  bf_sys_dma_pool_remove("persistmagpool");
+  bf_sys_dma_pool_attr_init(&attr);
+  attr.persistent = 1;
+  attr.mag_depth = 32;
+  for (i = 0; i < DMA_PERSIST_MAG_CYCLES && result == 0; i++) {
+    if (bf_sys_dma_pool_create_ext("persistmagpool", &ps_hndl, 0, 0, 4096,
+                                   DMA_PERSIST_MAG_BUF_CNT, 64, &attr)) {
+      printf("cannot attach to persistent pool with magazines\n");
+      result = -1;
+      break;
+    }
+    cnt = dma_free_cnt(ps_hndl, 4096, bufs, DMA_PERSIST_MAG_BUF_CNT + 1);
+    if (cnt != DMA_PERSIST_MAG_BUF_CNT) {
+      printf("persistent pool restart %d has %d free buffers, expected %d\n",
+             i, cnt, DMA_PERSIST_MAG_BUF_CNT);
+      result = -1;
+    }
+    bf_sys_dma_pool_destroy(ps_hndl);
+  }
+  bf_sys_dma_pool_remove("persistmagpool");
+  if (result == 0) {
+    printf("DMA persistent pool magazine test OK\n");
+  }
+  return result;
+}
+
+#define DMA_SHARED_BUF_CNT 64
+
+/* a child process attaches to the pool, fills buffers and sends back their
+ * dma addresses, which must lead the parent to the same buffers. The child
+ * is forked before the parent attaches, as the second attachment of a
+ * process to the same pages is left out of the global lookup index.
+ */
+static int test_dma_shared(void) {
+  bf_sys_dma_pool_attr_t attr;
+  bf_sys_dma_pool_handle_t sh_hndl, ps_hndl;
+  bf_sys_dma_pool_info_t info;
+  static void *bufs[DMA_SHARED_BUF_CNT];
+  bf_phys_addr_t phys[DMA_SHARED_BUF_CNT];
+  int i, status, fds[2], go[2], result = 0;
+  uint8_t *buf;
+  char c = 0;
+  pid_t pid;
+
+  bf_sys_dma_pool_remove("sharedpool");
+  bf_sys_dma_pool_attr_init(&attr);
+  attr.shared = 1;
+  if (pipe(fds)) {
+    return -1;
+  }
+  if (pipe(go)) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    close(go[1]);
+    /* wait for the parent to create the pool */
+    if (read(go[0], &c, 1) != 1 ||
+        bf_sys_dma_pool_create_ext("sharedpool", &sh_hndl, 0, 0, 4096,
+                                   DMA_SHARED_BUF_CNT, 64, &attr)) {
+      _exit(1);
+    }
+    bf_sys_dma_pool_info_get(sh_hndl, &info);
+    if (!info.restored ||
+        bf_sys_dma_alloc_bulk(sh_hndl, DMA_SHARED_BUF_CNT / 2, bufs, phys)) {
+      _exit(2);
+    }
+    for (i = 0; i < DMA_SHARED_BUF_CNT / 2; i++) {
+      memset(bufs[i], i, 4096);
+    }
+    if (write(fds[1], phys, sizeof(phys) / 2) != sizeof(phys) / 2) {
+      _exit(3);
+    }
+    bf_sys_dma_pool_destroy(sh_hndl);
+    _exit(0);
+  }
+  close(fds[1]);
+  close(go[0]);
+  if (bf_sys_dma_pool_create_ext("sharedpool", &sh_hndl, 0, 0, 4096,
+                                 DMA_SHARED_BUF_CNT, 64, &attr)) {
+    printf("cannot create shared pool\n");
+    close(go[1]);
+    close(fds[0]);
+    if (pid > 0) {
+      waitpid(pid, &status, 0);
+    }
+    return -1;
+  }
+  /* a persistent pool does not let others attach */
+  attr.shared = 0;
+  attr.persistent = 1;
+  if (bf_sys_dma_pool_create_ext("sharedpool", &ps_hndl, 0, 0, 4096,
+                                 DMA_SHARED_BUF_CNT, 64, &attr) == 0) {
+    printf("persistent pool attached to a shared pool in use\n");
+    bf_sys_dma_pool_destroy(ps_hndl);
+    result = -1;
+  }
+  if (write(go[1], &c, 1) != 1) {
+    result = -1;
+  }
+  close(go[1]);
+  if (pid < 0 || read(fds[0], phys, sizeof(phys) / 2) != sizeof(phys) / 2 ||
+      waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    printf("shared pool child failed\n");
+    result = -1;
+  }
+  close(fds[0]);
+  for (i = 0; i < DMA_SHARED_BUF_CNT / 2 && result == 0; i++) {
+    buf = bf_mem_dma2virt(sh_hndl, phys[i]);
+    if (buf == NULL || buf[0] != i || buf[4095] != i) {
+      printf("shared pool buffer %d not seen by the parent\n", i);
+      result = -1;
+    }
+  }
+  /* the parent gets the buffers the child left free, and only those */
+  if (result == 0 &&
+      (bf_sys_dma_alloc_bulk(sh_hndl, DMA_SHARED_BUF_CNT / 2, bufs, phys) ||
+       bf_sys_dma_alloc_bulk(sh_hndl, 1, bufs, phys) == 0)) {
+    printf("bad number of free buffers left in the shared pool\n");
+    result = -1;
+  }
+  bf_sys_dma_pool_destroy(sh_hndl);
+  bf_sys_dma_pool_remove("sharedpool");
+  if (result == 0) {
+    printf("DMA shared pool test OK\n");
+  }
+  return result;
+}
+
+/* a child process attaches with magazines, leaves freed buffers cached in
+ * them and detaches; the parent must still find every buffer free
+ */
+static int test_dma_shared_mags(void) {
+  bf_sys_dma_pool_attr_t attr;
+  bf_sys_dma_pool_handle_t sh_hndl;
+  static void *bufs[DMA_SHARED_BUF_CNT + 1];
+  bf_phys_addr_t phys;
+  int i, cnt, status, go[2], result = 0;
+  char c = 0;
+  pid_t pid;
+
+  bf_sys_dma_pool_remove("sharedmagpool");
+  bf_sys_dma_pool_attr_init(&attr);
+  attr.shared = 1;
+  if (pipe(go)) {
+    return -1;
+  }
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    close(go[1]);
+    attr.mag_depth = 16;
+    if (read(go[0], &c, 1) != 1 ||
+        bf_sys_dma_pool_create_ext("sharedmagpool", &sh_hndl, 0, 0, 4096,
+                                   DMA_SHARED_BUF_CNT, 64, &attr)) {
+      _exit(1);
+    }
+    for (i = 0; i < DMA_SHARED_BUF_CNT / 4; i++) {
+      if (bf_sys_dma_alloc(sh_hndl, 4096, &bufs[i], &phys)) {
+        _exit(2);
+      }
+    }
+    bf_sys_dma_free_bulk(sh_hndl, DMA_SHARED_BUF_CNT / 4, bufs);
+    bf_sys_dma_pool_destroy(sh_hndl);
+    _exit(0);
+  }
+  close(go[0]);
+  if (bf_sys_dma_pool_create_ext("sharedmagpool", &sh_hndl, 0, 0, 4096,
+                                 DMA_SHARED_BUF_CNT, 64, &attr)) {
+    printf("cannot create shared pool for magazines\n");
+    close(go[1]);
+    if (pid > 0) {
+      waitpid(pid, &status, 0);
+    }
+    return -1;
+  }
+  if (write(go[1], &c, 1) != 1) {
+    result = -1;
+  }
+  close(go[1]);
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    printf("shared pool magazine child failed\n");
+    result = -1;
+  }
+  cnt = dma_free_cnt(sh_hndl, 4096, bufs, DMA_SHARED_BUF_CNT + 1);
+  if (result == 0 && cnt != DMA_SHARED_BUF_CNT) {
+    printf("shared pool has %d free buffers after a detach, expected %d\n",
+           cnt, DMA_SHARED_BUF_CNT);
+    result = -1;
+  }
+  bf_sys_dma_pool_destroy(sh_hndl);
+  bf_sys_dma_pool_remove("sharedmagpool");
+  if (result == 0) {
+    printf("DMA shared pool magazine test OK\n");
+  }
+  return result;
+}
+
+#define DMA_POPULATE_BUF_CNT 256
+
+static int test_dma_populate(void) {
+  bf_sys_dma_pool_attr_t attr;
+  bf_sys_dma_pool_handle_t pp_hndl;
+  bf_sys_dma_pool_info_t info;
+  static void *bufs[DMA_POPULATE_BUF_CNT];
+  static bf_phys_addr_t phys[DMA_POPULATE_BUF_CNT];
+  int i, result = 0;
+
+  /* pages faulted in by several threads */
+  bf_sys_dma_pool_attr_init(&attr);
+  attr.populate_threads = 4;
+  if (bf_sys_dma_pool_create_ext("parpool", &pp_hndl, 0, 0, 65536,
+                                 DMA_POPULATE_BUF_CNT, 64, &attr)) {
+    printf("cannot create parallel populated pool\n");
+    return -1;
+  }
+  bf_sys_dma_pool_info_get(pp_hndl, &info);
+  if (info.cold || info.create_usec == 0) {
+    printf("bad parallel populated pool info\n");
+    result = -1;
+  }
+  if (result == 0 &&
+      bf_sys_dma_alloc_bulk(pp_hndl, DMA_POPULATE_BUF_CNT, bufs, phys)) {
+    printf("cannot alloc from parallel populated pool\n");
+    result = -1;
+  }
+  for (i = 0; i < DMA_POPULATE_BUF_CNT && result == 0; i++) {
+    if (phys[i] != bf_mem_virt2phy(bufs[i])) {
+      printf("bad parallel populated pool buffer %d\n", i);
+      result = -1;
+    }
+  }
+  bf_sys_dma_pool_destroy(pp_hndl);
+  if (result) {
+    return result;
+  }
+
+  /* pages left alone until the first allocation */
+  attr.cold = 1;
+  if (bf_sys_dma_pool_create_ext("coldpool", &pp_hndl, 0, 0, 65536,
+                                 DMA_POPULATE_BUF_CNT, 64, &attr)) {
+    printf("cannot create cold pool\n");
+    return -1;
+  }
+  bf_sys_dma_pool_info_get(pp_hndl, &info);
+  if (!info.cold) {
+    printf("cold pool populated at creation\n");
+    result = -1;
+  }
+  if (result == 0 &&
+      bf_sys_dma_alloc_bulk(pp_hndl, DMA_POPULATE_BUF_CNT, bufs, phys)) {
+    printf("cannot alloc from cold pool\n");
+    result = -1;
+  }
+  for (i = 0; i < DMA_POPULATE_BUF_CNT && result == 0; i++) {
+    if (phys[i] != bf_mem_virt2phy(bufs[i]) ||
+        bf_mem_dma2virt(pp_hndl, phys[i]) != bufs[i]) {
+      printf("bad cold pool buffer %d\n", i);
+      result = -1;
+    }
+  }
+  bf_sys_dma_pool_info_get(pp_hndl, &info);
+  if (result == 0 && (info.cold || info.warm_usec == 0)) {
+    printf("cold pool not populated on allocation\n");
+    result = -1;
+  }
+  bf_sys_dma_pool_destroy(pp_hndl);
+  if (result == 0) {
+    printf("DMA pool populate test OK\n");
+  }
+  return result;
+}
+
+#define DMA_STATS_BUF_CNT 100
+
+static int stats_iter_fn(bf_sys_dma_pool_handle_t pool_hndl,
+                         const char *pool_name, void *cookie) {
+  if (strcmp(pool_name, "statspool") == 0) {
+    *(bf_sys_dma_pool_handle_t *)cookie = pool_hndl;
+    return 1;
+  }
+  return 0;
+}
+
+static int test_dma_stats(void) {
+  bf_sys_dma_pool_attr_t attr;
+  bf_sys_dma_pool_handle_t st_hndl, found = NULL;
+  bf_sys_dma_pool_stats_t stats;
+  static void *bufs[DMA_STATS_BUF_CNT];
+  static bf_phys_addr_t bulk_phys[DMA_STATS_BUF_CNT];
+  bf_phys_addr_t phys;
+  void *extra;
+  int i, result = 0;
+
+  bf_sys_dma_pool_attr_init(&attr);
+  attr.mag_depth = 8;
+  if (bf_sys_dma_pool_create_ext("statspool", &st_hndl, 0, 0, 4096,
+                                 DMA_STATS_BUF_CNT, 64, &attr)) {
+    printf("cannot create stats pool\n");
+    return -1;
+  }
+  for (i = 0; i < DMA_STATS_BUF_CNT; i++) {
+    bf_sys_dma_alloc(st_hndl, 4096, &bufs[i], &phys);
+  }
+  bf_sys_dma_alloc(st_hndl, 4096, &extra, &phys);
+  bf_sys_dma_free_bulk(st_hndl, DMA_STATS_BUF_CNT / 2, bufs);
+  bf_sys_dma_pool_stats_get(st_hndl, &stats);
+  if (stats.allocs != DMA_STATS_BUF_CNT ||
+      stats.frees != DMA_STATS_BUF_CNT / 2 ||
+      stats.in_use != DMA_STATS_BUF_CNT / 2 || stats.alloc_fails != 1 ||
+      stats.taken_hwm != DMA_STATS_BUF_CNT ||
+      stats.buf_cnt != DMA_STATS_BUF_CNT || stats.num_pages != 1) {
+    printf("bad stats pool counters %" PRIu64 "/%" PRIu64 "/%" PRIu64
+           "/%" PRIu64 "/%" PRIu64 "\n",
+           stats.allocs, stats.frees, stats.in_use, stats.alloc_fails,
+           stats.taken_hwm);
+    result = -1;
+  }
+  /* taken goes back down as the buffers and the magazine come back, so
+   * taking them all again does not raise the high-water mark
+   */
+  bf_sys_dma_free_bulk(st_hndl, DMA_STATS_BUF_CNT / 2,
+                       &bufs[DMA_STATS_BUF_CNT / 2]);
+  bf_sys_dma_pool_mag_flush(st_hndl);
+  bf_sys_dma_alloc_bulk(st_hndl, DMA_STATS_BUF_CNT / 2, bufs, bulk_phys);
+  for (i = DMA_STATS_BUF_CNT / 2; i < DMA_STATS_BUF_CNT; i++) {
+    bf_sys_dma_alloc(st_hndl, 4096, &bufs[i], &phys);
+  }
+  bf_sys_dma_pool_stats_get(st_hndl, &stats);
+  if (stats.in_use != DMA_STATS_BUF_CNT ||
+      stats.taken_hwm != DMA_STATS_BUF_CNT) {
+    printf("bad stats pool high-water mark %" PRIu64 "\n", stats.taken_hwm);
+    result = -1;
+  }
+  bf_sys_dma_pool_iterate(stats_iter_fn, &found);
+  if (found != st_hndl) {
+    printf("stats pool not found among the live pools\n");
+    result = -1;
+  }
+  bf_sys_dma_pool_destroy(st_hndl);
+  found = NULL;
+  bf_sys_dma_pool_iterate(stats_iter_fn, &found);
+  if (found) {
+    printf("destroyed stats pool still live\n");
+    result = -1;
+  }
+  if (result == 0) {
+    printf("DMA pool stats test OK\n");
+  }
+  return result;
+}
+
+static int test_dma_bad_free(void) {
+  bf_sys_dma_pool_attr_t attr;
+  bf_sys_dma_pool_handle_t bf_hndl;
+  bf_sys_dma_pool_stats_t stats;
+  void *bufs[4], *again, *extra;
+  bf_phys_addr_t phys;
+  int i, result = 0;
+
+  bf_sys_dma_pool_attr_init(&attr);
+  attr.mag_depth = 4;
+  if (bf_sys_dma_pool_create_ext("badfreepool", &bf_hndl, 0, 0, 4096, 4, 64,
+                                 &attr)) {
+    printf("cannot create bad free pool\n");
+    return -1;
+  }
+  for (i = 0; i < 4; i++) {
+    bf_sys_dma_alloc(bf_hndl, 4096, &bufs[i], &phys);
+  }
+  /* a double free, a pointer into the middle of a buffer and a pointer
+   * outside of the pool are all dropped
+   */
+  bf_sys_dma_free(bf_hndl, bufs[0]);
+  bf_sys_dma_free(bf_hndl, bufs[0]);
+  bf_sys_dma_free(bf_hndl, (uint8_t *)bufs[1] + 8);
+  bf_sys_dma_free(bf_hndl, &stats);
+  extra = bufs[1];
+  bufs[1] = bufs[0];
+  bf_sys_dma_free_bulk(bf_hndl, 2, bufs);
+  bufs[1] = extra;
+  bf_sys_dma_pool_stats_get(bf_hndl, &stats);
+  if (stats.bad_frees != 5 || stats.in_use != 3) {
+    printf("bad frees not caught %" PRIu64 "/%" PRIu64 "\n", stats.bad_frees,
+           stats.in_use);
+    result = -1;
+  }
+  /* the double freed buffer is handed out once only */
+  if (bf_sys_dma_alloc(bf_hndl, 4096, &again, &phys) || again != bufs[0] ||
+      bf_sys_dma_alloc(bf_hndl, 4096, &extra, &phys) == 0) {
+    printf("double freed buffer handed out twice\n");
+    result = -1;
+  }
+  bf_sys_dma_free_bulk(bf_hndl, 4, bufs);
+  bf_sys_dma_pool_stats_get(bf_hndl, &stats);
+  if (stats.bad_frees != 5 || stats.in_use != 0) {
+    printf("good frees rejected %" PRIu64 "/%" PRIu64 "\n", stats.bad_frees,
+           stats.in_use);
+    result = -1;
+  }
+  bf_sys_dma_pool_destroy(bf_hndl);
+  if (result == 0) {
+    printf("DMA bad free test OK\n");
+  }
+  return result;
+}
+
+static int test_dma_refcnt(void) {
+  bf_sys_dma_pool_attr_t attr;
+  bf_sys_dma_pool_handle_t rc_hndl;
+  void *bufs[2], *buf;
+  bf_phys_addr_t phys;
+  int result = 0;
+
+  bf_sys_dma_pool_attr_init(&attr);
+  attr.refcnt = 1;
+  if (bf_sys_dma_pool_create_ext("refpool", &rc_hndl, 0, 0, 2048, 2, 64,
+                                 &attr)) {
+    printf("cannot create refcounted pool\n");
+    return -1;
+  }
+  bf_sys_dma_alloc(rc_hndl, 2048, &bufs[0], &phys);
+  bf_sys_dma_alloc(rc_hndl, 2048, &bufs[1], &phys);
+  /* three owners of the first buffer, two of the second */
+  if (bf_sys_dma_buf_ref(rc_hndl, bufs[0]) ||
+      bf_sys_dma_buf_ref(rc_hndl, bufs[0]) ||
+      bf_sys_dma_buf_ref(rc_hndl, bufs[1])) {
+    printf("cannot reference buffers\n");
+    result = -1;
+  }
+  bf_sys_dma_buf_unref(rc_hndl, bufs[0]);
+  bf_sys_dma_free_bulk(rc_hndl, 2, bufs);
+  if (bf_sys_dma_alloc(rc_hndl, 2048, &buf, &phys) == 0) {
+    printf("referenced buffer %p freed early\n", buf);
+    result = -1;
+  }
+  /* the last references free the buffers */
+  bf_sys_dma_free(rc_hndl, bufs[1]);
+  bf_sys_dma_buf_unref(rc_hndl, bufs[0]);
+  if (bf_sys_dma_buf_ref(rc_hndl, bufs[0]) == 0) {
+    printf("free buffer referenced\n");
+    result = -1;
+  }
+  if (bf_sys_dma_alloc(rc_hndl, 2048, &buf, &phys) ||
+      bf_sys_dma_alloc(rc_hndl, 2048, &buf, &phys)) {
+    printf("unreferenced buffers not freed\n");
+    result = -1;
+  }
+  bf_sys_dma_pool_destroy(rc_hndl);
+  if (bf_sys_dma_buf_ref(hndl[0], v_addr[0][0]) == 0) {
+    printf("buffer of a pool without reference counts referenced\n");
+    result = -1;
+  }
+  if (result == 0) {
+    printf("DMA buffer reference count test OK\n");
+  }
+  return result;
+}
+
+static int test_dma_copy(void) {
+  static uint8_t src[16384], dst[16384];
+  static const size_t lens[] = {0, 1, 63, 255, 256, 1000, 4096, 16000};
+  uint8_t *buf = v_addr[0][0];
+  size_t i, j, off;
+  uint8_t exp;
+  int result = 0;
+
+  for (i = 0; i < sizeof(src); i++) {
+    src[i] = (uint8_t)(i * 7 + 3);
+  }
+  /* every length at a few source and destination misalignments */
+  for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+    for (off = 0; off < 64; off += 13) {
+      memset(buf, 0xa5, lens[i] + 128);
+      if (bf_sys_dma_copy_to_dev(buf + off, src + off / 2, lens[i]) !=
+          buf + off) {
+        printf("copy to dev returned a wrong pointer\n");
+        return -1;
+      }
+      if (memcmp(buf + off, src + off / 2, lens[i]) ||
+          buf[off + lens[i]] != 0xa5 || (off && buf[off - 1] != 0xa5)) {
+        printf("copy to dev of %zu bytes at %zu failed\n", lens[i], off);
+        result = -1;
+      }
+      if (bf_sys_dma_cache_flush(buf + off, lens[i]) ||
+          bf_sys_dma_cache_invalidate(buf + off, lens[i]) ||
+          memcmp(buf + off, src + off / 2, lens[i])) {
+        printf("cache flush of %zu bytes at %zu failed\n", lens[i], off);
+        result = -1;
+      }
+      memset(dst, 0x5a, sizeof(dst));
+      if (bf_sys_dma_copy_from_dev(dst + 3, buf + off, lens[i]) != dst + 3) {
+        printf("copy from dev returned a wrong pointer\n");
+        return -1;
+      }
+      for (j = 0; j < sizeof(dst); j++) {
+        exp = (j >= 3 && j < lens[i] + 3) ? src[off / 2 + j - 3] : 0x5a;
+        if (dst[j] != exp) {
+          printf("copy from dev of %zu bytes at %zu failed\n", lens[i], off);
+          result = -1;
+          break;
+        }
+      }
+    }
+  }
+  if (result == 0) {
+    printf("DMA copy test OK\n");
+  }
+  return result;
+}
+
+static int test_dma_ring(void) {
+  bf_sys_dma_pool_handle_t ring_pool;
+  bf_sys_dma_ring_handle_t ring;
+  bf_sys_dma_ring_info_t info;
+  static const int flags[] = {0, BF_SYS_DMA_RING_F_MP};
+  uint32_t in[100][4], out[100][4];
+  uint32_t i, k, n, want, room, seq, next;
+  int f, result = 0;
+
+  if (bf_sys_dma_pool_create("ringpool", &ring_pool, 0, 0, 8192, 2, 64)) {
+    printf("cannot create ring pool\n");
+    return -1;
+  }
+  if (bf_sys_dma_ring_create(ring_pool, 48, 16, 0, &ring) == 0 ||
+      bf_sys_dma_ring_create(ring_pool, 1024, 16, 0, &ring) == 0) {
+    printf("ring of a bad slot count or too large created\n");
+    result = -1;
+  }
+  for (f = 0; f < 2 && result == 0; f++) {
+    if (bf_sys_dma_ring_create(ring_pool, 64, 16, flags[f], &ring)) {
+      printf("cannot create ring\n");
+      result = -1;
+      break;
+    }
+    bf_sys_dma_ring_info_get(ring, &info);
+    if (info.slot_cnt != 64 || info.slot_size != 16 ||
+        info.slots_phys_addr != bf_mem_virt2phy(info.slots_v_addr) ||
+        info.slots_dma_addr != bf_mem_virt2dma(info.slots_v_addr) ||
+        info.prod_idx_dma_addr / 64 == info.cons_idx_dma_addr / 64) {
+      printf("wrong ring info\n");
+      result = -1;
+    }
+    /* bursts of uneven sizes, wrapping around the end of the ring */
+    seq = next = 0;
+    for (i = 0; i < 200 && result == 0; i++) {
+      for (k = 0; k < 100; k++) {
+        in[k][0] = seq + k;
+        in[k][3] = ~(seq + k);
+      }
+      want = 1 + i * 7 % 100;
+      room = bf_sys_dma_ring_free_count(ring);
+      n = bf_sys_dma_ring_enqueue_burst(ring, in, want);
+      if (n != (want < room ? want : room)) {
+        printf("enqueued %u of %u slots into %u free\n", n, want, room);
+        result = -1;
+      }
+      seq += n;
+      want = 1 + i * 5 % 60;
+      room = bf_sys_dma_ring_count(ring);
+      n = bf_sys_dma_ring_dequeue_burst(ring, out, want);
+      if (room != seq - next || n != (want < room ? want : room)) {
+        printf("dequeued %u of %u slots out of %u\n", n, want, room);
+        result = -1;
+      }
+      for (k = 0; k < n; k++, next++) {
+        if (out[k][0] != next || out[k][3] != ~next) {
+          printf("slot %u dequeued out of order\n", next);
+          result = -1;
+          break;
+        }
+      }
+    }
+    bf_sys_dma_ring_destroy(ring);
+  }
+  bf_sys_dma_pool_destroy(ring_pool);
+  if (result == 0) {
+    printf("DMA ring test OK\n");
+  }
+  return result;
+}
+
+/* mock iommu of devices with iova spaces of their own, each starting at
+ * DMA_MOCK_IOVA_OFFSET
+ */
+static int mock_dev_map_range(int dev_id, uint32_t subdev_id,
+                              const bf_phys_addr_t *phy_addrs, int cnt,
+                              size_t page_size, bf_dma_addr_t *dma_addrs) {
+  int i;
+
+  (void)dev_id;
+  (void)subdev_id;
+  (void)phy_addrs;
+  for (i = 0; i < cnt; i++) {
+    dma_addrs[i] = DMA_MOCK_IOVA_OFFSET + (size_t)i * page_size;
+  }
+  return 0;
+}
+
+/* two devices with the same bus addresses each find their own pool */
+static int test_dma_lookup_devs(void) {
+  bf_sys_dma_pool_handle_t dev_hndl[2] = {NULL, NULL}, found;
+  bf_dma_addr_t dma[2];
+  void *bufs[2], *vaddr;
+  int i, result = 0;
+
+  bf_sys_dma_map_range_fn_register(mock_dev_map_range, mock_unmap_range);
+  for (i = 0; i < 2 && result == 0; i++) {
+    if (bf_sys_dma_pool_create(i ? "devpool1" : "devpool0", &dev_hndl[i], i,
+                               0, 4096, 4, 64) ||
+        bf_sys_dma_alloc(dev_hndl[i], 4096, &bufs[i], &dma[i])) {
+      printf("cannot create pool of device %d\n", i);
+      result = -1;
+    }
+  }
+  if (result == 0 && dma[0] != dma[1]) {
+    printf("devices got different bus addresses\n");
+    result = -1;
+  }
+  for (i = 0; i < 2 && result == 0; i++) {
+    if (bf_sys_dma_lookup(i, 0, dma[i], &found, &vaddr, NULL) ||
+        found != dev_hndl[i] || vaddr != bufs[i]) {
+      printf("lookup of the pool of device %d failed\n", i);
+      result = -1;
+    }
+  }
+  if (result == 0 && bf_sys_dma_lookup(2, 0, dma[0], &found, NULL, NULL) == 0) {
+    printf("pool found for a device without pools\n");
+    result = -1;
+  }
+  for (i = 0; i < 2; i++) {
+    if (dev_hndl[i]) {
+      bf_sys_dma_pool_destroy(dev_hndl[i]);
+    }
+  }
+  bf_sys_dma_map_range_fn_register(NULL, NULL);
+  return result;
+}
+
+static int test_dma_lookup(void) {
+  bf_sys_dma_pool_handle_t found, tmp_hndl;
+  static const unsigned int offs[] = {0, 1, 2};
+  void *vaddr, *buf;
+  bf_phys_addr_t phys;
+  unsigned int i, j, k, off;
+  int index;
+
+  /* the start, middle and last byte of every buffer of every pool */
+  for (i = 0; i < DMA_POOL_CNT; i++) {
+    for (j = 0; j < buff_cnt[i]; j++) {
+      for (k = 0; k < sizeof(offs) / sizeof(offs[0]); k++) {
+        off = offs[k] * (buff_size[i] - 1) / 2;
+        if (bf_sys_dma_lookup(0, 0, dma_addr[i][j] + off, &found, &vaddr,
+                              &index) ||
+            found != hndl[i] || vaddr != (uint8_t *)v_addr[i][j] + off ||
+            index != bf_sys_dma_buffer_index(hndl[i], v_addr[i][j])) {
+          printf("lookup of pool %u buffer %u offset %u failed\n", i, j, off);
+          return -1;
+        }
+      }
+    }
+  }
+  /* a pool is not found once destroyed */
+  if (bf_sys_dma_pool_create("lookuppool", &tmp_hndl, 0, 0, 4096, 4, 64) ||
+      bf_sys_dma_alloc(tmp_hndl, 4096, &buf, &phys)) {
+    printf("cannot create lookup pool\n");
+    return -1;
+  }
+  if (bf_sys_dma_lookup(0, 0, phys, &found, NULL, NULL) || found != tmp_hndl) {
+    printf("lookup of a new pool failed\n");
+    bf_sys_dma_pool_destroy(tmp_hndl);
+    return -1;
+  }
+  bf_sys_dma_pool_destroy(tmp_hndl);
+  if (bf_sys_dma_lookup(0, 0, phys, &found, NULL, NULL) == 0) {
+    printf("destroyed pool found by lookup\n");
+    return -1;
+  }
+  if (test_dma_lookup_devs()) {
+    return -1;
+  }
+  printf("DMA global lookup test OK\n");
+  return 0;
+}
+
 static int dma_mem_test() {
   int ret, i, j;
   int result = 0;
@@ -147,6 +1860,131 @@ static int dma_mem_test() {
   }
 
   result = test_dma_2_virt();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_mag();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_bulk();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_1g_pages();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_large_bufs();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_packing();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_page_bufs();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_one_page();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_sg();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_numa();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_malloc();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_reserve();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_map_range();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_user_map();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_elastic();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_persistent();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_persistent_mags();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_shared();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_shared_mags();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_populate();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_stats();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_bad_free();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_refcnt();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_copy();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_ring();
+  if (result != 0) {
+    goto free_dma_buff;
+  }
+
+  result = test_dma_lookup();
 
 free_dma_buff:
   for (i = 0; i < DMA_POOL_CNT; i++) {
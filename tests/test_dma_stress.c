@@ -0,0 +1,295 @@
+/*******************************************************************************
+ * Copyright(c) 2021 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this software except as stipulated in the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ******************************************************************************/
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <target-sys/bf_sal/bf_sys_dma.h>
+
+/* Concurrent alloc/free stress of a single DMA pool. Every thread stamps the
+ * buffers it owns and checks the stamp before freeing them, so a buffer handed
+ * out twice by the pool freelist is caught.
+ */
+
+#define STRESS_THREAD_MAX 32
+#define STRESS_BUF_CNT 4096
+#define STRESS_BUF_SIZE 256
+#define STRESS_BURST 8
+#define STRESS_ITER 200000
+
+static bf_sys_dma_pool_handle_t stress_hndl;
+static volatile int stress_errors = 0;
+
+static void *stress_thread(void *arg) {
+  uintptr_t id = (uintptr_t)arg;
+  void *bufs[STRESS_BURST];
+  bf_phys_addr_t phys;
+  int i, j, n;
+
+  for (i = 0; i < STRESS_ITER; i++) {
+    for (n = 0; n < STRESS_BURST; n++) {
+      if (bf_sys_dma_alloc(stress_hndl, STRESS_BUF_SIZE, &bufs[n], &phys)) {
+        break;
+      }
+      *(volatile uint64_t *)bufs[n] = (id << 32) | (uint32_t)i;
+    }
+    for (j = n - 1; j >= 0; j--) {
+      if (*(volatile uint64_t *)bufs[j] != ((id << 32) | (uint32_t)i)) {
+        __sync_fetch_and_add(&stress_errors, 1);
+      }
+      bf_sys_dma_free(stress_hndl, bufs[j]);
+    }
+  }
+  bf_sys_dma_pool_mag_flush(stress_hndl);
+  return NULL;
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int stress_run(int thread_cnt, int mag_depth) {
+  bf_sys_dma_pool_attr_t attr;
+  pthread_t thr[STRESS_THREAD_MAX];
+  void *bufs[STRESS_BUF_CNT];
+  bf_phys_addr_t phys;
+  double start, elapsed;
+  int i, n;
+
+  bf_sys_dma_pool_attr_init(&attr);
+  attr.mag_depth = mag_depth;
+  if (bf_sys_dma_pool_create_ext("stresspool", &stress_hndl, 0, 0,
+                                 STRESS_BUF_SIZE, STRESS_BUF_CNT, 64, &attr)) {
+    printf("cannot create stress pool\n");
+    return -1;
+  }
+  start = now_sec();
+  for (i = 0; i < thread_cnt; i++) {
+    pthread_create(&thr[i], NULL, stress_thread, (void *)(uintptr_t)(i + 1));
+  }
+  for (i = 0; i < thread_cnt; i++) {
+    pthread_join(thr[i], NULL);
+  }
+  elapsed = now_sec() - start;
+
+  /* every buffer must be back on the freelist exactly once */
+  for (n = 0; n < STRESS_BUF_CNT; n++) {
+    if (bf_sys_dma_alloc(stress_hndl, STRESS_BUF_SIZE, &bufs[n], &phys)) {
+      break;
+    }
+  }
+  if (n != STRESS_BUF_CNT ||
+      bf_sys_dma_alloc(stress_hndl, STRESS_BUF_SIZE, &bufs[0], &phys) == 0) {
+    printf("freelist holds %d buffers, expected %d\n", n, STRESS_BUF_CNT);
+    stress_errors++;
+  }
+  bf_sys_dma_pool_destroy(stress_hndl);
+
+  printf("threads %2d mag_depth %3d: %8.2f Mops/s\n", thread_cnt, mag_depth,
+         2.0 * STRESS_BURST * STRESS_ITER * thread_cnt / elapsed / 1e6);
+  return stress_errors ? -1 : 0;
+}
+
+/* Multi-producer ring stress: producers enqueue their own sequence numbers
+ * in bursts and the consumer checks that each producer's slots arrive
+ * complete and in order.
+ */
+#define RING_STRESS_SLOTS 1024
+#define RING_STRESS_ITER 200000
+
+static bf_sys_dma_ring_handle_t ring_stress_hndl;
+
+static void *ring_stress_thread(void *arg) {
+  uint64_t id = (uintptr_t)arg;
+  uint64_t slots[STRESS_BURST][2];
+  uint32_t seq = 0, n, i;
+
+  while (seq < RING_STRESS_ITER) {
+    for (i = 0; i < STRESS_BURST; i++) {
+      slots[i][0] = id;
+      slots[i][1] = seq + i;
+    }
+    n = STRESS_BURST;
+    if (n > RING_STRESS_ITER - seq) {
+      n = RING_STRESS_ITER - seq;
+    }
+    n = bf_sys_dma_ring_enqueue_burst(ring_stress_hndl, slots, n);
+    if (n == 0) {
+      sched_yield();
+    }
+    seq += n;
+  }
+  return NULL;
+}
+
+static int ring_stress_run(int thread_cnt) {
+  bf_sys_dma_pool_handle_t pool;
+  pthread_t thr[STRESS_THREAD_MAX];
+  uint64_t slots[STRESS_BURST][2];
+  uint32_t next[STRESS_THREAD_MAX + 1] = {0};
+  uint64_t total = 0;
+  double start, elapsed;
+  int errors = 0;
+  uint32_t n, i;
+
+  if (bf_sys_dma_pool_create("ringstresspool", &pool, 0, 0,
+                             128 + RING_STRESS_SLOTS * sizeof(slots[0]), 1,
+                             64) ||
+      bf_sys_dma_ring_create(pool, RING_STRESS_SLOTS, sizeof(slots[0]),
+                             BF_SYS_DMA_RING_F_MP, &ring_stress_hndl)) {
+    printf("cannot create stress ring\n");
+    return -1;
+  }
+  start = now_sec();
+  for (i = 0; i < (uint32_t)thread_cnt; i++) {
+    pthread_create(&thr[i], NULL, ring_stress_thread,
+                   (void *)(uintptr_t)(i + 1));
+  }
+  while (total < (uint64_t)thread_cnt * RING_STRESS_ITER) {
+    n = bf_sys_dma_ring_dequeue_burst(ring_stress_hndl, slots, STRESS_BURST);
+    if (n == 0) {
+      sched_yield();
+    }
+    for (i = 0; i < n; i++) {
+      if (slots[i][0] < 1 || slots[i][0] > (uint64_t)thread_cnt ||
+          slots[i][1] != next[slots[i][0]]++) {
+        errors++;
+      }
+    }
+    total += n;
+  }
+  for (i = 0; i < (uint32_t)thread_cnt; i++) {
+    pthread_join(thr[i], NULL);
+  }
+  elapsed = now_sec() - start;
+  if (bf_sys_dma_ring_count(ring_stress_hndl) != 0) {
+    errors++;
+  }
+  bf_sys_dma_ring_destroy(ring_stress_hndl);
+  bf_sys_dma_pool_destroy(pool);
+
+  printf("ring producers %2d: %8.2f Mslots/s\n", thread_cnt,
+         total / elapsed / 1e6);
+  if (errors) {
+    printf("%d slots lost or out of order\n", errors);
+  }
+  return errors ? -1 : 0;
+}
+
+/* Global lookup under pool churn: lookup threads resolve the buffers of a
+ * pool that stays while the main thread creates and destroys other pools.
+ */
+#define LOOKUP_STRESS_POOLS 100
+
+static volatile int lookup_stress_done;
+static void *lookup_stress_bufs[STRESS_BURST];
+static bf_dma_addr_t lookup_stress_dma[STRESS_BURST];
+
+static void *lookup_stress_thread(void *arg) {
+  bf_sys_dma_pool_handle_t found;
+  void *vaddr;
+  int i, index;
+
+  (void)arg;
+  while (!lookup_stress_done) {
+    for (i = 0; i < STRESS_BURST; i++) {
+      if (bf_sys_dma_lookup(0, 0, lookup_stress_dma[i] + 8, &found, &vaddr,
+                            &index) ||
+          found != stress_hndl ||
+          vaddr != (uint8_t *)lookup_stress_bufs[i] + 8 ||
+          index != bf_sys_dma_buffer_index(stress_hndl,
+                                           lookup_stress_bufs[i])) {
+        __sync_fetch_and_add(&stress_errors, 1);
+      }
+    }
+    /* leave the pool churn some cpu on small machines */
+    sched_yield();
+  }
+  return NULL;
+}
+
+static int lookup_stress_run(int thread_cnt) {
+  bf_sys_dma_pool_handle_t churn;
+  pthread_t thr[STRESS_THREAD_MAX];
+  void *buf;
+  bf_phys_addr_t phys;
+  int i;
+
+  if (bf_sys_dma_pool_create("lookupstresspool", &stress_hndl, 0, 0,
+                             STRESS_BUF_SIZE, STRESS_BUF_CNT, 64)) {
+    printf("cannot create lookup stress pool\n");
+    return -1;
+  }
+  for (i = 0; i < STRESS_BURST; i++) {
+    bf_sys_dma_alloc(stress_hndl, STRESS_BUF_SIZE, &lookup_stress_bufs[i],
+                     &lookup_stress_dma[i]);
+  }
+  lookup_stress_done = 0;
+  for (i = 0; i < thread_cnt; i++) {
+    pthread_create(&thr[i], NULL, lookup_stress_thread, NULL);
+  }
+  for (i = 0; i < LOOKUP_STRESS_POOLS; i++) {
+    if (bf_sys_dma_pool_create("churnpool", &churn, 0, 0, 4096, 16, 64)) {
+      stress_errors++;
+      break;
+    }
+    if (bf_sys_dma_alloc(churn, 4096, &buf, &phys) ||
+        bf_sys_dma_lookup(0, 0, phys, NULL, NULL, NULL)) {
+      stress_errors++;
+    }
+    bf_sys_dma_pool_destroy(churn);
+  }
+  lookup_stress_done = 1;
+  for (i = 0; i < thread_cnt; i++) {
+    pthread_join(thr[i], NULL);
+  }
+  bf_sys_dma_pool_destroy(stress_hndl);
+  printf("lookup threads %2d: %d pools created and destroyed\n", thread_cnt,
+         LOOKUP_STRESS_POOLS);
+  return stress_errors ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+  int max_threads = 16;
+  int t;
+
+  if (argc > 1) {
+    max_threads = atoi(argv[1]);
+  }
+  if (max_threads < 1 || max_threads > STRESS_THREAD_MAX) {
+    max_threads = STRESS_THREAD_MAX;
+  }
+  for (t = 1; t <= max_threads; t *= 2) {
+    assert(stress_run(t, 0) == 0);
+    assert(stress_run(t, 64) == 0);
+  }
+  for (t = 1; t <= max_threads; t *= 2) {
+    assert(ring_stress_run(t) == 0);
+  }
+  for (t = 1; t <= max_threads; t *= 2) {
+    assert(lookup_stress_run(t) == 0);
+  }
+  printf("DMA pool stress test OK\n");
+  return 0;
+}